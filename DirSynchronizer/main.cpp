@@ -1,4 +1,5 @@
 #include <chrono>
+#include <ctime>
 #include <iostream>
 #include <filesystem>
 #include <thread>
@@ -10,267 +11,734 @@
 #include <set>
 #include <vector>
 #include <format>
-#include "logger.h"
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <span>
+#include "Logger.h"
+#include "ThreadPool.h"
+#include "Config.h"
+#include "IoScheduler.h"
+#include "CopyEngine.h"
+#include "Metrics.h"
+#include "DirHandleCache.h"
+#include "FilterEngine.h"
+#include "CostModel.h"
+#include "Journal.h"
+#include "DirWatcher.h"
+#include "DirWatcherCallback.h"
+#include "SyncService.h"
+#include "ControlServer.h"
+#include "ReplicaAgent.h"
+#include "RemoteReplica.h"
+#include "ChunkStore.h"
 
 namespace fs = std::filesystem;
 
 
-class DirWatcherCallbackBase
-{
-public:
-    DirWatcherCallbackBase(void) = default;
-    virtual ~DirWatcherCallbackBase(void) = default;
-
-    enum class action_t { CREATE, MODIFY, DELETE, UNEXPECTED_ACTION };
-    enum class file_t { DIRECTORY, REGULAR, UNEXPECTED_FILE };
-
-    static char const* get_action_str(action_t action)
-    {
-        switch (action)
-        {
-        case DirWatcherCallbackBase::action_t::CREATE:
-            return "created";
-        case DirWatcherCallbackBase::action_t::MODIFY:
-            return "modified";
-        case DirWatcherCallbackBase::action_t::DELETE:
-            return "deleted";
-        case DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION:
-            throw std::runtime_error("Unexpected action has been detected");
-        default:
-            return nullptr;
-        }
-    }
-
-    static char const* get_file_str(const file_t file)
-    {
-        switch (file)
-        {
-        case DirWatcherCallbackBase::file_t::DIRECTORY:
-            return "Directory";
-        case DirWatcherCallbackBase::file_t::REGULAR:
-            return "Regular file";
-        case DirWatcherCallbackBase::file_t::UNEXPECTED_FILE:
-            throw std::runtime_error("Action has been detected for unexpected file type");
-        default:
-            return nullptr;
-        }
-    }
-
-    virtual void log(action_t action, file_t file, std::string const& name) const = 0;
-    virtual void report_action(action_t action, file_t file, fs::path const& path, std::string const& directory_path) = 0;
-};
+#ifdef _WIN32
+static std::atomic<bool> stop_requested{ false };
 
-void DirWatcherCallbackBase::log(const action_t action, const file_t file, std::string const& name) const
+// Runs on a thread of its own on Windows; main() wakes up and stops the service.
+void sig_handler(int)
 {
-    std::cout << "The " << get_file_str(file) << " " << name << " has been " << get_action_str(action) << std::endl;
+    stop_requested = true;
+    stop_requested.notify_all();
 }
+#endif
 
-
-class DirWatcher final
+// Matches every path of path_list (one per line, relative, '/'-separated) against the
+// rules of filter_file until at least a few million matches were done.
+int bench_filter(char const* filter_file, char const* path_list)
 {
-    std::set<fs::directory_entry> source_content;
-    std::set<fs::directory_entry> replica_content;
-    std::vector<fs::directory_entry> garbage;
-
-    static constexpr size_t name_len = 1024;
-    static inline DirWatcher* this_ptr = nullptr;
-
-    std::atomic<bool> stop_flag;
-    std::unique_ptr<std::thread> runner;
-
-    std::string source = "Source";
-    std::string replica = "Replica";
-    std::string logfile;
-    size_t synch_interval;
-
-public:
-
-    DirWatcher(std::string source_, std::string replica_, size_t synch_interval_, std::string logfile_path_)
-        : stop_flag(false)
-        , source(std::move(source_))
-        , replica(std::move(replica_))
-        , logfile(std::move(logfile_path_))
-        , synch_interval(synch_interval_)
+    FilterEngine filter;
+    filter.load_file(filter_file);
+    std::ifstream in(path_list);
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(in, line))
     {
-        if (this_ptr)
-            throw std::runtime_error("Only one instance of DirWatcher can be created");
-        this_ptr = this;
+        if (false == line.empty())
+            paths.push_back(line);
     }
-
-    ~DirWatcher(void)
-    {
-        stop_flag = true;
-        runner->join();
-        this_ptr = nullptr;
-    }
-
-    DirWatcher(const DirWatcher&) = delete;
-
-    DirWatcher& operator=(const DirWatcher&) = delete;
-
-    DirWatcher(DirWatcher&&) = delete;
-
-    DirWatcher& operator=(DirWatcher&&) = delete;
-
-    void run(DirWatcherCallbackBase* callback)
+    if (paths.empty())
     {
-        runner.reset(new std::thread(&DirWatcher::run_internal, this, callback));
+        std::cout << "No paths in " << path_list << std::endl;
+        return EXIT_FAILURE;
     }
 
-    void join() const
+    size_t matched = 0;
+    size_t excluded = 0;
+    auto const start = std::chrono::steady_clock::now();
+    while (matched < 4000000)
     {
-        runner->join();
+        for (auto const& path : paths)
+            excluded += filter.is_excluded(path, '/' == path.back()) ? 1 : 0;
+        matched += paths.size();
     }
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << matched << " paths matched in " << seconds << " s (" << seconds * 1e9 / static_cast<double>(matched) << " ns/path, "
+        << static_cast<double>(matched) / seconds / 1e6 << " Mpaths/s), " << excluded * paths.size() / matched << " of " << paths.size() << " excluded" << std::endl;
+    return EXIT_SUCCESS;
+}
 
-    static DirWatcher* get_instance(void)
+// Copies every regular file below source_dir into scratch_dir with the blocking
+// CopyEngine::copy_file on pool threads and with copy_file_async coroutines on the
+// same pool, as many copies in flight as the pool has threads, and prints the
+// throughput of both. Each variant runs twice, only the second (warm cache) run counts.
+int bench_copy(char const* source_dir, char const* scratch_dir)
+{
+    std::vector<fs::path> files;
+    uint64_t bytes = 0;
+    for (auto const& entry : fs::recursive_directory_iterator(source_dir))
     {
-        return DirWatcher::this_ptr;
+        if (entry.is_regular_file())
+        {
+            files.push_back(entry.path());
+            bytes += entry.file_size();
+        }
     }
-
-    static void stop()
+    if (files.empty())
     {
-        if (this_ptr)
-            this_ptr->~DirWatcher();
+        std::cout << "No files in " << source_dir << std::endl;
+        return EXIT_FAILURE;
     }
 
-private:
-
-    void run_internal(DirWatcherCallbackBase* callback)
+    size_t const threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int round = 0; round < 2; ++round)
     {
-        while (false == stop_flag.load(std::memory_order_relaxed))
+        for (bool const coroutines : { false, true })
         {
-            std::this_thread::sleep_for(std::chrono::seconds(synch_interval));
-            for (auto& entry : fs::recursive_directory_iterator(source))
+            fs::path const target = fs::path(scratch_dir) / (coroutines ? "coroutines" : "threads");
+            fs::remove_all(target);
+            fs::create_directories(target);
+
+            CopyEngine::throttle_t unlimited;
+            JobMetrics metrics;
+            CopyEngine engine(unlimited, unlimited, metrics);
+            DirHandleCache cache(target);
+            std::mutex done_mtx;
+            std::condition_variable done_cv;
+            size_t done = 0;
+            size_t failed = 0;
+            std::atomic<size_t> next{ 0 };
+            std::function<void(void)> start_next;
+            // Destroyed first, so that no worker touches the state above afterwards.
+            ThreadPool pool(threads);
+
+            start_next = [&]()
             {
-                auto const file_entry = source_content.find(entry);
-                if (file_entry == source_content.end())
+                size_t const index = next.fetch_add(1);
+                if (index >= files.size())
+                    return;
+                auto finished = [&](bool ok)
                 {
-                    source_content.emplace(entry);
-                    replica_content.emplace(entry);
-                    if (entry.is_regular_file())
                     {
-                        callback->report_action(DirWatcherCallbackBase::action_t::CREATE, DirWatcherCallbackBase::file_t::REGULAR,
-                            entry.path(), replica);
+                        std::lock_guard<std::mutex> lock(done_mtx);
+                        ++done;
+                        failed += ok ? 0 : 1;
                     }
-                    else if (entry.is_directory())
+                    done_cv.notify_all();
+                    start_next();
+                };
+                fs::path const relative = files[index].lexically_relative(source_dir);
+                pool.submit(0, [&, index, relative, finished]()
+                {
+                    if (coroutines)
                     {
-                        callback->report_action(DirWatcherCallbackBase::action_t::CREATE, DirWatcherCallbackBase::file_t::DIRECTORY,
-                            entry.path(), replica);
+                        engine.copy_file_async(files[index], cache, relative, pool, 0).start([finished](std::exception_ptr error) { finished(nullptr == error); });
+                        return;
                     }
-                }
-                else if (entry.last_write_time() > file_entry->last_write_time())
-                {
-                    if (entry.is_regular_file())
+                    bool ok = true;
+                    try
                     {
-                        callback->report_action(DirWatcherCallbackBase::action_t::MODIFY, DirWatcherCallbackBase::file_t::REGULAR,
-                            entry.path(), replica);
+                        engine.copy_file(files[index], cache, relative);
                     }
-                    else if (entry.is_directory())
+                    catch (std::exception const&)
                     {
-                        callback->report_action(DirWatcherCallbackBase::action_t::MODIFY, DirWatcherCallbackBase::file_t::DIRECTORY,
-                            entry.path(), replica);
+                        ok = false;
                     }
-                }
+                    finished(ok);
+                });
+            };
+
+            auto const start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < threads; ++i)
+                start_next();
+            {
+                std::unique_lock<std::mutex> lock(done_mtx);
+                done_cv.wait(lock, [&] { return done == files.size(); });
+            }
+            double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (1 == round)
+            {
+                std::cout << (coroutines ? "coroutines:  " : "thread pool: ") << files.size() << " files, " << bytes << " bytes in " << seconds << " s ("
+                    << static_cast<double>(bytes) / seconds / (1 << 20) << " MiB/s, " << static_cast<double>(files.size()) / seconds << " files/s)";
+                if (0 != failed)
+                    std::cout << ", " << failed << " failed";
+                std::cout << std::endl;
             }
+        }
+    }
+    fs::remove_all(fs::path(scratch_dir) / "threads");
+    fs::remove_all(fs::path(scratch_dir) / "coroutines");
+    return EXIT_SUCCESS;
+}
+
+// Sends every regular file below source_dir to ReplicaAgents serving agent_dir on
+// loopback: waiting for each file before the next one goes out, pipelined (all files
+// back to back, then all replies) with the zero-copy paths and with plain read/write
+// on both ends, zstd-compressed when built with zstd, and pipelined as deltas against
+// the copies the agent got, which sends only block hashes. The same files are also copied with CopyEngine::copy_file into
+// scratch_dir; pointing that at an NFS or FUSE mount compares the protocol with
+// copying to a network file system. CPU time is that of the whole process, client
+// and agent together. Each variant runs twice, only the second run counts.
+int bench_remote(char const* source_dir, char const* scratch_dir, char const* agent_dir)
+{
+    class null_sink_t final : public LogSink
+    {
+        virtual void write(severity_t, char const*, size_t, std::string const&) override
+        {
+        }
+    };
+
+    enum class mode_t { LOCAL, PER_FILE, PIPELINED, DELTA };
+
+    std::vector<fs::path> files;
+    std::vector<fs::path> relatives;
+    uint64_t bytes = 0;
+    for (auto const& entry : fs::recursive_directory_iterator(source_dir))
+    {
+        if (entry.is_regular_file())
+        {
+            files.push_back(entry.path());
+            relatives.push_back(entry.path().lexically_relative(source_dir));
+            bytes += entry.file_size();
+        }
+    }
+    if (files.empty())
+    {
+        std::cout << "No files in " << source_dir << std::endl;
+        return EXIT_FAILURE;
+    }
 
-            for (auto& entry : source_content)
+    null_sink_t sink;
+    Logger::scope_t const log_scope(&sink);
+    fs::path const target = fs::path(scratch_dir) / "local";
+    fs::remove_all(target);
+    // Agents sharing a folder would each cache descriptors of directories the other removed.
+    ReplicaAgent agent(fs::path(agent_dir) / "zero-copy", "127.0.0.1:0");
+    ReplicaAgent plain_agent(fs::path(agent_dir) / "read-write", "127.0.0.1:0", 4, false);
+    RemoteReplica remote(std::string(RemoteReplica::scheme) + "127.0.0.1:" + std::to_string(agent.get_port()));
+    RemoteReplica plain_remote(std::string(RemoteReplica::scheme) + "127.0.0.1:" + std::to_string(plain_agent.get_port()), false);
+    Compressor::settings_t compression;
+    compression.enabled = Compressor::available;
+    RemoteReplica compressed_remote(std::string(RemoteReplica::scheme) + "127.0.0.1:" + std::to_string(agent.get_port()), true, compression);
+    CopyEngine::throttle_t unlimited;
+
+    struct variant_t
+    {
+        char const* name;
+        mode_t mode;
+        RemoteReplica* remote;
+    };
+    std::vector<variant_t> variants = {
+        { "local copy:             ", mode_t::LOCAL, nullptr },
+        { "remote per file:        ", mode_t::PER_FILE, &remote },
+        { "remote pipelined:       ", mode_t::PIPELINED, &remote },
+        { "remote read/write:      ", mode_t::PIPELINED, &plain_remote } };
+    if (Compressor::available)
+        variants.push_back({ "remote zstd, auto level:", mode_t::PIPELINED, &compressed_remote });
+    variants.push_back({ "remote delta, unchanged:", mode_t::DELTA, &remote });
+
+    for (int round = 0; round < 2; ++round)
+    {
+        for (auto const& variant : variants)
+        {
+            JobMetrics metrics;
+            CopyEngine engine(unlimited, unlimited, metrics);
+            if (mode_t::LOCAL == variant.mode)
+                fs::remove_all(target);
+            else if (mode_t::DELTA != variant.mode)
+                variant.remote->remove_tree("remote", false);
+
+            uint64_t const sent_before = variant.remote ? variant.remote->get_bytes_sent() : 0;
+            std::clock_t const cpu_start = std::clock();
+            auto const start = std::chrono::steady_clock::now();
+            if (mode_t::LOCAL == variant.mode)
+            {
+                DirHandleCache cache(target);
+                for (size_t i = 0; i < files.size(); ++i)
+                    engine.copy_file(files[i], cache, relatives[i]);
+            }
+            else if (mode_t::PER_FILE == variant.mode)
+            {
+                for (size_t i = 0; i < files.size(); ++i)
+                    variant.remote->send_file(files[i], fs::path("remote") / relatives[i], engine, false);
+            }
+            else
             {
-                if (replica_content.contains(entry) && false == fs::exists(entry))
+                bool const delta = mode_t::DELTA == variant.mode;
+                std::vector<RemoteReplica::pending_t> pending;
+                // Signatures are fetched a batch at a time, like a job with batch_size does.
+                for (size_t first = 0; first < files.size(); first += 256)
                 {
-                    if (entry.is_regular_file())
-                    {
-                        callback->report_action(DirWatcherCallbackBase::action_t::DELETE, DirWatcherCallbackBase::file_t::REGULAR,
-                            entry.path(), replica);
-                    }
-                    else if (entry.is_directory())
-                    {
-                        callback->report_action(DirWatcherCallbackBase::action_t::DELETE, DirWatcherCallbackBase::file_t::DIRECTORY,
-                            entry.path(), replica);
-                    }
-                    garbage.push_back(entry);
+                    size_t const last = std::min(files.size(), first + 256);
+                    std::vector<fs::path> paths;
+                    for (size_t i = first; i < last; ++i)
+                        paths.push_back(fs::path("remote") / relatives[i]);
+                    std::vector<RemoteReplica::signature_t> const signatures = delta ? variant.remote->signatures(paths) : std::vector<RemoteReplica::signature_t>{};
+                    for (size_t i = first; i < last; ++i)
+                        pending.push_back(variant.remote->post_file(files[i], paths[i - first], engine, delta ? &signatures[i - first] : nullptr));
                 }
+                variant.remote->wait_all(pending);
             }
-            for (auto& elem : garbage)
+            double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double const cpu_seconds = static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+            if (1 == round)
             {
-                source_content.erase(elem);
+                std::cout << variant.name << " " << files.size() << " files, " << bytes << " bytes in " << seconds << " s ("
+                    << static_cast<double>(bytes) * 8 / seconds / 1e9 << " Gbit/s, " << static_cast<double>(files.size()) / seconds << " files/s, "
+                    << cpu_seconds / (static_cast<double>(bytes) / 1e9) << " CPU s/GB), " << metrics.bytes_copied.load() << " bytes transferred";
+                if (variant.remote)
+                    std::cout << ", " << variant.remote->get_bytes_sent() - sent_before << " on the wire";
+                std::cout << std::endl;
             }
-            garbage.clear();
         }
     }
-};
+    fs::remove_all(target);
+    fs::remove_all(fs::path(agent_dir) / "zero-copy");
+    fs::remove_all(fs::path(agent_dir) / "read-write");
+    return EXIT_SUCCESS;
+}
 
-class DirWatcherCallback final : public DirWatcherCallbackBase
+// Puts every regular file below source_dir into a chunk store in scratch_dir, twice:
+// the first round stores the data, the second finds every chunk already there, so it
+// shows the cost of chunking and hashing alone.
+int bench_dedup(char const* source_dir, char const* scratch_dir)
 {
-    static std::string get_filename(const std::string& str)
+    std::vector<fs::path> files;
+    for (auto const& entry : fs::recursive_directory_iterator(source_dir))
+    {
+        if (entry.is_regular_file())
+            files.push_back(entry.path());
+    }
+    if (files.empty())
+    {
+        std::cout << "No files in " << source_dir << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    fs::path const target = fs::path(scratch_dir) / "dedup";
+    fs::remove_all(target);
+    for (char const* name : { "first put: ", "second put:" })
     {
-        const int elem = str.rfind('/');
-        return str.substr(elem + 1, str.size());
+        ChunkStore store(target);
+        DirHandleCache cache(ChunkStore::files_path(target));
+        CopyEngine::throttle_t unlimited;
+        JobMetrics metrics;
+        CopyEngine engine(unlimited, unlimited, metrics);
+        auto const start = std::chrono::steady_clock::now();
+        for (auto const& file : files)
+            store.put_file(file, cache, file.lexically_relative(source_dir), engine);
+        double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ChunkStore::stats_t const stats = store.get_stats();
+        std::cout << name << " " << files.size() << " files, " << stats.logical_bytes << " bytes in " << seconds << " s ("
+            << static_cast<double>(stats.logical_bytes) / seconds / (1 << 20) << " MiB/s, chunking " << stats.chunking_rate() / (1 << 20) << " MiB/s), "
+            << stats.chunks << " chunks (" << stats.new_chunks << " new, average " << (0 == stats.chunks ? 0 : stats.logical_bytes / stats.chunks)
+            << " bytes), dedup ratio " << stats.dedup_ratio() << std::endl;
     }
+    fs::remove_all(target);
+    return EXIT_SUCCESS;
+}
 
-    virtual void report_action(const action_t action, const file_t file, fs::path const& path, const std::string& directory_path) override
+// Rebuilds `path` (a file or folder, "." for everything) of the chunk store in
+// store_dir at target.
+int restore(char const* store_dir, char const* path, char const* target)
+{
+    try
+    {
+        ChunkStore(store_dir).restore(std::string(".") == path ? fs::path() : fs::path(path), target);
+    }
+    catch (std::exception const& e)
     {
-        if ((action == DirWatcherCallback::action_t::CREATE
-            || action == DirWatcherCallback::action_t::MODIFY)
-            && file == DirWatcherCallback::file_t::REGULAR)
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Removes chunks no manifest refers to. The job writing to the store must not run.
+int collect_garbage(char const* store_dir)
+{
+    try
+    {
+        uint64_t const freed = ChunkStore(store_dir).collect_garbage();
+        std::cout << freed << " bytes freed" << std::endl;
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Serves replica_dir to jobs whose replica is tcp://<host>:<port> until SIGINT or
+// SIGTERM.
+int run_agent(char const* replica_dir, char const* endpoint, char const* log_file)
+{
+#ifndef _WIN32
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    Logger logger(log_file, false, false, false);
+    try
+    {
+        ReplicaAgent agent(replica_dir, endpoint);
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Serving %s on port %u", replica_dir, static_cast<unsigned>(agent.get_port()));
+        int sig = 0;
+        sigwait(&signals, &sig);
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Signal %d received, shutting down", sig);
+    }
+    catch (std::exception const& e)
+    {
+        Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "%s", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+#else
+    (void)replica_dir;
+    (void)endpoint;
+    (void)log_file;
+    std::cerr << "The replica agent is only supported on POSIX systems" << std::endl;
+    return EXIT_FAILURE;
+#endif
+}
+
+// Runs the scan and diff of the first cycle of every job and prints the operations it
+// would issue with the predicted cost, without touching any replica. File operations
+// are spread over as many threads as the copy pool and the replica device allow,
+// bytes are assumed to flow at the measured single-stream throughput and the
+// bandwidth and IOPS limits in effect right now bound the result from below. Costs
+// are measured next to every local replica; replica agents and dedup stores aren't
+// probed, their jobs are only bounded by those limits.
+int plan(SyncConfig const& config)
+{
+    using action_t = DirWatcherCallbackBase::action_t;
+    using file_t = DirWatcherCallbackBase::file_t;
+    using pending_action_t = DirWatcher::pending_action_t;
+
+    struct job_plan_t
+    {
+        std::vector<std::pair<pending_action_t, bool>> actions;
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        uint64_t dirs = 0;
+        uint64_t renames = 0;
+        uint64_t deletes = 0;
+        uint64_t metadata = 0;
+        uint64_t special = 0;
+        std::vector<fs::path> samples;
+    };
+
+    // Applies nothing; only answers the quick check of a local replica, so files the
+    // cycle would skip as unchanged are left out of the plan too.
+    class plan_callback_t final : public DirWatcherCallbackBase
+    {
+        DirHandleCache replica;
+
+    public:
+
+        explicit plan_callback_t(fs::path const& replica_)
+            : replica(replica_)
+        {
+        }
+
+        virtual void log(action_t, file_t, std::string const&) const override
         {
-            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), get_filename(path.generic_string()).c_str(), (" | " + path.generic_string()).c_str());
-            fs::copy_file(path, directory_path + "/" + get_filename(path.generic_string()), fs::copy_options::overwrite_existing);
         }
-        else if (action == DirWatcherCallback::action_t::DELETE && file == DirWatcherCallback::file_t::REGULAR)
+
+        virtual void report_action(action_t, file_t, fs::path const&, fs::path const&, std::string const&) override
         {
-            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been deleted from Replica%s", get_file_str(file), get_filename(path.generic_string()).c_str(), (" | " + path.generic_string()).c_str());
-            fs::remove(directory_path + "/" + get_filename(path.generic_string()));
+            throw std::logic_error("The planner doesn't apply operations");
         }
-        else if ((action == DirWatcherCallback::action_t::CREATE
-            || action == DirWatcherCallback::action_t::MODIFY)
-            && file == DirWatcherCallback::file_t::DIRECTORY)
+
+        virtual bool is_in_sync(fs::path const& relative, FileInfo const& info) override
         {
-            fs::copy(path, directory_path + "/" + get_filename(path.generic_string()), fs::copy_options::overwrite_existing |
-                fs::copy_options::recursive);
-            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), get_filename(path.generic_string()).c_str(), (" | " + path.generic_string()).c_str());
+            return DirWatcherCallback::matches(replica, relative, info);
         }
-        else if ((action == DirWatcherCallback::action_t::DELETE && file == DirWatcherCallback::file_t::DIRECTORY))
+    };
+
+    auto const get_op_str = [](pending_action_t const& action) -> char const*
+    {
+        switch (action.action)
         {
-            fs::remove_all(directory_path + "/" + get_filename(path.generic_string()));
-            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been deleted from Replica%s", get_file_str(file), get_filename(path.generic_string()).c_str(), (" | " + path.generic_string()).c_str());
+        case action_t::CREATE:
+            return file_t::DIRECTORY == action.file ? "mkdir" : file_t::SYMLINK == action.file ? "symlink" : file_t::SPECIAL == action.file ? "mknod" : "copy";
+        case action_t::MODIFY:
+            return "update";
+        case action_t::DELETE:
+            return file_t::DIRECTORY == action.file ? "rmtree" : "unlink";
+        case action_t::RENAME:
+            return "rename";
+        case action_t::METADATA:
+            return "attrs";
+        default:
+            return "?";
         }
+    };
+
+    std::vector<job_plan_t> plans(config.jobs.size());
+    for (size_t id = 0; id < config.jobs.size(); ++id)
+    {
+        JobConfig const& job = config.jobs[id];
+        job_plan_t& job_plan = plans[id];
+        JobMetrics metrics;
+        // Replica agents and dedup stores aren't looked at, like in the cost measurement.
+        std::unique_ptr<plan_callback_t> callback;
+        if (false == job.dedup && 0 != job.replica.rfind("tcp://", 0))
+            callback = std::make_unique<plan_callback_t>(job.snapshots.keep > 0 ? SnapshotManager::current_path(job.replica) : fs::path(job.replica));
+        DirWatcher watcher(job, callback.get(), metrics);
+        if (false == job.journal.empty())
+            watcher.restore(Journal(job.journal).load());
+        watcher.plan_cycle([&](pending_action_t const& action, bool is_inline)
+        {
+            job_plan.actions.emplace_back(action, is_inline);
+            if (action_t::RENAME == action.action)
+                ++job_plan.renames;
+            else if (action_t::DELETE == action.action)
+                ++job_plan.deletes;
+            else if (action_t::METADATA == action.action)
+                ++job_plan.metadata;
+            else if (file_t::DIRECTORY == action.file)
+                ++job_plan.dirs;
+            else if (file_t::REGULAR != action.file)
+                ++job_plan.special;
+            else
+            {
+                ++job_plan.files;
+                job_plan.bytes += action.info.size;
+                job_plan.samples.push_back(fs::path(job.source) / action.relative);
+            }
+        });
     }
 
-    virtual void log(const action_t action, const file_t file, std::string const& name) const override
+
+    double total_s = 0;
+    for (size_t id = 0; id < config.jobs.size(); ++id)
     {
-        if (DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION == action && DirWatcherCallbackBase::file_t::UNEXPECTED_FILE == file)
-            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for unexpected file type: %s", name.c_str());
-        else if (DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION == action)
-            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for %s %s", get_file_str(file), name.c_str());
-        else if (DirWatcherCallbackBase::file_t::UNEXPECTED_FILE == file)
-            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected file %s has been %s", name.c_str(), get_action_str(action));
+        JobConfig const& job = config.jobs[id];
+        job_plan_t const& job_plan = plans[id];
+        std::cout << "Job " << job.name << ": " << job.source << " -> " << job.replica << std::endl;
+
+        bool const is_local = false == job.dedup && 0 != job.replica.rfind("tcp://", 0);
+        CostModel const cost = is_local ? CostModel::measure(job.replica, job_plan.samples) : CostModel();
+
+        double inline_ns = 0;
+        double file_ns = 0;
+        for (auto const& [action, is_inline] : job_plan.actions)
+        {
+            char const* const priority = is_inline ? "-" : IoScheduler::get_priority_str(action.priority);
+            std::cout << "  " << get_op_str(action) << "\t" << priority << "\t";
+            if (action_t::RENAME == action.action)
+                std::cout << "-\t" << action.old_relative.generic_string() << " -> " << action.relative.generic_string() << std::endl;
+            else if (file_t::REGULAR == action.file && action_t::DELETE != action.action && action_t::METADATA != action.action)
+                std::cout << action.info.size << "\t" << action.relative.generic_string() << std::endl;
+            else
+                std::cout << "-\t" << action.relative.generic_string() << std::endl;
+
+            // A metadata update costs about as much as a rename: a few inode updates. Links
+            // and device nodes are, like directories, inodes without data.
+            double const op_ns = action_t::RENAME == action.action || action_t::METADATA == action.action ? cost.rename_ns
+                : action_t::DELETE == action.action ? cost.remove_ns
+                : file_t::REGULAR != action.file ? cost.dir_ns
+                : cost.file_ns;
+            (is_inline ? inline_ns : file_ns) += op_ns;
+        }
+
+        uint64_t const replica_dev = is_local ? FileInfo::get(job.replica).dev : 0;
+        uint64_t const source_dev = FileInfo::get(job.source).dev;
+        size_t const parallelism = std::min({ config.copy_threads,
+            IoScheduler::get_device_limit(replica_dev, config.io_limits), IoScheduler::get_device_limit(source_dev, config.io_limits) });
+        double foreground_s = (file_ns / static_cast<double>(std::max<size_t>(1, parallelism))
+            + static_cast<double>(job_plan.bytes) * cost.byte_ns) / 1e9;
+
+        auto const effective_rate = [](uint64_t global_rate, std::vector<TokenBucket::window_t> const& global_schedule,
+            uint64_t job_rate, std::vector<TokenBucket::window_t> const& job_schedule)
+        {
+            TokenBucket global_bucket;
+            TokenBucket job_bucket;
+            global_bucket.set_rate(global_rate);
+            global_bucket.set_schedule(global_schedule);
+            job_bucket.set_rate(job_rate);
+            job_bucket.set_schedule(job_schedule);
+            uint64_t const a = global_bucket.get_rate();
+            uint64_t const b = job_bucket.get_rate();
+            return 0 == a ? b : 0 == b ? a : std::min(a, b);
+        };
+        uint64_t const bandwidth = effective_rate(config.throttle.bandwidth, config.throttle.bandwidth_schedule, job.throttle.bandwidth, job.throttle.bandwidth_schedule);
+        uint64_t const iops = effective_rate(config.throttle.iops, config.throttle.iops_schedule, job.throttle.iops, job.throttle.iops_schedule);
+        if (0 != bandwidth)
+            foreground_s = std::max(foreground_s, static_cast<double>(job_plan.bytes) / static_cast<double>(bandwidth));
+        if (0 != iops)
+            foreground_s = std::max(foreground_s, static_cast<double>(job_plan.actions.size()) / static_cast<double>(iops));
+        double const job_s = inline_ns / 1e9 + foreground_s;
+        total_s += job_s;
+
+        std::cout << "Job " << job.name << ": " << job_plan.files << " files (" << job_plan.bytes << " bytes) to copy, "
+            << job_plan.dirs << " directories and " << job_plan.special << " links or special files to create, " << job_plan.renames << " renames, " << job_plan.deletes << " deletions, "
+            << job_plan.metadata << " metadata updates, estimated "
+            << job_s << " s" << std::endl;
+        if (is_local)
+            std::cout << "Job " << job.name << " measured costs: file " << cost.file_ns / 1e3 << " us, directory " << cost.dir_ns / 1e3 << " us, rename "
+                << cost.rename_ns / 1e3 << " us, remove " << cost.remove_ns / 1e3 << " us, throughput "
+                << (cost.byte_ns > 0 ? 1e9 / cost.byte_ns / (1 << 20) : 0.0) << " MiB/s" << std::endl;
         else
-            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been %s", get_file_str(file), name.c_str(), get_action_str(action));
+            std::cout << "Job " << job.name << " costs not measured (" << (job.dedup ? "dedup store" : "replica agent")
+                << "), estimate only bounded by the bandwidth and IOPS limits" << std::endl;
     }
-};
-
 
+    std::cout << "Estimated total: " << total_s << " s (directory deletions counted as one removal each)" << std::endl;
+    return EXIT_SUCCESS;
+}
 
-void sig_handler(int sig)
+// Loads `filename` into `config`; prints what is wrong with it and returns false if
+// it can't be used.
+bool load_config(char const* filename, SyncConfig& config)
 {
-    DirWatcher::stop();
-    exit(EXIT_SUCCESS);
+    try
+    {
+        config = SyncConfig::load(filename);
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
 }
 
 int main(const int argc, char* argv[])
 {
-    Logger logger(argv[4], false, false, false);
+    if (4 == argc && std::string("--bench-filter") == argv[1])
+        return bench_filter(argv[2], argv[3]);
 
-    if (5 != argc)
+    if (4 == argc && std::string("--bench-copy") == argv[1])
+        return bench_copy(argv[2], argv[3]);
+
+    if (5 == argc && std::string("--bench-remote") == argv[1])
+        return bench_remote(argv[2], argv[3], argv[4]);
+
+    if (4 == argc && std::string("--bench-dedup") == argv[1])
+        return bench_dedup(argv[2], argv[3]);
+
+    if (5 == argc && std::string("--agent") == argv[1])
+        return run_agent(argv[2], argv[3], argv[4]);
+
+    if (5 == argc && std::string("--restore") == argv[1])
+        return restore(argv[2], argv[3], argv[4]);
+
+    if (3 == argc && std::string("--collect-garbage") == argv[1])
+        return collect_garbage(argv[2]);
+
+    if (4 <= argc && std::string("--control") == argv[1])
+    {
+        std::string command;
+        for (int i = 3; i < argc; ++i)
+            command += std::string(3 == i ? "" : " ") + argv[i];
+        try
+        {
+            std::cout << ControlServer::request(argv[2], command);
+        }
+        catch (std::exception const& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (4 == argc && std::string("--plan") == argv[1])
+    {
+        SyncConfig config;
+        if (std::string("--config") == argv[2])
+        {
+            if (false == load_config(argv[3], config))
+                return EXIT_FAILURE;
+        }
+        else
+        {
+            JobConfig& job = config.jobs.emplace_back();
+            job.name = "default";
+            job.source = argv[2];
+            job.replica = argv[3];
+        }
+        return plan(config);
+    }
+
+    bool const config_mode = 4 == argc && std::string("--config") == argv[1];
+    if (5 != argc && false == config_mode)
     {
         std::cout << "Few arguments | 1. Source folder path | 2. Replica folder path | 3. Synchronization interval | 4. Log file path and log filename" << std::endl;
+        std::cout << "          or | --config <config file> <log file path and log filename>" << std::endl;
+        std::cout << "          or | --plan <source folder path> <replica folder path>" << std::endl;
+        std::cout << "          or | --plan --config <config file>" << std::endl;
+        std::cout << "          or | --agent <replica folder path> <[address:]port> <log file path and log filename>" << std::endl;
+        std::cout << "          or | --restore <chunk store folder path> <path in the store or .> <target path>" << std::endl;
+        std::cout << "          or | --collect-garbage <chunk store folder path>" << std::endl;
+        std::cout << "          or | --control <control socket> <scan <job> [subtree] | scan <path> | pause [job] | resume [job] | throttle <job | global> [bandwidth=<rate>] [iops=<rate>] | stats>" << std::endl;
+        std::cout << "          or | --bench-filter <filter file> <file with one relative path per line>" << std::endl;
+        std::cout << "          or | --bench-copy <source folder path> <scratch folder path>" << std::endl;
+        std::cout << "          or | --bench-remote <source folder path> <scratch folder path> <agent folder path>" << std::endl;
+        std::cout << "          or | --bench-dedup <source folder path> <scratch folder path>" << std::endl;
         exit(EXIT_FAILURE);
     }
-    signal(SIGINT, sig_handler);
 
-    DirWatcher watcher(argv[1], argv[2], std::atoi(argv[3]), argv[4]);
-    DirWatcherCallback cb;
-    watcher.run(&cb);
-    watcher.join();
+    SyncConfig config;
+    if (config_mode && false == load_config(argv[2], config))
+        return EXIT_FAILURE;
+
+    Logger logger(config_mode ? argv[3] : argv[4], false, false, false);
+
+    if (false == config_mode)
+    {
+        config.scanner_threads = 1;
+        JobConfig& job = config.jobs.emplace_back();
+        job.name = "default";
+        job.source = argv[1];
+        job.replica = argv[2];
+        job.synch_interval = static_cast<size_t>(std::atoi(argv[3]));
+    }
+
+    // On POSIX systems SIGINT and SIGTERM are blocked in every thread and picked up
+    // with sigwait() below, so the shutdown runs in normal context.
+#ifndef _WIN32
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#else
+    signal(SIGINT, sig_handler);
+#endif
+
+    SyncService service(config, logger);
+    service.start();
+#ifndef _WIN32
+    int sig = 0;
+    sigwait(&signals, &sig);
+    Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Signal %d received, shutting down", sig);
+#else
+    stop_requested.wait(false);
+#endif
+    service.stop();
     return 0;
-}
\ No newline at end of file
+}
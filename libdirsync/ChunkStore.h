@@ -0,0 +1,454 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <span>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
+#include <algorithm>
+#include <system_error>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include "Sha256.h"
+#include "CopyEngine.h"
+#include "DeleteEngine.h"
+#include "DirHandleCache.h"
+
+
+// Deduplicating replica. Files are cut into content-defined chunks and every distinct
+// chunk is stored once, named by its SHA-256, below chunks/. The folder a job syncs
+// into is files/, where every file is replaced by a manifest listing its chunks, so
+// directories, renames and deletes work exactly as in a plain replica; a new version
+// of a large file only adds the chunks around its changes. restore() rebuilds files,
+// collect_garbage() drops chunks no manifest refers to any more.
+class ChunkStore final
+{
+public:
+
+    static constexpr size_t min_chunk = 16 << 10;
+    static constexpr size_t average_chunk = 64 << 10;
+    static constexpr size_t max_chunk = 256 << 10;
+
+    struct stats_t
+    {
+        // Bytes of all files put, and the part of them that were new chunks.
+        uint64_t logical_bytes = 0;
+        uint64_t stored_bytes = 0;
+        uint64_t chunks = 0;
+        uint64_t new_chunks = 0;
+        uint64_t chunking_ns = 0;
+
+        double dedup_ratio(void) const
+        {
+            return 0 == stored_bytes ? 0.0 : static_cast<double>(logical_bytes) / static_cast<double>(stored_bytes);
+        }
+
+        // Throughput of the cut point search alone, in bytes per second.
+        double chunking_rate(void) const
+        {
+            return 0 == chunking_ns ? 0.0 : static_cast<double>(logical_bytes) * 1e9 / static_cast<double>(chunking_ns);
+        }
+    };
+
+    // FastCDC (Xia et al., USENIX ATC 2016) with normalized chunking: up to the average
+    // size a cut point needs two more zero bits than after it, which keeps chunk sizes
+    // close to the average. As in the 2020 revision two bytes are rolled per step, with
+    // the first one through a pre-shifted gear table, which saves a shift per byte.
+    class chunker_t
+    {
+        static constexpr std::array<uint64_t, 256> make_gear(int shift)
+        {
+            std::array<uint64_t, 256> table{};
+            uint64_t state = 0x2545f4914f6cdd1d;
+            for (auto& entry : table)
+            {
+                // splitmix64
+                state += 0x9e3779b97f4a7c15;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                entry = (z ^ (z >> 31)) << shift;
+            }
+            return table;
+        }
+
+        // `bits` ones spread over bits 16 to 62, so a cut depends on a window of more
+        // than 16 bytes. Bit 63 stays clear for the shifted masks.
+        static constexpr uint64_t make_mask(int bits)
+        {
+            uint64_t mask = 0;
+            for (int i = 0; i < bits; ++i)
+                mask |= uint64_t(1) << (62 - i * 46 / bits);
+            return mask;
+        }
+
+    public:
+
+        // Length of the chunk at the start of `data`; all of it when `size` doesn't
+        // exceed min_chunk.
+        static size_t cut(uint8_t const* data, size_t size)
+        {
+            static constexpr std::array<uint64_t, 256> gear = make_gear(0);
+            static constexpr std::array<uint64_t, 256> gear_shifted = make_gear(1);
+            // average_chunk is 2^16.
+            static constexpr uint64_t mask_small = make_mask(18);
+            static constexpr uint64_t mask_large = make_mask(14);
+
+            if (size <= min_chunk)
+                return size;
+            size_t const normal = std::min(size, average_chunk);
+            size_t const end = std::min(size, max_chunk);
+            uint64_t fingerprint = 0;
+            size_t i = min_chunk;
+            for (; i + 1 < normal; i += 2)
+            {
+                fingerprint = (fingerprint << 2) + gear_shifted[data[i]];
+                if (0 == (fingerprint & (mask_small << 1)))
+                    return i + 1;
+                fingerprint += gear[data[i + 1]];
+                if (0 == (fingerprint & mask_small))
+                    return i + 2;
+            }
+            for (; i + 1 < end; i += 2)
+            {
+                fingerprint = (fingerprint << 2) + gear_shifted[data[i]];
+                if (0 == (fingerprint & (mask_large << 1)))
+                    return i + 1;
+                fingerprint += gear[data[i + 1]];
+                if (0 == (fingerprint & mask_large))
+                    return i + 2;
+            }
+            return end;
+        }
+    };
+
+private:
+
+    struct entry_t
+    {
+        Sha256::digest_t digest;
+        uint32_t length;
+    };
+
+    struct manifest_t
+    {
+        uint64_t size = 0;
+        std::vector<entry_t> entries;
+    };
+
+    struct digest_hash_t
+    {
+        size_t operator()(Sha256::digest_t const& digest) const
+        {
+            size_t hash;
+            std::memcpy(&hash, digest.data(), sizeof(hash));
+            return hash;
+        }
+    };
+
+    static constexpr char manifest_magic[4] = { 'D', 'S', 'C', 'M' };
+    static constexpr uint32_t manifest_version = 1;
+    // Suffix of manifests and chunks being written, renamed into place when complete.
+    static constexpr char const* part_suffix = ".dirsync-part";
+
+    std::filesystem::path const root;
+    std::filesystem::path const chunks_root;
+    std::atomic<uint64_t> part_counter{ 0 };
+    std::atomic<uint64_t> logical_bytes{ 0 };
+    std::atomic<uint64_t> stored_bytes{ 0 };
+    std::atomic<uint64_t> chunks{ 0 };
+    std::atomic<uint64_t> new_chunks{ 0 };
+    std::atomic<uint64_t> chunking_ns{ 0 };
+
+public:
+
+    static std::filesystem::path files_path(std::filesystem::path const& root)
+    {
+        return root / "files";
+    }
+
+    explicit ChunkStore(std::filesystem::path root_)
+        : root(std::move(root_))
+        , chunks_root(root / "chunks")
+    {
+        static char const digits[] = "0123456789abcdef";
+        std::filesystem::create_directories(files_path(root));
+        for (int i = 0; i < 256; ++i)
+            std::filesystem::create_directories(chunks_root / std::string{ digits[i >> 4], digits[i & 15] });
+    }
+
+    ChunkStore(const ChunkStore&) = delete;
+
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    stats_t get_stats(void) const
+    {
+        return { logical_bytes.load(std::memory_order_relaxed), stored_bytes.load(std::memory_order_relaxed), chunks.load(std::memory_order_relaxed),
+            new_chunks.load(std::memory_order_relaxed), chunking_ns.load(std::memory_order_relaxed) };
+    }
+
+    // Chunks `from` into the store and writes its manifest to `relative` below `files`,
+    // which is rooted at files_path(). Reads are throttled like a copy; the metrics
+    // count the bytes of new chunks.
+    void put_file(std::filesystem::path const& from, DirHandleCache& files, std::filesystem::path const& relative, CopyEngine& engine)
+    {
+        std::ifstream in(from, std::ios::binary);
+        if (false == in.is_open())
+            throw std::filesystem::filesystem_error("Can't open source file", from, std::error_code(errno, std::generic_category()));
+
+        std::vector<char> buffer(4 * CopyEngine::chunk_size);
+        size_t begin = 0;
+        size_t end = 0;
+        bool eof = false;
+        manifest_t manifest;
+        uint64_t stored = 0;
+        uint64_t cutting_ns = 0;
+        while (true)
+        {
+            if (engine.is_cancelled())
+                throw std::filesystem::filesystem_error("Copy cancelled", from, std::make_error_code(std::errc::operation_canceled));
+            // A cut point is only final with max_chunk bytes ahead or at the end.
+            while (false == eof && end - begin < max_chunk)
+            {
+                if (buffer.size() - end < max_chunk)
+                {
+                    std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+                in.read(buffer.data() + end, static_cast<std::streamsize>(buffer.size() - end));
+                if (in.bad())
+                    throw std::filesystem::filesystem_error("Can't read source file", from, std::make_error_code(std::errc::io_error));
+                size_t const n = static_cast<size_t>(in.gcount());
+                engine.throttle_bytes(n);
+                end += n;
+                eof = in.eof() || 0 == n;
+            }
+            if (begin == end)
+                break;
+
+            auto const start = std::chrono::steady_clock::now();
+            size_t const length = chunker_t::cut(reinterpret_cast<uint8_t const*>(buffer.data() + begin), end - begin);
+            cutting_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            std::span<char const> const chunk(buffer.data() + begin, length);
+            entry_t const& entry = manifest.entries.emplace_back(entry_t{ Sha256::hash(chunk.data(), chunk.size()), static_cast<uint32_t>(length) });
+            stored += store_chunk(entry.digest, chunk);
+            manifest.size += length;
+            begin += length;
+        }
+        write_manifest(files, relative, manifest);
+
+        logical_bytes.fetch_add(manifest.size, std::memory_order_relaxed);
+        stored_bytes.fetch_add(stored, std::memory_order_relaxed);
+        chunks.fetch_add(manifest.entries.size(), std::memory_order_relaxed);
+        chunking_ns.fetch_add(cutting_ns, std::memory_order_relaxed);
+        JobMetrics& metrics = engine.get_metrics();
+        metrics.files_copied.fetch_add(1, std::memory_order_relaxed);
+        metrics.bytes_copied.fetch_add(stored, std::memory_order_relaxed);
+    }
+
+    // Rebuilds `relative` below files/, a file or a whole directory, at `target`. Every
+    // chunk is verified against its hash on the way.
+    void restore(std::filesystem::path const& relative, std::filesystem::path const& target) const
+    {
+        std::filesystem::path const source = files_path(root) / relative;
+        if (false == std::filesystem::is_directory(source))
+        {
+            restore_file(source, target);
+            return;
+        }
+        std::filesystem::create_directories(target);
+        for (auto it = std::filesystem::recursive_directory_iterator(source); it != std::filesystem::recursive_directory_iterator(); ++it)
+        {
+            std::filesystem::path const name = it->path().filename();
+            if (DeleteEngine::trash_name == name && source == it->path().parent_path())
+            {
+                it.disable_recursion_pending();
+                continue;
+            }
+            std::filesystem::path const to = target / it->path().lexically_relative(source);
+            if (it->is_directory())
+                std::filesystem::create_directories(to);
+            else if (it->is_regular_file() && false == is_part(name))
+                restore_file(it->path(), to);
+        }
+    }
+
+    // Removes chunks that no manifest refers to, leftovers of interrupted writes
+    // included, and returns the bytes freed. Manifests in the trash still count. Must
+    // not run while a job writes to the store: its new chunks have no manifest yet.
+    uint64_t collect_garbage(void)
+    {
+        std::unordered_set<Sha256::digest_t, digest_hash_t> referenced;
+        for (auto const& entry : std::filesystem::recursive_directory_iterator(files_path(root)))
+        {
+            if (entry.is_regular_file() && false == is_part(entry.path().filename()))
+            {
+                for (auto const& chunk : read_manifest(entry.path()).entries)
+                    referenced.insert(chunk.digest);
+            }
+        }
+        uint64_t freed = 0;
+        for (auto const& entry : std::filesystem::recursive_directory_iterator(chunks_root))
+        {
+            if (false == entry.is_regular_file())
+                continue;
+            Sha256::digest_t digest;
+            if (false == parse_digest(entry.path().filename().string(), digest) || 0 == referenced.count(digest))
+            {
+                freed += entry.file_size();
+                std::filesystem::remove(entry.path());
+            }
+        }
+        return freed;
+    }
+
+private:
+
+    std::filesystem::path chunk_path(Sha256::digest_t const& digest) const
+    {
+        std::string const hex = Sha256::to_hex(digest);
+        return chunks_root / hex.substr(0, 2) / hex;
+    }
+
+    static bool is_part(std::filesystem::path const& name)
+    {
+        std::string const str = name.string();
+        size_t const suffix = std::char_traits<char>::length(part_suffix);
+        return str.size() >= suffix && 0 == str.compare(str.size() - suffix, suffix, part_suffix);
+    }
+
+    static bool parse_digest(std::string const& hex, Sha256::digest_t& digest)
+    {
+        if (hex.size() != digest.size() * 2)
+            return false;
+        for (size_t i = 0; i < hex.size(); ++i)
+        {
+            char const c = hex[i];
+            int const value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (value < 0)
+                return false;
+            digest[i / 2] = static_cast<uint8_t>(0 == i % 2 ? value << 4 : digest[i / 2] | value);
+        }
+        return true;
+    }
+
+    // Returns the bytes written, 0 when the store already holds the chunk. Concurrent
+    // writers of the same chunk each write a part file of their own and the last
+    // rename wins, with identical content.
+    uint64_t store_chunk(Sha256::digest_t const& digest, std::span<char const> data)
+    {
+        std::filesystem::path const path = chunk_path(digest);
+        std::error_code ec;
+        if (std::filesystem::exists(path, ec))
+            return 0;
+        std::filesystem::path const part = path.string() + "-" + std::to_string(part_counter.fetch_add(1, std::memory_order_relaxed)) + part_suffix;
+        write_file(part, data);
+        std::filesystem::rename(part, path);
+        new_chunks.fetch_add(1, std::memory_order_relaxed);
+        return data.size();
+    }
+
+    void write_manifest(DirHandleCache& files, std::filesystem::path const& relative, manifest_t const& manifest)
+    {
+        std::vector<char> data;
+        data.reserve(20 + manifest.entries.size() * 36);
+        data.insert(data.end(), std::begin(manifest_magic), std::end(manifest_magic));
+        append_le(data, manifest_version, 4);
+        append_le(data, manifest.size, 8);
+        append_le(data, manifest.entries.size(), 4);
+        for (auto const& entry : manifest.entries)
+        {
+            data.insert(data.end(), entry.digest.begin(), entry.digest.end());
+            append_le(data, entry.length, 4);
+        }
+        files.make_directory(relative.parent_path());
+        std::filesystem::path const path = files.full_path(relative);
+        std::filesystem::path const part = path.string() + "-" + std::to_string(part_counter.fetch_add(1, std::memory_order_relaxed)) + part_suffix;
+        write_file(part, data);
+        std::filesystem::rename(part, path);
+    }
+
+    static manifest_t read_manifest(std::filesystem::path const& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> const data{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        if (false == in.is_open() || in.bad())
+            throw std::filesystem::filesystem_error("Can't read manifest", path, std::make_error_code(std::errc::io_error));
+
+        manifest_t manifest;
+        bool valid = data.size() >= 20 && 0 == std::memcmp(data.data(), manifest_magic, sizeof(manifest_magic)) && manifest_version == load_le(data, 4, 4);
+        if (valid)
+        {
+            manifest.size = load_le(data, 8, 8);
+            uint64_t const count = load_le(data, 16, 4);
+            valid = data.size() == 20 + count * 36;
+            uint64_t total = 0;
+            for (size_t at = 20; valid && at < data.size(); at += 36)
+            {
+                entry_t& entry = manifest.entries.emplace_back();
+                std::memcpy(entry.digest.data(), data.data() + at, entry.digest.size());
+                entry.length = static_cast<uint32_t>(load_le(data, at + 32, 4));
+                total += entry.length;
+            }
+            valid = valid && total == manifest.size;
+        }
+        if (false == valid)
+            throw std::filesystem::filesystem_error("Corrupt manifest", path, std::make_error_code(std::errc::bad_message));
+        return manifest;
+    }
+
+    void restore_file(std::filesystem::path const& manifest_path, std::filesystem::path const& target) const
+    {
+        manifest_t const manifest = read_manifest(manifest_path);
+        std::ofstream out(target, std::ios::binary | std::ios::trunc);
+        if (false == out.is_open())
+            throw std::filesystem::filesystem_error("Can't open destination file", target, std::error_code(errno, std::generic_category()));
+        std::vector<char> chunk;
+        for (auto const& entry : manifest.entries)
+        {
+            std::filesystem::path const path = chunk_path(entry.digest);
+            std::ifstream in(path, std::ios::binary);
+            chunk.resize(entry.length);
+            in.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            if (static_cast<size_t>(in.gcount()) != chunk.size() || Sha256::hash(chunk.data(), chunk.size()) != entry.digest)
+                throw std::filesystem::filesystem_error("Missing or corrupt chunk", path, target, std::make_error_code(std::errc::bad_message));
+            out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        }
+        out.close();
+        if (false == out.good())
+            throw std::filesystem::filesystem_error("Can't write destination file", target, std::make_error_code(std::errc::io_error));
+    }
+
+    static void write_file(std::filesystem::path const& path, std::span<char const> data)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        out.close();
+        if (false == out.good())
+        {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            throw std::filesystem::filesystem_error("Can't write chunk store file", path, std::make_error_code(std::errc::io_error));
+        }
+    }
+
+    static void append_le(std::vector<char>& data, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+            data.push_back(static_cast<char>(value >> (8 * i)));
+    }
+
+    static uint64_t load_le(std::vector<char> const& data, size_t at, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i)
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(data[at + i])) << (8 * i);
+        return value;
+    }
+};
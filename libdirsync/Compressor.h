@@ -0,0 +1,233 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <span>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <cstdint>
+#include "TokenBucket.h"
+
+// Builds where zstd.h can be found compress; -DDIRSYNC_WITH_ZSTD=0 opts out.
+#ifndef DIRSYNC_WITH_ZSTD
+#if __has_include(<zstd.h>)
+#define DIRSYNC_WITH_ZSTD 1
+#else
+#define DIRSYNC_WITH_ZSTD 0
+#endif
+#endif
+
+#if DIRSYNC_WITH_ZSTD
+#include <zstd.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "zstd.lib")
+#endif
+#endif
+
+
+// zstd compression of replica data. Every chunk becomes a zstd frame of its own, so the
+// receiving end can unpack and write each one independently, at its own offset. Without
+// zstd at build time `available` is false and nothing is ever compressed.
+class Compressor final
+{
+public:
+
+    static constexpr bool available = 0 != DIRSYNC_WITH_ZSTD;
+    // Files at least this large are compressed by several zstd workers.
+    static constexpr uint64_t multithread_min = 16 << 20;
+    // Range the automatic level moves in; negative levels trade ratio for speed.
+    static constexpr int auto_min_level = -5;
+    static constexpr int auto_max_level = 19;
+    static constexpr int auto_start_level = 3;
+
+    struct settings_t
+    {
+        bool enabled = false;
+        // 0 picks the level automatically to keep up with target_rate.
+        int level = 0;
+        // Bytes per second a compressing thread should at least manage.
+        uint64_t target_rate = 100 << 20;
+        size_t threads = 4;
+
+        bool set(std::string const& key, std::string const& value)
+        {
+            if ("compression" == key)
+            {
+                if ("none" != value && "zstd" != value)
+                    throw std::runtime_error("unknown compression " + value);
+                if ("zstd" == value && false == available)
+                    throw std::runtime_error("built without zstd");
+                enabled = "zstd" == value;
+            }
+            else if ("compression_level" == key)
+                level = "auto" == value ? 0 : parse_level(value);
+            else if ("compression_target" == key)
+                target_rate = std::max<uint64_t>(1, TokenBucket::parse_rate(value));
+            else if ("compression_threads" == key)
+                threads = static_cast<size_t>(std::max(1, parse_level(value)));
+            else
+                return false;
+            return true;
+        }
+
+    private:
+
+        static int parse_level(std::string const& value)
+        {
+            try
+            {
+                size_t pos = 0;
+                int const result = std::stoi(value, &pos);
+                if (pos == value.size())
+                    return result;
+            }
+            catch (std::logic_error const&)
+            {
+            }
+            throw std::runtime_error("invalid number " + value);
+        }
+    };
+
+    // Automatic level shared by the compressors of one replica. It drops while chunks
+    // compress slower than the target rate and rises while they compress at more than
+    // twice that, so compression keeps up with the link instead of holding it back.
+    class tuner_t
+    {
+        std::atomic<int> level{ auto_start_level };
+        uint64_t const target_rate;
+
+    public:
+
+        explicit tuner_t(uint64_t target_rate_)
+            : target_rate(target_rate_)
+        {
+        }
+
+        int get_level(void) const
+        {
+            return level.load(std::memory_order_relaxed);
+        }
+
+        void record(size_t bytes, std::chrono::nanoseconds elapsed)
+        {
+            // Tiny chunks are all overhead and say nothing about the level.
+            if (bytes < (64 << 10))
+                return;
+            double const rate = static_cast<double>(bytes) * 1e9 / static_cast<double>(std::max<int64_t>(1, elapsed.count()));
+            int current = level.load(std::memory_order_relaxed);
+            int wanted = current;
+            if (rate < static_cast<double>(target_rate))
+                wanted = std::max(auto_min_level, current - 1);
+            else if (rate > 2.0 * static_cast<double>(target_rate))
+                wanted = std::min(auto_max_level, current + 1);
+            if (wanted != current)
+                level.compare_exchange_strong(current, wanted, std::memory_order_relaxed);
+        }
+    };
+
+private:
+
+#if DIRSYNC_WITH_ZSTD
+    ZSTD_CCtx* context = nullptr;
+#endif
+    std::vector<char> packed;
+
+public:
+
+    Compressor(void) = default;
+
+    ~Compressor(void)
+    {
+#if DIRSYNC_WITH_ZSTD
+        ZSTD_freeCCtx(context);
+#endif
+    }
+
+    Compressor(const Compressor&) = delete;
+
+    Compressor& operator=(const Compressor&) = delete;
+
+    // Compresses `data` into one frame with `threads` zstd workers (0 compresses on the
+    // calling thread). Returns the frame, or nothing when it wouldn't save at least 3%,
+    // which is the case for media and encrypted data. The frame stays valid until the
+    // next call.
+    std::span<char const> compress(std::span<char const> data, int level, size_t threads)
+    {
+#if DIRSYNC_WITH_ZSTD
+        if (nullptr == context)
+        {
+            context = ZSTD_createCCtx();
+            if (nullptr == context)
+                throw std::bad_alloc();
+        }
+        ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+        // Fails harmlessly when libzstd was built without threads.
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers, static_cast<int>(threads))))
+            ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers, 0);
+        else if (threads > 0)
+            ZSTD_CCtx_setParameter(context, ZSTD_c_jobSize, 1 << 20);
+        packed.resize(ZSTD_compressBound(data.size()));
+        size_t const size = ZSTD_compress2(context, packed.data(), packed.size(), data.data(), data.size());
+        if (ZSTD_isError(size) || size >= data.size() - data.size() / 32)
+            return {};
+        return { packed.data(), size };
+#else
+        (void)data;
+        (void)level;
+        (void)threads;
+        return {};
+#endif
+    }
+};
+
+
+// Counterpart of Compressor.
+class Decompressor final
+{
+#if DIRSYNC_WITH_ZSTD
+    ZSTD_DCtx* context = nullptr;
+#endif
+    std::vector<char> unpacked;
+
+public:
+
+    Decompressor(void) = default;
+
+    ~Decompressor(void)
+    {
+#if DIRSYNC_WITH_ZSTD
+        ZSTD_freeDCtx(context);
+#endif
+    }
+
+    Decompressor(const Decompressor&) = delete;
+
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Unpacks a frame that has to yield exactly `size` bytes; throws EBADMSG otherwise.
+    // The result stays valid until the next call.
+    std::span<char const> decompress(std::span<char const> frame, size_t size)
+    {
+#if DIRSYNC_WITH_ZSTD
+        if (nullptr == context)
+        {
+            context = ZSTD_createDCtx();
+            if (nullptr == context)
+                throw std::bad_alloc();
+        }
+        unpacked.resize(size);
+        size_t const result = ZSTD_decompressDCtx(context, unpacked.data(), unpacked.size(), frame.data(), frame.size());
+        if (ZSTD_isError(result) || result != size)
+            throw std::system_error(EBADMSG, std::generic_category(), "Corrupt compressed data");
+        return { unpacked.data(), size };
+#else
+        (void)frame;
+        (void)size;
+        throw std::system_error(ENOTSUP, std::generic_category(), "Built without zstd");
+#endif
+    }
+};
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <algorithm>
+#include "IoScheduler.h"
+#include "TokenBucket.h"
+#include "Compressor.h"
+#include "SnapshotManager.h"
+
+
+// Rates are per second, 0 means unlimited. Schedules override the rate during the
+// listed time-of-day windows.
+struct ThrottleConfig
+{
+    uint64_t bandwidth = 0;
+    uint64_t iops = 0;
+    std::vector<TokenBucket::window_t> bandwidth_schedule;
+    std::vector<TokenBucket::window_t> iops_schedule;
+
+    bool set(std::string const& key, std::string const& value)
+    {
+        if ("bandwidth" == key)
+            bandwidth = TokenBucket::parse_rate(value);
+        else if ("iops" == key)
+            iops = TokenBucket::parse_rate(value);
+        else if ("bandwidth_schedule" == key)
+            bandwidth_schedule = TokenBucket::parse_schedule(value);
+        else if ("iops_schedule" == key)
+            iops_schedule = TokenBucket::parse_schedule(value);
+        else
+            return false;
+        return true;
+    }
+};
+
+struct JobConfig
+{
+    std::string name;
+    std::string source;
+    std::string replica;
+    size_t synch_interval = 0;
+    ThrottleConfig throttle;
+    std::vector<std::string> priority_paths;
+    uint64_t small_file_size = 1 << 20;
+    size_t hot_age = 300;
+    bool deferred_delete = false;
+    std::vector<std::string> filters;
+    std::vector<std::string> filter_files;
+    std::string journal;
+    bool async_callbacks = false;
+    size_t batch_size = 0;
+    Compressor::settings_t compression;
+    bool dedup = false;
+    SnapshotManager::settings_t snapshots;
+    bool two_way = false;
+};
+
+// Daemon configuration in INI format:
+//
+//   [global]
+//   scanner_threads = 2
+//   copy_threads = 8
+//   delete_threads = 4
+//   shutdown_timeout = 10
+//   control_socket = /run/dirsync.sock
+//   rotational_concurrency = 1
+//   ssd_concurrency = 8
+//   device_queue_depth = 4096
+//   bandwidth = 100M
+//   bandwidth_schedule = 08:00-18:00=20M
+//
+//   [job photos]
+//   source = /data/photos
+//   replica = /backup/photos
+//   interval = 30
+//   iops = 500
+//   priority_paths = incoming, db/wal
+//   small_file_size = 1M
+//   hot_age = 300
+//   deferred_delete = true
+//   filter = build/
+//   filter = *.tmp
+//   filter = size>10G
+//   filter_file = /data/photos/.syncignore
+//   journal = /var/lib/dirsync/photos.journal
+//   async_callbacks = true
+//   batch_size = 256
+//   compression = zstd
+//   compression_level = auto
+//   compression_target = 100M
+//   compression_threads = 4
+//   dedup = false
+//   snapshots = 24
+//   snapshot_interval = 3600
+//   snapshot_reflink = false
+//   snapshot_threads = 4
+//   two_way = false
+//
+// filter and filter_file may be repeated, rules are applied in order. With a journal
+// a restarted job resumes where it stopped instead of copying everything again.
+// batch_size hands file operations to the callback as change sets of up to that many
+// entries of one directory instead of one by one.
+// replica may also be tcp://<host>:<port>, a folder served by a ReplicaAgent. Data sent
+// there can be zstd-compressed; with compression_level = auto the level adapts so that
+// each copy thread compresses at least compression_target bytes per second, and files
+// of 16 MiB or more are compressed by compression_threads workers. With dedup the
+// replica folder becomes a ChunkStore: files/ holds a manifest per file, chunks/ every
+// distinct content-defined chunk once. With snapshots the job syncs into current/ and,
+// after a cycle that changed something but at most every snapshot_interval seconds,
+// links it into snapshots/<UTC time>; the newest `snapshots` of them are kept.
+// two_way also propagates changes made in the replica back to the source; a path
+// changed on both sides keeps the older version renamed to <name>.conflict-<time>.
+struct SyncConfig
+{
+    size_t scanner_threads = 1;
+    size_t copy_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t delete_threads = 4;
+    size_t shutdown_timeout = 10;
+    std::string control_socket;
+    IoScheduler::limits_t io_limits;
+    ThrottleConfig throttle;
+    std::vector<JobConfig> jobs;
+
+    static SyncConfig load(std::string const& filename)
+    {
+        std::ifstream in(filename);
+        if (false == in.is_open())
+            throw std::runtime_error("Can't open config file " + filename);
+
+        SyncConfig config;
+        JobConfig* job = nullptr;
+        bool in_global = false;
+        std::string line;
+        size_t line_no = 0;
+        while (std::getline(in, line))
+        {
+            ++line_no;
+            line = trim(line);
+            if (line.empty() || '#' == line.front() || ';' == line.front())
+                continue;
+
+            if ('[' == line.front())
+            {
+                if (']' != line.back())
+                    throw std::runtime_error(error_str(filename, line_no, "unterminated section header"));
+                std::string const section = trim(line.substr(1, line.size() - 2));
+                if ("global" == section)
+                {
+                    in_global = true;
+                    job = nullptr;
+                }
+                else if (0 == section.rfind("job", 0))
+                {
+                    in_global = false;
+                    std::string name = trim(section.substr(3));
+                    if (name.empty())
+                        name = "job" + std::to_string(config.jobs.size() + 1);
+                    if (config.jobs.end() != std::find_if(config.jobs.begin(), config.jobs.end(), [&](JobConfig const& j) { return name == j.name; }))
+                        throw std::runtime_error(error_str(filename, line_no, "duplicate job " + name));
+                    job = &config.jobs.emplace_back();
+                    job->name = std::move(name);
+                }
+                else
+                    throw std::runtime_error(error_str(filename, line_no, "unknown section " + section));
+                continue;
+            }
+
+            size_t const eq = line.find('=');
+            if (std::string::npos == eq)
+                throw std::runtime_error(error_str(filename, line_no, "expected key = value"));
+            std::string const key = trim(line.substr(0, eq));
+            std::string const value = trim(line.substr(eq + 1));
+
+            if (in_global)
+                config.set_global(key, value, filename, line_no);
+            else if (job)
+                set_job(*job, key, value, filename, line_no);
+            else
+                throw std::runtime_error(error_str(filename, line_no, "key outside of a section"));
+        }
+
+        if (config.jobs.empty())
+            throw std::runtime_error("Config file " + filename + " doesn't define any job");
+        for (auto const& j : config.jobs)
+        {
+            if (j.source.empty() || j.replica.empty() || 0 == j.synch_interval)
+                throw std::runtime_error("Job " + j.name + " needs source, replica and a non-zero interval");
+            if (j.dedup && 0 == j.replica.rfind("tcp://", 0))
+                throw std::runtime_error("Job " + j.name + " can't keep a deduplicated replica on a replica agent");
+            if (j.snapshots.keep > 0 && (j.dedup || 0 == j.replica.rfind("tcp://", 0)))
+                throw std::runtime_error("Job " + j.name + " can only snapshot a local, non-deduplicated replica");
+            if (j.two_way && (j.dedup || j.snapshots.keep > 0 || j.deferred_delete || false == j.journal.empty() || 0 == j.replica.rfind("tcp://", 0)))
+                throw std::runtime_error("Job " + j.name + " can't combine two_way with dedup, snapshots, deferred_delete, a journal or a replica agent");
+        }
+        return config;
+    }
+
+private:
+
+    void set_global(std::string const& key, std::string const& value, std::string const& filename, size_t line_no)
+    {
+        if ("scanner_threads" == key)
+            scanner_threads = to_size(value, filename, line_no);
+        else if ("copy_threads" == key)
+            copy_threads = to_size(value, filename, line_no);
+        else if ("delete_threads" == key)
+            delete_threads = to_size(value, filename, line_no);
+        else if ("shutdown_timeout" == key)
+            shutdown_timeout = to_size(value, filename, line_no);
+        else if ("control_socket" == key)
+            control_socket = value;
+        else if ("rotational_concurrency" == key)
+            io_limits.rotational_concurrency = to_size(value, filename, line_no);
+        else if ("ssd_concurrency" == key)
+            io_limits.ssd_concurrency = to_size(value, filename, line_no);
+        else if ("device_queue_depth" == key)
+            io_limits.queue_depth = std::max<size_t>(1, to_size(value, filename, line_no));
+        else if (set_throttle(throttle, key, value, filename, line_no))
+            return;
+        else
+            throw std::runtime_error(error_str(filename, line_no, "unknown global key " + key));
+    }
+
+    static void set_job(JobConfig& job, std::string const& key, std::string const& value, std::string const& filename, size_t line_no)
+    {
+        if ("source" == key)
+            job.source = value;
+        else if ("replica" == key)
+            job.replica = value;
+        else if ("interval" == key)
+            job.synch_interval = to_size(value, filename, line_no);
+        else if (set_throttle(job.throttle, key, value, filename, line_no))
+            return;
+        else if ("priority_paths" == key)
+            job.priority_paths = split_list(value);
+        else if ("small_file_size" == key)
+            job.small_file_size = to_bytes(value, filename, line_no);
+        else if ("hot_age" == key)
+            job.hot_age = to_size(value, filename, line_no);
+        else if ("filter" == key)
+            job.filters.push_back(value);
+        else if ("filter_file" == key)
+            job.filter_files.push_back(value);
+        else if ("deferred_delete" == key)
+            job.deferred_delete = to_bool(value, filename, line_no);
+        else if ("journal" == key)
+            job.journal = value;
+        else if ("async_callbacks" == key)
+            job.async_callbacks = to_bool(value, filename, line_no);
+        else if ("batch_size" == key)
+            job.batch_size = to_size(value, filename, line_no);
+        else if (set_compression(job.compression, key, value, filename, line_no))
+            return;
+        else if ("dedup" == key)
+            job.dedup = to_bool(value, filename, line_no);
+        else if ("two_way" == key)
+            job.two_way = to_bool(value, filename, line_no);
+        else if ("snapshots" == key)
+            job.snapshots.keep = to_size(value, filename, line_no);
+        else if ("snapshot_interval" == key)
+            job.snapshots.interval = to_size(value, filename, line_no);
+        else if ("snapshot_reflink" == key)
+            job.snapshots.reflink = to_bool(value, filename, line_no);
+        else if ("snapshot_threads" == key)
+            job.snapshots.threads = std::max<size_t>(1, to_size(value, filename, line_no));
+        else
+            throw std::runtime_error(error_str(filename, line_no, "unknown job key " + key));
+    }
+
+    static bool set_throttle(ThrottleConfig& throttle, std::string const& key, std::string const& value, std::string const& filename, size_t line_no)
+    {
+        try
+        {
+            return throttle.set(key, value);
+        }
+        catch (std::runtime_error const& e)
+        {
+            throw std::runtime_error(error_str(filename, line_no, e.what()));
+        }
+    }
+
+    static bool set_compression(Compressor::settings_t& compression, std::string const& key, std::string const& value, std::string const& filename,
+        size_t line_no)
+    {
+        try
+        {
+            return compression.set(key, value);
+        }
+        catch (std::runtime_error const& e)
+        {
+            throw std::runtime_error(error_str(filename, line_no, e.what()));
+        }
+    }
+
+    static bool to_bool(std::string const& value, std::string const& filename, size_t line_no)
+    {
+        if ("true" == value || "yes" == value || "1" == value)
+            return true;
+        if ("false" == value || "no" == value || "0" == value)
+            return false;
+        throw std::runtime_error(error_str(filename, line_no, "invalid boolean " + value));
+    }
+
+    static uint64_t to_bytes(std::string const& value, std::string const& filename, size_t line_no)
+    {
+        try
+        {
+            return TokenBucket::parse_rate(value);
+        }
+        catch (std::runtime_error const&)
+        {
+            throw std::runtime_error(error_str(filename, line_no, "invalid size " + value));
+        }
+    }
+
+    static std::vector<std::string> split_list(std::string const& value)
+    {
+        std::vector<std::string> result;
+        size_t pos = 0;
+        while (pos <= value.size())
+        {
+            size_t end = value.find(',', pos);
+            if (std::string::npos == end)
+                end = value.size();
+            std::string item = trim(value.substr(pos, end - pos));
+            if (false == item.empty())
+                result.push_back(std::move(item));
+            pos = end + 1;
+        }
+        return result;
+    }
+
+    static size_t to_size(std::string const& value, std::string const& filename, size_t line_no)
+    {
+        try
+        {
+            size_t pos = 0;
+            unsigned long long const result = std::stoull(value, &pos);
+            if (pos != value.size())
+                throw std::invalid_argument(value);
+            return static_cast<size_t>(result);
+        }
+        catch (std::logic_error const&)
+        {
+            throw std::runtime_error(error_str(filename, line_no, "invalid number " + value));
+        }
+    }
+
+    static std::string trim(std::string const& str)
+    {
+        size_t const begin = str.find_first_not_of(" \t\r\n");
+        if (std::string::npos == begin)
+            return std::string();
+        size_t const end = str.find_last_not_of(" \t\r\n");
+        return str.substr(begin, end - begin + 1);
+    }
+
+    static std::string error_str(std::string const& filename, size_t line_no, std::string const& what)
+    {
+        return filename + ":" + std::to_string(line_no) + ": " + what;
+    }
+};
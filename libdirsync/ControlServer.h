@@ -0,0 +1,332 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <sstream>
+#include <stdexcept>
+#include <optional>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include "Logger.h"
+#include "TokenBucket.h"
+#include "SyncService.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+
+// Line-based control interface of a running SyncService on a Unix domain socket.
+// Every request is one line, every reply ends with a line that is either "ok" or
+// "error: <reason>"; stats puts one line per job before it. Commands:
+//
+//   scan <job> [subtree]           start a cycle of the job now, of the subtree only
+//   scan <absolute path>           rescan that path in the job owning it
+//   pause [job]                    start no new cycles, of every job without a name
+//   resume [job]
+//   throttle <job | global> [bandwidth=<rate>] [iops=<rate>]   0 is unlimited
+//   stats
+//
+// The socket is created with mode 0660, so access is governed by its owner and group.
+// Clients are served one request at a time by a single thread.
+class ControlServer final
+{
+#ifndef _WIN32
+    static constexpr size_t max_line = 4096;
+
+    struct client_t
+    {
+        int fd;
+        std::string input;
+    };
+
+    SyncService& service;
+    std::string const path;
+    LogSink* const log_sink = Logger::current_sink();
+    int listen_fd = -1;
+    bool bound = false;
+    int wake_pipe[2] = { -1, -1 };
+    std::thread thread;
+
+public:
+
+    ControlServer(SyncService& service_, std::string path_)
+        : service(service_)
+        , path(std::move(path_))
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Control socket path is too long: " + path);
+        path.copy(address.sun_path, path.size());
+
+        // A socket left behind by a previous run would make bind() fail.
+        struct stat st;
+        if (0 == ::lstat(path.c_str(), &st) && S_ISSOCK(st.st_mode))
+            ::unlink(path.c_str());
+
+        listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0)
+            throw_error("Can't create control socket");
+        bound = 0 == ::bind(listen_fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address));
+        if (false == bound || 0 != ::chmod(path.c_str(), 0660) || 0 != ::listen(listen_fd, 16) || 0 != ::pipe2(wake_pipe, O_CLOEXEC))
+        {
+            int const error = errno;
+            close_all();
+            errno = error;
+            throw_error("Can't listen on control socket " + path);
+        }
+        thread = std::thread(&ControlServer::serve, this);
+    }
+
+    ~ControlServer(void)
+    {
+        char const byte = 0;
+        while (::write(wake_pipe[1], &byte, 1) < 0 && EINTR == errno)
+            ;
+        thread.join();
+        close_all();
+    }
+
+    ControlServer(const ControlServer&) = delete;
+
+    ControlServer& operator=(const ControlServer&) = delete;
+
+    // Sends `command` to the server listening on `path` and returns the reply without
+    // its final line; throws with the reason if that line was an error.
+    static std::string request(std::string const& path, std::string const& command)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Control socket path is too long: " + path);
+        path.copy(address.sun_path, path.size());
+
+        int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw_error("Can't create control socket");
+        if (0 != ::connect(fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)))
+        {
+            int const error = errno;
+            ::close(fd);
+            errno = error;
+            throw_error("Can't connect to " + path);
+        }
+        std::string reply;
+        bool const sent = send_all(fd, command + "\n");
+        while (sent)
+        {
+            char buffer[4096];
+            ssize_t const n = ::read(fd, buffer, sizeof(buffer));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n <= 0)
+                break;
+            reply.append(buffer, static_cast<size_t>(n));
+            if ('\n' != reply.back())
+                continue;
+            size_t const previous = reply.size() < 2 ? std::string::npos : reply.rfind('\n', reply.size() - 2);
+            size_t const start = std::string::npos == previous ? 0 : previous + 1;
+            std::string const status = reply.substr(start, reply.size() - start - 1);
+            if ("ok" == status || 0 == status.rfind("error: ", 0))
+            {
+                ::close(fd);
+                reply.erase(start);
+                if ("ok" != status)
+                    throw std::runtime_error(status.substr(7));
+                return reply;
+            }
+        }
+        ::close(fd);
+        throw std::runtime_error("Connection to " + path + " closed without a reply");
+    }
+
+private:
+
+    void serve(void)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        std::vector<client_t> clients;
+        while (true)
+        {
+            std::vector<pollfd> fds{ { wake_pipe[0], POLLIN, 0 }, { listen_fd, POLLIN, 0 } };
+            for (auto const& client : clients)
+                fds.push_back({ client.fd, POLLIN, 0 });
+            if (::poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Control socket poll failed: %s", std::strerror(errno));
+                break;
+            }
+            if (fds[0].revents)
+                break;
+
+            for (size_t i = clients.size(); i-- > 0;)
+            {
+                if (0 == fds[i + 2].revents)
+                    continue;
+                if (false == receive(clients[i]))
+                {
+                    ::close(clients[i].fd);
+                    clients.erase(clients.begin() + static_cast<ptrdiff_t>(i));
+                }
+            }
+
+            if (fds[1].revents & POLLIN)
+            {
+                int const fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0)
+                {
+                    // A client that stops reading must not stall the others for long.
+                    timeval const timeout{ 1, 0 };
+                    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                    clients.push_back({ fd, {} });
+                }
+            }
+        }
+        for (auto const& client : clients)
+            ::close(client.fd);
+    }
+
+    // Reads what the client sent and answers every complete line; false once the
+    // connection is to be closed.
+    bool receive(client_t& client)
+    {
+        char buffer[max_line];
+        ssize_t const n = ::read(client.fd, buffer, sizeof(buffer));
+        if (n < 0 && EINTR == errno)
+            return true;
+        if (n <= 0)
+            return false;
+        client.input.append(buffer, static_cast<size_t>(n));
+        for (size_t end; std::string::npos != (end = client.input.find('\n'));)
+        {
+            std::string line = client.input.substr(0, end);
+            client.input.erase(0, end + 1);
+            if (false == line.empty() && '\r' == line.back())
+                line.pop_back();
+            if (false == send_all(client.fd, execute(line)))
+                return false;
+        }
+        return client.input.size() <= max_line;
+    }
+
+    std::string execute(std::string const& line)
+    {
+        std::istringstream in(line);
+        std::vector<std::string> args;
+        for (std::string arg; in >> arg;)
+            args.push_back(std::move(arg));
+        if (args.empty())
+            return "error: empty command\n";
+
+        std::string const& command = args[0];
+        if ("stats" != command)
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Control command: %s", line.c_str());
+        try
+        {
+            if ("scan" == command && 2 == args.size() && '/' == args[1].front())
+                return service.trigger_scan_path(args[1]) ? "ok\n" : "error: no running job covers " + args[1] + "\n";
+            if ("scan" == command && (2 == args.size() || 3 == args.size()))
+            {
+                std::string const subtree = 3 == args.size() ? args[2] : std::string();
+                return service.trigger_scan(args[1], subtree) ? "ok\n" : "error: no running job " + args[1] + "\n";
+            }
+            if (("pause" == command || "resume" == command) && args.size() <= 2)
+            {
+                std::string const job = 2 == args.size() ? args[1] : std::string();
+                bool const found = "pause" == command ? service.pause(job) : service.resume(job);
+                return found ? "ok\n" : "error: no job " + job + "\n";
+            }
+            if ("throttle" == command && args.size() >= 3)
+            {
+                std::optional<uint64_t> bandwidth;
+                std::optional<uint64_t> iops;
+                for (size_t i = 2; i < args.size(); ++i)
+                {
+                    size_t const eq = args[i].find('=');
+                    std::string const key = args[i].substr(0, eq);
+                    if (std::string::npos == eq || ("bandwidth" != key && "iops" != key))
+                        return "error: expected bandwidth=<rate> or iops=<rate>, got " + args[i] + "\n";
+                    ("bandwidth" == key ? bandwidth : iops) = TokenBucket::parse_rate(args[i].substr(eq + 1));
+                }
+                std::string const job = "global" == args[1] ? std::string() : args[1];
+                return service.set_throttle(job, bandwidth, iops) ? "ok\n" : "error: no job " + job + "\n";
+            }
+            if ("stats" == command && 1 == args.size())
+                return format_stats(service.query_stats()) + "ok\n";
+        }
+        catch (std::exception const& e)
+        {
+            return std::string("error: ") + e.what() + "\n";
+        }
+        return "error: usage: scan <job> [subtree] | scan <path> | pause [job] | resume [job] | throttle <job | global> [bandwidth=<rate>] [iops=<rate>] | stats\n";
+    }
+
+    static std::string format_stats(std::vector<JobStats> const& stats)
+    {
+        std::ostringstream out;
+        for (auto const& job : stats)
+        {
+            out << "job " << job.name << " files_copied=" << job.files_copied << " bytes_copied=" << job.bytes_copied
+                << " entries_deleted=" << job.entries_deleted << " throttle_wait_ns=" << job.throttle_wait_ns
+                << " metadata_updated=" << job.metadata_updated
+                << " lag_p99_ms=" << job.lag_p99_ms[0] << "/" << job.lag_p99_ms[1] << "/" << job.lag_p99_ms[2]
+                << " cycles=" << job.cycles << " running=" << job.cycle_running << " paused=" << job.paused << "\n";
+        }
+        return out.str();
+    }
+
+    static bool send_all(int fd, std::string const& data)
+    {
+        for (size_t sent = 0; sent < data.size();)
+        {
+            ssize_t const n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void close_all(void)
+    {
+        for (int* fd : { &listen_fd, &wake_pipe[0], &wake_pipe[1] })
+        {
+            if (*fd >= 0)
+                ::close(*fd);
+            *fd = -1;
+        }
+        if (bound)
+            ::unlink(path.c_str());
+    }
+
+    [[noreturn]] static void throw_error(std::string const& what)
+    {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+#else
+public:
+
+    ControlServer(SyncService&, std::string const&)
+    {
+        throw std::runtime_error("The control socket is only supported on POSIX systems");
+    }
+
+    static std::string request(std::string const&, std::string const&)
+    {
+        throw std::runtime_error("The control socket is only supported on POSIX systems");
+    }
+#endif
+};
@@ -0,0 +1,637 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <set>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <system_error>
+#include "TokenBucket.h"
+#include "Metrics.h"
+#include "DirHandleCache.h"
+#include "Task.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <cstring>
+#include <sys/xattr.h>
+#endif
+
+
+// Copies file contents chunk by chunk so that bandwidth and IOPS limits can be
+// applied smoothly instead of once per file. Every job owns an engine that charges
+// both the daemon-wide throttle and its own one.
+class CopyEngine
+{
+public:
+
+    static constexpr size_t chunk_size = 1 << 20;
+
+    // How much data a copy writes between two progress reports.
+    static constexpr uint64_t commit_bytes = 64 << 20;
+
+    struct throttle_t
+    {
+        TokenBucket bytes;
+        TokenBucket ops;
+    };
+
+private:
+
+    throttle_t& global_throttle;
+    throttle_t& job_throttle;
+    JobMetrics& metrics;
+    std::atomic<bool> const* cancelled;
+
+public:
+
+    // Copies in progress stop at the next chunk once *cancelled_ becomes true.
+    CopyEngine(throttle_t& global_throttle_, throttle_t& job_throttle_, JobMetrics& metrics_, std::atomic<bool> const* cancelled_ = nullptr)
+        : global_throttle(global_throttle_)
+        , job_throttle(job_throttle_)
+        , metrics(metrics_)
+        , cancelled(cancelled_)
+    {
+    }
+
+    CopyEngine(const CopyEngine&) = delete;
+
+    CopyEngine& operator=(const CopyEngine&) = delete;
+
+    JobMetrics& get_metrics(void)
+    {
+        return metrics;
+    }
+
+    void acquire_op(void)
+    {
+        auto const waited = global_throttle.ops.acquire(1) + job_throttle.ops.acquire(1);
+        metrics.throttle_wait_ns.fetch_add(waited.count(), std::memory_order_relaxed);
+    }
+
+    // Copies `from` to `relative` inside the replica behind `replica`, which gets the
+    // owner, mode and extended attributes of `from` and its mtime to the nanosecond
+    // once complete, the same way copy_metadata applies them. A non-zero
+    // resume_offset keeps that many bytes of an existing destination, as long as the
+    // destination is at least that long. on_commit is called with the number of bytes
+    // written every commit_bytes, and once more when the copy is cancelled, which
+    // throws a filesystem_error with std::errc::operation_canceled.
+    void copy_file(std::filesystem::path const& from, DirHandleCache& replica, std::filesystem::path const& relative,
+        uint64_t resume_offset = 0, std::function<void(uint64_t)> const& on_commit = {})
+    {
+        std::filesystem::path const to = replica.full_path(relative);
+        std::vector<char> buffer(chunk_size);
+        uint64_t total = 0;
+        uint64_t committed = 0;
+#ifndef _WIN32
+        int in = -1;
+        int out = -1;
+        struct stat st;
+        open_files(from, replica, relative, resume_offset, in, out, st);
+        total = committed = resume_offset;
+
+        while (true)
+        {
+            if (is_cancelled())
+            {
+                ::close(in);
+                ::close(out);
+                throw_cancelled(from, to, total, committed, on_commit);
+            }
+            ssize_t const n = ::read(in, buffer.data(), buffer.size());
+            if (n < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                ::close(in);
+                ::close(out);
+                throw_error("Can't read source file", from);
+            }
+            if (0 == n)
+                break;
+
+            throttle_bytes(static_cast<uint64_t>(n));
+            for (ssize_t written = 0; written < n;)
+            {
+                ssize_t const w = ::write(out, buffer.data() + written, static_cast<size_t>(n - written));
+                if (w < 0)
+                {
+                    if (EINTR == errno)
+                        continue;
+                    ::close(in);
+                    ::close(out);
+                    throw_error("Can't write destination file", to);
+                }
+                written += w;
+            }
+            total += static_cast<uint64_t>(n);
+            if (on_commit && total - committed >= commit_bytes)
+            {
+                committed = total;
+                on_commit(total);
+            }
+        }
+        ::close(in);
+        if (0 != resume_offset && 0 != ::ftruncate(out, static_cast<off_t>(total)))
+        {
+            ::close(out);
+            throw_error("Can't truncate destination file", to);
+        }
+        try
+        {
+            set_attributes(out, st, from, to);
+        }
+        catch (...)
+        {
+            ::close(out);
+            throw;
+        }
+        if (0 != ::close(out))
+            throw_error("Can't close destination file", to);
+#else
+        std::ifstream in(from, std::ios::binary);
+        if (false == in.is_open())
+            throw_error("Can't open source file", from);
+        std::error_code ec;
+        if (0 != resume_offset && (std::filesystem::file_size(to, ec) < resume_offset || ec || std::filesystem::file_size(from, ec) < resume_offset))
+            resume_offset = 0;
+        std::fstream out(to, std::ios::binary | std::ios::out | (0 == resume_offset ? std::ios::trunc : std::ios::in));
+        if (false == out.is_open())
+            throw_error("Can't open destination file", to);
+        if (0 != resume_offset)
+        {
+            in.seekg(static_cast<std::streamoff>(resume_offset));
+            out.seekp(static_cast<std::streamoff>(resume_offset));
+            total = committed = resume_offset;
+        }
+        while (in)
+        {
+            if (is_cancelled())
+            {
+                out.close();
+                throw_cancelled(from, to, total, committed, on_commit);
+            }
+            in.read(buffer.data(), buffer.size());
+            std::streamsize const n = in.gcount();
+            if (n <= 0)
+                break;
+            throttle_bytes(static_cast<uint64_t>(n));
+            out.write(buffer.data(), n);
+            if (false == out.good())
+                throw_error("Can't write destination file", to);
+            total += static_cast<uint64_t>(n);
+            if (on_commit && total - committed >= commit_bytes)
+            {
+                committed = total;
+                on_commit(total);
+            }
+        }
+        out.close();
+        if (0 != resume_offset)
+            std::filesystem::resize_file(to, total);
+        std::filesystem::permissions(to, std::filesystem::status(from).permissions());
+        std::filesystem::last_write_time(to, std::filesystem::last_write_time(from));
+#endif
+        metrics.files_copied.fetch_add(1, std::memory_order_relaxed);
+        metrics.bytes_copied.fetch_add(total - resume_offset, std::memory_order_relaxed);
+    }
+
+    // Same as copy_file, as a coroutine that never blocks its thread on I/O: reads and
+    // writes run on `pool` and the read of the next chunk overlaps the write of the
+    // current one.
+    Task<void> copy_file_async(std::filesystem::path from, DirHandleCache& replica, std::filesystem::path relative, ThreadPool& pool, size_t job_id,
+        uint64_t resume_offset = 0, std::function<void(uint64_t)> on_commit = {})
+    {
+#ifndef _WIN32
+        std::filesystem::path const to = replica.full_path(relative);
+        int in = -1;
+        int out = -1;
+        struct stat st;
+        co_await offload(pool, job_id, [&]() { open_files(from, replica, relative, resume_offset, in, out, st); });
+
+        std::vector<char> current(chunk_size);
+        std::vector<char> next(chunk_size);
+        uint64_t total = resume_offset;
+        uint64_t committed = resume_offset;
+        std::exception_ptr error;
+        try
+        {
+            size_t n = co_await offload(pool, job_id, [&]() { return read_at(in, current, total, from); });
+            while (n > 0)
+            {
+                if (is_cancelled())
+                    throw_cancelled(from, to, total, committed, on_commit);
+                throttle_bytes(n);
+
+                uint64_t const offset = total;
+                size_t next_n = 0;
+                std::vector<Task<void>> io;
+                io.push_back(run_on(pool, job_id, [&]() { write_at(out, current, n, offset, to); }));
+                io.push_back(run_on(pool, job_id, [&]() { next_n = read_at(in, next, offset + n, from); }));
+                co_await when_all(std::move(io));
+
+                total += n;
+                if (on_commit && total - committed >= commit_bytes)
+                {
+                    committed = total;
+                    on_commit(total);
+                }
+                std::swap(current, next);
+                n = next_n;
+            }
+            if (0 != resume_offset && 0 != ::ftruncate(out, static_cast<off_t>(total)))
+                throw_error("Can't truncate destination file", to);
+            co_await offload(pool, job_id, [&]() { set_attributes(out, st, from, to); });
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        ::close(in);
+        if (0 != ::close(out) && nullptr == error)
+            throw_error("Can't close destination file", to);
+        if (error)
+            std::rethrow_exception(error);
+        metrics.files_copied.fetch_add(1, std::memory_order_relaxed);
+        metrics.bytes_copied.fetch_add(total - resume_offset, std::memory_order_relaxed);
+#else
+        co_await offload(pool, job_id, [&]() { copy_file(from, replica, relative, resume_offset, on_commit); });
+#endif
+    }
+
+    // Gives `relative` inside the replica the owner, permissions, times and extended
+    // attributes of `from` without touching its data. What the replica can't take, such
+    // as ownership without privileges, is skipped. Directory times are left alone since
+    // every entry added to the directory moves them again. An entry with other hard
+    // links, such as one a snapshot shares, is first replaced by a copy of its own.
+    void copy_metadata(std::filesystem::path const& from, DirHandleCache& replica, std::filesystem::path const& relative, bool directory)
+    {
+        std::filesystem::path const to = replica.full_path(relative);
+#ifndef _WIN32
+        struct stat st;
+        if (0 != ::lstat(from.c_str(), &st))
+            throw_error("Can't stat source entry", from);
+        DirHandleCache::handle_ptr const parent = replica.get_dir(relative.parent_path(), false);
+        if (nullptr == parent)
+            throw std::filesystem::filesystem_error("Can't update replica entry", to, std::make_error_code(std::errc::no_such_file_or_directory));
+        std::string const name = relative.filename().string();
+        struct stat out_st;
+        if (false == directory && 0 == ::fstatat(parent->get(), name.c_str(), &out_st, AT_SYMLINK_NOFOLLOW) && out_st.st_nlink > 1)
+            break_link(parent->get(), name, out_st, to);
+        if (0 != ::fchownat(parent->get(), name.c_str(), st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) && EPERM != errno)
+            throw_error("Can't change owner of replica entry", to);
+        // After the owner, whose change clears set-user-ID bits.
+        // Links have no mode of their own, fchmodat would change their target.
+        if (false == S_ISLNK(st.st_mode) && 0 != ::fchmodat(parent->get(), name.c_str(), st.st_mode & 07777, 0))
+            throw_error("Can't change mode of replica entry", to);
+        if (false == directory)
+        {
+            timespec const times[2] = { st.st_atim, st.st_mtim };
+            if (0 != ::utimensat(parent->get(), name.c_str(), times, AT_SYMLINK_NOFOLLOW))
+                throw_error("Can't set times of replica entry", to);
+        }
+#ifdef __linux__
+        copy_xattrs(from, to);
+#endif
+#else
+        (void)directory;
+        std::filesystem::permissions(to, std::filesystem::status(from).permissions());
+#endif
+        metrics.metadata_updated.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Recreates the symbolic link, FIFO or device node `from` at `relative` inside the
+    // replica in place of whatever file was there. Links are copied as links and never
+    // followed; device nodes need the privilege to create them.
+    void copy_special(std::filesystem::path const& from, DirHandleCache& replica, std::filesystem::path const& relative)
+    {
+        std::filesystem::path const to = replica.full_path(relative);
+#ifndef _WIN32
+        struct stat st;
+        if (0 != ::lstat(from.c_str(), &st))
+            throw_error("Can't stat source entry", from);
+        std::string target;
+        if (S_ISLNK(st.st_mode))
+        {
+            // st_size is only a hint, some file systems report 0 for links.
+            for (size_t size = std::max<size_t>(static_cast<size_t>(st.st_size) + 1, 256);; size *= 2)
+            {
+                target.resize(size);
+                ssize_t const length = ::readlink(from.c_str(), target.data(), target.size());
+                if (length < 0)
+                    throw_error("Can't read source link", from);
+                if (static_cast<size_t>(length) < target.size())
+                {
+                    target.resize(static_cast<size_t>(length));
+                    break;
+                }
+            }
+        }
+        else if (false == S_ISFIFO(st.st_mode) && false == S_ISCHR(st.st_mode) && false == S_ISBLK(st.st_mode))
+            throw std::filesystem::filesystem_error("Can't replicate source entry of this type", from, std::make_error_code(std::errc::not_supported));
+
+        replica.remove_file(relative);
+        DirHandleCache::handle_ptr const parent = replica.get_dir(relative.parent_path());
+        std::string const name = relative.filename().string();
+        if (S_ISLNK(st.st_mode) ? 0 != ::symlinkat(target.c_str(), parent->get(), name.c_str())
+            : 0 != ::mknodat(parent->get(), name.c_str(), st.st_mode & (S_IFMT | 07777), S_ISFIFO(st.st_mode) ? 0 : st.st_rdev))
+            throw_error("Can't create replica entry", to);
+        if (0 != ::fchownat(parent->get(), name.c_str(), st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) && EPERM != errno)
+            throw_error("Can't change owner of replica entry", to);
+        if (false == S_ISLNK(st.st_mode) && 0 != ::fchmodat(parent->get(), name.c_str(), st.st_mode & 07777, 0))
+            throw_error("Can't change mode of replica entry", to);
+        timespec const times[2] = { { 0, UTIME_OMIT }, st.st_mtim };
+        if (0 != ::utimensat(parent->get(), name.c_str(), times, AT_SYMLINK_NOFOLLOW))
+            throw_error("Can't set times of replica entry", to);
+#else
+        if (false == std::filesystem::is_symlink(std::filesystem::symlink_status(from)))
+            throw std::filesystem::filesystem_error("Can't replicate source entry of this type", from, std::make_error_code(std::errc::not_supported));
+        std::filesystem::remove(to);
+        std::filesystem::create_directories(to.parent_path());
+        std::filesystem::copy_symlink(from, to);
+#endif
+        metrics.files_copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool is_cancelled(void) const
+    {
+        return cancelled && cancelled->load(std::memory_order_relaxed);
+    }
+
+    // Charges `count` bytes to both bandwidth limits, for transfers that don't go
+    // through copy_file.
+    void throttle_bytes(uint64_t count)
+    {
+        auto const waited = global_throttle.bytes.acquire(count) + job_throttle.bytes.acquire(count);
+        metrics.throttle_wait_ns.fetch_add(waited.count(), std::memory_order_relaxed);
+    }
+
+private:
+
+    template<typename F>
+    static Task<void> run_on(ThreadPool& pool, size_t job_id, F fn)
+    {
+        co_await offload(pool, job_id, std::move(fn));
+    }
+
+#ifndef _WIN32
+    // Opens the source and the destination. resume_offset is reset to 0 when the
+    // destination is shorter than that or the source changed size below it; both
+    // descriptors are positioned at resume_offset. A destination with other hard links,
+    // such as one a snapshot shares, is replaced by a new file instead of overwritten.
+    // `st` receives the status of the source.
+    static void open_files(std::filesystem::path const& from, DirHandleCache& replica, std::filesystem::path const& relative,
+        uint64_t& resume_offset, int& in, int& out, struct stat& st)
+    {
+        in = ::open(from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0)
+            throw_error("Can't open source file", from);
+        if (0 != ::fstat(in, &st))
+        {
+            ::close(in);
+            throw_error("Can't stat source file", from);
+        }
+        // Neither written through: a link or device node that was replicated before
+        // the source became a regular file, nor a file that has other hard links.
+        struct stat out_st;
+        bool const replace = replica.stat(relative, out_st) && (false == S_ISREG(out_st.st_mode) || out_st.st_nlink > 1);
+        if (replace)
+        {
+            try
+            {
+                replica.remove_file(relative);
+            }
+            catch (...)
+            {
+                ::close(in);
+                throw;
+            }
+            resume_offset = 0;
+        }
+        out = replica.open_file(relative, O_WRONLY | O_CREAT | O_NOFOLLOW | (replace ? O_EXCL : 0), st.st_mode & 07777);
+        if (out >= 0 && 0 == resume_offset && 0 != ::ftruncate(out, 0))
+        {
+            ::close(out);
+            out = -1;
+        }
+        if (out < 0)
+        {
+            ::close(in);
+            throw_error("Can't open destination file", replica.full_path(relative));
+        }
+        if (0 != resume_offset)
+        {
+            struct stat out_st;
+            if (0 != ::fstat(out, &out_st) || static_cast<uint64_t>(out_st.st_size) < resume_offset || resume_offset > static_cast<uint64_t>(st.st_size)
+                || static_cast<off_t>(resume_offset) != ::lseek(in, static_cast<off_t>(resume_offset), SEEK_SET)
+                || static_cast<off_t>(resume_offset) != ::lseek(out, static_cast<off_t>(resume_offset), SEEK_SET))
+            {
+                resume_offset = 0;
+                ::lseek(in, 0, SEEK_SET);
+                ::lseek(out, 0, SEEK_SET);
+            }
+        }
+    }
+
+    // Replaces `name` in `dir`, described by `st`, by a copy that shares no inode with
+    // other hard links: the copy is made next to it and renamed over it, so the entry
+    // never goes missing. The caller sets owner, mode, times and attributes afterwards.
+    void break_link(int dir, std::string const& name, struct stat const& st, std::filesystem::path const& to)
+    {
+        std::string const part = name + ".dirsync-part";
+        ::unlinkat(dir, part.c_str(), 0);
+        if (S_ISREG(st.st_mode))
+        {
+            int const in = ::openat(dir, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (in < 0)
+                throw_error("Can't open replica file", to);
+            int const out = ::openat(dir, part.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, st.st_mode & 07777);
+            if (out < 0)
+            {
+                ::close(in);
+                throw_error("Can't create replica file", to);
+            }
+            std::vector<char> buffer(chunk_size);
+            bool failed = false;
+            while (false == failed)
+            {
+                ssize_t const n = ::read(in, buffer.data(), buffer.size());
+                if (n < 0 && EINTR == errno)
+                    continue;
+                if (n <= 0)
+                {
+                    failed = n < 0;
+                    break;
+                }
+                throttle_bytes(static_cast<uint64_t>(n));
+                for (ssize_t written = 0; written < n && false == failed;)
+                {
+                    ssize_t const w = ::write(out, buffer.data() + written, static_cast<size_t>(n - written));
+                    if (w < 0 && EINTR != errno)
+                        failed = true;
+                    else if (w > 0)
+                        written += w;
+                }
+            }
+            int const error = errno;
+            ::close(in);
+            if (0 != ::close(out) || failed)
+            {
+                ::unlinkat(dir, part.c_str(), 0);
+                errno = error;
+                throw_error("Can't copy replica file", to);
+            }
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            std::string target;
+            for (size_t size = std::max<size_t>(static_cast<size_t>(st.st_size) + 1, 256);; size *= 2)
+            {
+                target.resize(size);
+                ssize_t const length = ::readlinkat(dir, name.c_str(), target.data(), target.size());
+                if (length < 0)
+                    throw_error("Can't read replica link", to);
+                if (static_cast<size_t>(length) < target.size())
+                {
+                    target.resize(static_cast<size_t>(length));
+                    break;
+                }
+            }
+            if (0 != ::symlinkat(target.c_str(), dir, part.c_str()))
+                throw_error("Can't create replica link", to);
+        }
+        else if (0 != ::mknodat(dir, part.c_str(), st.st_mode & (S_IFMT | 07777), S_ISFIFO(st.st_mode) ? 0 : st.st_rdev))
+            throw_error("Can't create replica entry", to);
+        if (0 != ::renameat(dir, part.c_str(), dir, name.c_str()))
+        {
+            int const error = errno;
+            ::unlinkat(dir, part.c_str(), 0);
+            errno = error;
+            throw_error("Can't replace replica entry", to);
+        }
+    }
+
+#ifdef __linux__
+    // Sets every extended attribute of `from` on `to` and removes those `from` doesn't
+    // have. Namespaces the process may not write, like trusted.* without CAP_SYS_ADMIN,
+    // and file systems without extended attributes are skipped.
+    static void copy_xattrs(std::filesystem::path const& from, std::filesystem::path const& to)
+    {
+        auto const skipped = [](int error) { return ENOTSUP == error || EPERM == error || EACCES == error || ENODATA == error; };
+        std::vector<char> const wanted = list_xattrs(from);
+        std::set<std::string> names;
+        std::vector<char> value;
+        for (char const* key = wanted.data(); key < wanted.data() + wanted.size(); key += std::strlen(key) + 1)
+        {
+            names.insert(key);
+            ssize_t const size = ::lgetxattr(from.c_str(), key, nullptr, 0);
+            if (size < 0)
+                continue;
+            value.resize(static_cast<size_t>(size));
+            ssize_t const got = ::lgetxattr(from.c_str(), key, value.data(), value.size());
+            if (got < 0)
+                continue;
+            if (0 != ::lsetxattr(to.c_str(), key, value.data(), static_cast<size_t>(got), 0) && false == skipped(errno))
+                throw_error("Can't set extended attribute of replica entry", to);
+        }
+        std::vector<char> const present = list_xattrs(to);
+        for (char const* key = present.data(); key < present.data() + present.size(); key += std::strlen(key) + 1)
+        {
+            if (false == names.contains(key) && 0 != ::lremovexattr(to.c_str(), key) && false == skipped(errno))
+                throw_error("Can't remove extended attribute of replica entry", to);
+        }
+    }
+
+    // Null-separated attribute names, empty where there are none or they can't be read.
+    static std::vector<char> list_xattrs(std::filesystem::path const& path)
+    {
+        ssize_t const size = ::llistxattr(path.c_str(), nullptr, 0);
+        if (size <= 0)
+            return {};
+        std::vector<char> names(static_cast<size_t>(size));
+        ssize_t const got = ::llistxattr(path.c_str(), names.data(), names.size());
+        names.resize(static_cast<size_t>(std::max<ssize_t>(0, got)));
+        return names;
+    }
+#endif
+
+    // Gives the written destination `fd` the owner, mode, extended attributes and mtime
+    // of the source described by `st`; O_CREAT only applied the mode through the umask,
+    // and an existing destination kept its own. The mtime goes last. Leaves the access
+    // time alone, reads of the source don't concern the replica.
+    static void set_attributes(int fd, struct stat const& st, std::filesystem::path const& from, std::filesystem::path const& to)
+    {
+        if (0 != ::fchown(fd, st.st_uid, st.st_gid) && EPERM != errno)
+            throw_error("Can't change owner of destination file", to);
+        // After the owner, whose change clears set-user-ID bits.
+        if (0 != ::fchmod(fd, st.st_mode & 07777))
+            throw_error("Can't change mode of destination file", to);
+#ifdef __linux__
+        copy_xattrs(from, to);
+#else
+        (void)from;
+#endif
+        timespec const times[2] = { { 0, UTIME_OMIT }, st.st_mtim };
+        if (0 != ::futimens(fd, times))
+            throw_error("Can't set destination file time", to);
+    }
+
+    // Fills `buffer` from `offset` on, short only at the end of the file.
+    static size_t read_at(int fd, std::vector<char>& buffer, uint64_t offset, std::filesystem::path const& path)
+    {
+        size_t done = 0;
+        while (done < buffer.size())
+        {
+            ssize_t const n = ::pread(fd, buffer.data() + done, buffer.size() - done, static_cast<off_t>(offset + done));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+                throw_error("Can't read source file", path);
+            if (0 == n)
+                break;
+            done += static_cast<size_t>(n);
+        }
+        return done;
+    }
+
+    static void write_at(int fd, std::vector<char> const& buffer, size_t size, uint64_t offset, std::filesystem::path const& path)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t const n = ::pwrite(fd, buffer.data() + done, size - done, static_cast<off_t>(offset + done));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+                throw_error("Can't write destination file", path);
+            done += static_cast<size_t>(n);
+        }
+    }
+#endif
+
+    [[noreturn]] static void throw_cancelled(std::filesystem::path const& from, std::filesystem::path const& to, uint64_t total, uint64_t committed,
+        std::function<void(uint64_t)> const& on_commit)
+    {
+        if (on_commit && total != committed)
+            on_commit(total);
+        throw std::filesystem::filesystem_error("Copy cancelled", from, to, std::make_error_code(std::errc::operation_canceled));
+    }
+
+    [[noreturn]] static void throw_error(char const* what, std::filesystem::path const& path)
+    {
+#ifndef _WIN32
+        std::error_code const ec(errno, std::generic_category());
+#else
+        std::error_code const ec = std::make_error_code(std::errc::io_error);
+#endif
+        throw std::filesystem::filesystem_error(what, path, ec);
+    }
+};
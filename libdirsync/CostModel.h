@@ -0,0 +1,126 @@
+#pragma once
+
+#include <filesystem>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <algorithm>
+#include <system_error>
+#include "CopyEngine.h"
+#include "DirHandleCache.h"
+#include "Metrics.h"
+
+
+// Per-operation costs measured on this host, used by the dry-run planner to predict how
+// long a cycle takes. Measurements run in a scratch directory created next to the
+// replica (so they hit the same filesystem) or, when that isn't possible, in the
+// system temporary directory; the replica itself is never touched.
+struct CostModel
+{
+    double file_ns = 0;
+    double byte_ns = 0;
+    double dir_ns = 0;
+    double remove_ns = 0;
+    double rename_ns = 0;
+
+    static constexpr size_t op_samples = 256;
+    static constexpr uint64_t byte_samples = 64 << 20;
+
+    // `samples` are source files the cycle is going to copy; up to byte_samples of
+    // them are copied to measure throughput, a synthetic file is used when they are
+    // too small to tell.
+    static CostModel measure(std::filesystem::path const& replica, std::vector<std::filesystem::path> const& samples)
+    {
+        namespace fs = std::filesystem;
+        using clock_t = std::chrono::steady_clock;
+
+        std::string const name = ".dirsync-plan-" + std::to_string(clock_t::now().time_since_epoch().count());
+        std::error_code ec;
+        fs::path scratch = fs::absolute(replica, ec).parent_path() / name;
+        if (false == fs::create_directory(scratch, ec))
+        {
+            scratch = fs::temp_directory_path() / name;
+            fs::create_directory(scratch);
+        }
+
+        CostModel model;
+        try
+        {
+            CopyEngine::throttle_t unlimited;
+            JobMetrics metrics;
+            CopyEngine engine(unlimited, unlimited, metrics);
+            DirHandleCache cache(scratch);
+
+            auto const elapsed_ns = [](clock_t::time_point since)
+            {
+                return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - since).count());
+            };
+
+            std::ofstream(scratch / "empty").close();
+            auto start = clock_t::now();
+            for (size_t i = 0; i < op_samples; ++i)
+                cache.make_directory("d" + std::to_string(i));
+            model.dir_ns = elapsed_ns(start) / op_samples;
+
+            start = clock_t::now();
+            for (size_t i = 0; i < op_samples; ++i)
+                engine.copy_file(scratch / "empty", cache, "d" + std::to_string(i) + "/f");
+            model.file_ns = elapsed_ns(start) / op_samples;
+
+            start = clock_t::now();
+            for (size_t i = 0; i < op_samples; ++i)
+                cache.rename("d" + std::to_string(i) + "/f", "d" + std::to_string(i) + "/r");
+            model.rename_ns = elapsed_ns(start) / op_samples;
+
+            start = clock_t::now();
+            for (size_t i = 0; i < op_samples; ++i)
+                cache.remove_file("d" + std::to_string(i) + "/r");
+            model.remove_ns = elapsed_ns(start) / op_samples;
+
+            uint64_t copied = 0;
+            size_t index = 0;
+            start = clock_t::now();
+            for (auto const& sample : samples)
+            {
+                if (copied >= byte_samples)
+                    break;
+                uint64_t const before = metrics.bytes_copied.load();
+                try
+                {
+                    engine.copy_file(sample, cache, "c" + std::to_string(index++));
+                }
+                catch (fs::filesystem_error const&)
+                {
+                    continue;
+                }
+                copied += metrics.bytes_copied.load() - before;
+            }
+            double copy_ns = elapsed_ns(start) - model.file_ns * static_cast<double>(index);
+
+            if (copied < (1 << 20))
+            {
+                {
+                    std::ofstream out(scratch / "synthetic", std::ios::binary);
+                    std::vector<char> const chunk(CopyEngine::chunk_size, 'x');
+                    for (uint64_t written = 0; written < byte_samples / 4; written += chunk.size())
+                        out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+                }
+                uint64_t const before = metrics.bytes_copied.load();
+                start = clock_t::now();
+                engine.copy_file(scratch / "synthetic", cache, "copy");
+                copy_ns = elapsed_ns(start) - model.file_ns;
+                copied = metrics.bytes_copied.load() - before;
+            }
+            model.byte_ns = std::max(0.0, copy_ns) / static_cast<double>(std::max<uint64_t>(1, copied));
+        }
+        catch (...)
+        {
+            fs::remove_all(scratch, ec);
+            throw;
+        }
+        fs::remove_all(scratch, ec);
+        return model;
+    }
+};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "DirHandleCache.h"
+#include "Logger.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+
+// Removes replica subtrees in parallel. Every directory is a node that a worker opens,
+// empties of non-directories with unlinkat and splits into child nodes; a directory
+// is removed by the worker that completes its last child. Workers push new nodes to
+// the back of their own deque and pop from there (depth-first, which keeps the number
+// of open descriptors low) and steal from the front of other deques when idle.
+//
+// Subtrees can also be moved into a trash directory inside the replica with a single
+// rename and purged in the background, so a sync cycle never waits for a big delete.
+// Shutdown doesn't wait for those purges either, what is left of them is purged again
+// at the next start.
+class DeleteEngine
+{
+public:
+
+    static constexpr char const* trash_name = ".dirsync-trash";
+
+private:
+
+    struct request_t
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false;
+        std::error_code error;
+        std::filesystem::path path;
+        // Trash purge nobody waits for, dropped on shutdown.
+        bool background = false;
+    };
+
+    struct node_t
+    {
+        std::shared_ptr<node_t> parent;
+        DirHandleCache::handle_ptr parent_handle;
+        DirHandleCache::handle_ptr handle;
+        std::string name;
+        std::atomic<size_t> pending{ 1 };
+        std::shared_ptr<request_t> request;
+    };
+
+    using node_ptr = std::shared_ptr<node_t>;
+
+    struct worker_queue_t
+    {
+        std::mutex mtx;
+        std::deque<node_ptr> nodes;
+    };
+
+    std::vector<std::unique_ptr<worker_queue_t>> queues;
+    std::vector<std::thread> workers;
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<size_t> queued{ 0 };
+    std::atomic<size_t> next_queue{ 0 };
+    std::atomic<uint64_t> trash_counter{ 0 };
+    std::atomic<bool> stopping{ false };
+    LogSink* const log_sink = Logger::current_sink();
+
+    static inline thread_local size_t worker_index = SIZE_MAX;
+
+public:
+
+    explicit DeleteEngine(size_t threads)
+    {
+        threads = std::max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i)
+            queues.push_back(std::make_unique<worker_queue_t>());
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(&DeleteEngine::worker_loop, this, i);
+    }
+
+    ~DeleteEngine(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    DeleteEngine(const DeleteEngine&) = delete;
+
+    DeleteEngine& operator=(const DeleteEngine&) = delete;
+
+    // Removes `relative` and everything below it, returns once it is gone.
+    void remove_tree(DirHandleCache& replica, std::filesystem::path const& relative)
+    {
+        replica.invalidate(relative);
+#ifndef _WIN32
+        DirHandleCache::handle_ptr parent = replica.get_dir(relative.parent_path(), false);
+        if (nullptr == parent)
+            return;
+        auto request = std::make_shared<request_t>();
+        request->path = replica.full_path(relative);
+        submit_root(std::move(parent), relative.filename().string(), request);
+
+        std::unique_lock<std::mutex> lock(request->mtx);
+        request->cv.wait(lock, [&] { return request->done; });
+        if (request->error)
+            throw std::filesystem::filesystem_error("Can't remove replica directory", request->path, request->error);
+#else
+        std::filesystem::remove_all(replica.full_path(relative));
+#endif
+    }
+
+    // Renames `relative` into the replica's trash directory and purges it in the
+    // background.
+    void defer_remove_tree(DirHandleCache& replica, std::filesystem::path const& relative)
+    {
+        replica.invalidate(relative);
+        std::string const unique = std::to_string(std::chrono::system_clock::now().time_since_epoch().count())
+            + "-" + std::to_string(trash_counter.fetch_add(1));
+#ifndef _WIN32
+        DirHandleCache::handle_ptr const parent = replica.get_dir(relative.parent_path(), false);
+        if (nullptr == parent)
+            return;
+        DirHandleCache::handle_ptr const trash = replica.get_dir(trash_name);
+        if (0 != ::renameat(parent->get(), relative.filename().c_str(), trash->get(), unique.c_str()))
+        {
+            if (ENOENT == errno)
+                return;
+            throw std::filesystem::filesystem_error("Can't move replica directory to trash", replica.full_path(relative), std::error_code(errno, std::generic_category()));
+        }
+        auto request = std::make_shared<request_t>();
+        request->path = replica.full_path(std::filesystem::path(trash_name) / unique);
+        request->background = true;
+        submit_root(trash, unique, request);
+#else
+        std::filesystem::path const trash = replica.full_path(trash_name);
+        if (false == std::filesystem::exists(replica.full_path(relative)))
+            return;
+        std::filesystem::create_directories(trash);
+        std::filesystem::rename(replica.full_path(relative), trash / unique);
+        std::filesystem::remove_all(trash / unique);
+#endif
+    }
+
+    // Purges whatever a previous run left in the trash directory, in the background.
+    void purge_trash(DirHandleCache& replica)
+    {
+#ifndef _WIN32
+        std::error_code ec;
+        if (false == std::filesystem::exists(replica.full_path(trash_name), ec))
+            return;
+        DirHandleCache::handle_ptr const trash = replica.get_dir(trash_name);
+        for (auto const& entry : std::filesystem::directory_iterator(replica.full_path(trash_name), ec))
+        {
+            auto request = std::make_shared<request_t>();
+            request->path = entry.path();
+            request->background = true;
+            submit_root(trash, entry.path().filename().string(), request);
+        }
+#else
+        std::filesystem::remove_all(replica.full_path(trash_name));
+#endif
+    }
+
+private:
+
+#ifndef _WIN32
+    void submit_root(DirHandleCache::handle_ptr parent_handle, std::string name, std::shared_ptr<request_t> request)
+    {
+        auto node = std::make_shared<node_t>();
+        node->parent_handle = std::move(parent_handle);
+        node->name = std::move(name);
+        node->request = std::move(request);
+        push(std::move(node));
+    }
+
+    void push(node_ptr node)
+    {
+        size_t const index = worker_index < queues.size() ? worker_index : next_queue.fetch_add(1) % queues.size();
+        queued.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mtx);
+            queues[index]->nodes.push_back(std::move(node));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+        }
+        idle_cv.notify_one();
+    }
+
+    node_ptr pop(size_t index)
+    {
+        {
+            worker_queue_t& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (false == own.nodes.empty())
+            {
+                node_ptr node = std::move(own.nodes.back());
+                own.nodes.pop_back();
+                return node;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            worker_queue_t& victim = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (false == victim.nodes.empty())
+            {
+                node_ptr node = std::move(victim.nodes.front());
+                victim.nodes.pop_front();
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    void process(node_ptr const& node)
+    {
+        int const fd = ::openat(node->parent_handle->get(), node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (ENOTDIR == errno || ELOOP == errno)
+                unlink_entry(node, node->parent_handle->get(), node->name, 0);
+            else if (ENOENT != errno)
+                set_error(node, errno);
+            complete(node);
+            return;
+        }
+        node->handle = std::make_shared<DirHandleCache::handle_t>(fd);
+
+        int const list_fd = ::dup(fd);
+        DIR* dir = list_fd < 0 ? nullptr : ::fdopendir(list_fd);
+        if (nullptr == dir)
+        {
+            if (list_fd >= 0)
+                ::close(list_fd);
+            set_error(node, errno);
+            complete(node);
+            return;
+        }
+
+        while (dirent* entry = ::readdir(dir))
+        {
+            if (0 == std::strcmp(entry->d_name, ".") || 0 == std::strcmp(entry->d_name, ".."))
+                continue;
+
+            bool is_dir = DT_DIR == entry->d_type;
+            if (DT_UNKNOWN == entry->d_type)
+            {
+                struct stat st;
+                is_dir = 0 == ::fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+            }
+
+            if (is_dir)
+            {
+                auto child = std::make_shared<node_t>();
+                child->parent = node;
+                child->parent_handle = node->handle;
+                child->name = entry->d_name;
+                child->request = node->request;
+                node->pending.fetch_add(1);
+                push(std::move(child));
+            }
+            else
+                unlink_entry(node, fd, entry->d_name, 0);
+        }
+        ::closedir(dir);
+        complete(node);
+    }
+
+    void complete(node_ptr node)
+    {
+        while (node && 1 == node->pending.fetch_sub(1))
+        {
+            node->handle.reset();
+            unlink_entry(node, node->parent_handle->get(), node->name, AT_REMOVEDIR);
+
+            if (nullptr == node->parent)
+            {
+                auto const& request = node->request;
+                {
+                    std::lock_guard<std::mutex> lock(request->mtx);
+                    request->done = true;
+                }
+                request->cv.notify_all();
+                if (request->error)
+                    Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Can't remove %s: %s", request->path.generic_string().c_str(), request->error.message().c_str());
+            }
+            node = node->parent;
+        }
+    }
+
+    void unlink_entry(node_ptr const& node, int dir_fd, std::string const& name, int flags)
+    {
+        if (0 != ::unlinkat(dir_fd, name.c_str(), flags) && ENOENT != errno)
+            set_error(node, errno);
+    }
+
+    static void set_error(node_ptr const& node, int error)
+    {
+        std::lock_guard<std::mutex> lock(node->request->mtx);
+        if (false == static_cast<bool>(node->request->error))
+            node->request->error = std::error_code(error, std::generic_category());
+    }
+#endif
+
+    void worker_loop(size_t index)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        worker_index = index;
+        while (true)
+        {
+#ifndef _WIN32
+            if (node_ptr node = pop(index))
+            {
+                queued.fetch_sub(1);
+                if (false == (node->request->background && stopping.load()))
+                    process(node);
+                continue;
+            }
+#endif
+            std::unique_lock<std::mutex> lock(idle_mtx);
+            if (stopping && 0 == queued.load())
+                return;
+            idle_cv.wait(lock, [this] { return stopping || queued.load() > 0; });
+        }
+    }
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+
+// Resolves paths relative to a replica root. On POSIX systems every replica directory
+// that has been touched keeps an open descriptor (LRU-bounded), keyed by its relative
+// path, and files are reached with openat/mkdirat/unlinkat against the parent's
+// descriptor, so deep trees don't pay for a full path walk in the kernel on every
+// operation. Missing parents are created on the way down.
+class DirHandleCache
+{
+public:
+
+    class handle_t
+    {
+        int fd;
+
+    public:
+
+        explicit handle_t(int fd_)
+            : fd(fd_)
+        {
+        }
+
+        ~handle_t(void)
+        {
+#ifndef _WIN32
+            if (fd >= 0)
+                ::close(fd);
+#endif
+        }
+
+        handle_t(const handle_t&) = delete;
+
+        handle_t& operator=(const handle_t&) = delete;
+
+        int get(void) const
+        {
+            return fd;
+        }
+    };
+
+    using handle_ptr = std::shared_ptr<handle_t>;
+
+private:
+
+    struct cached_t
+    {
+        handle_ptr handle;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::filesystem::path const root;
+    size_t const capacity;
+    std::mutex mtx;
+    std::unordered_map<std::string, cached_t> handles;
+    std::list<std::string> lru;
+
+public:
+
+    explicit DirHandleCache(std::filesystem::path root_, size_t capacity_ = 1024)
+        : root(std::move(root_))
+        , capacity(capacity_)
+    {
+    }
+
+    DirHandleCache(const DirHandleCache&) = delete;
+
+    DirHandleCache& operator=(const DirHandleCache&) = delete;
+
+    std::filesystem::path const& get_root(void) const
+    {
+        return root;
+    }
+
+    std::filesystem::path full_path(std::filesystem::path const& relative) const
+    {
+        return relative.empty() ? root : root / relative;
+    }
+
+#ifndef _WIN32
+    // Descriptor of a replica directory, creating it (and its parents) if needed.
+    // With create == false a missing directory yields nullptr.
+    handle_ptr get_dir(std::filesystem::path const& relative, bool create = true)
+    {
+        std::string const key = relative.generic_string();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto const it = handles.find(key);
+            if (it != handles.end())
+            {
+                lru.splice(lru.begin(), lru, it->second.lru_pos);
+                return it->second.handle;
+            }
+        }
+
+        int fd = -1;
+        if (relative.empty())
+        {
+            fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 && ENOENT == errno && create && 0 == ::mkdir(root.c_str(), 0777))
+                fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        else
+        {
+            handle_ptr const parent = get_dir(relative.parent_path(), create);
+            if (nullptr == parent)
+                return nullptr;
+            std::string const name = relative.filename().string();
+            fd = ::openat(parent->get(), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0 && ENOENT == errno && create && (0 == ::mkdirat(parent->get(), name.c_str(), 0777) || EEXIST == errno))
+                fd = ::openat(parent->get(), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd < 0 && false == create && (ENOENT == errno || ENOTDIR == errno))
+            return nullptr;
+        if (fd < 0)
+            throw std::filesystem::filesystem_error("Can't open replica directory", full_path(relative), std::error_code(errno, std::generic_category()));
+
+        auto handle = std::make_shared<handle_t>(fd);
+        std::lock_guard<std::mutex> lock(mtx);
+        auto const [it, inserted] = handles.try_emplace(key);
+        if (false == inserted)
+            return it->second.handle;
+        lru.push_front(key);
+        it->second = { handle, lru.begin() };
+        while (handles.size() > capacity)
+        {
+            handles.erase(lru.back());
+            lru.pop_back();
+        }
+        return handle;
+    }
+
+    // Opens a file inside the replica; the returned descriptor is owned by the caller.
+    int open_file(std::filesystem::path const& relative, int flags, mode_t mode)
+    {
+        handle_ptr const parent = get_dir(relative.parent_path());
+        return ::openat(parent->get(), relative.filename().c_str(), flags | O_CLOEXEC, mode);
+    }
+
+    // lstat() of a replica entry through its cached parent; false when it is missing.
+    bool stat(std::filesystem::path const& relative, struct stat& st)
+    {
+        handle_ptr const parent = get_dir(relative.parent_path(), false);
+        return nullptr != parent && 0 == ::fstatat(parent->get(), relative.filename().c_str(), &st, AT_SYMLINK_NOFOLLOW);
+    }
+#endif
+
+    void make_directory(std::filesystem::path const& relative)
+    {
+#ifndef _WIN32
+        get_dir(relative);
+#else
+        std::filesystem::create_directories(full_path(relative));
+#endif
+    }
+
+    bool remove_file(std::filesystem::path const& relative)
+    {
+#ifndef _WIN32
+        handle_ptr const parent = get_dir(relative.parent_path(), false);
+        if (nullptr == parent)
+            return false;
+        if (0 == ::unlinkat(parent->get(), relative.filename().c_str(), 0))
+            return true;
+        if (ENOENT == errno)
+            return false;
+        throw std::filesystem::filesystem_error("Can't remove replica file", full_path(relative), std::error_code(errno, std::generic_category()));
+#else
+        return std::filesystem::remove(full_path(relative));
+#endif
+    }
+
+    // Returns false when the source doesn't exist in the replica.
+    bool rename(std::filesystem::path const& from, std::filesystem::path const& to)
+    {
+        invalidate(from);
+#ifndef _WIN32
+        handle_ptr const from_parent = get_dir(from.parent_path(), false);
+        if (nullptr == from_parent)
+            return false;
+        handle_ptr const to_parent = get_dir(to.parent_path());
+        if (0 == ::renameat(from_parent->get(), from.filename().c_str(), to_parent->get(), to.filename().c_str()))
+            return true;
+        if (ENOENT == errno)
+            return false;
+        throw std::filesystem::filesystem_error("Can't rename replica entry", full_path(from), full_path(to), std::error_code(errno, std::generic_category()));
+#else
+        std::error_code ec;
+        if (false == std::filesystem::exists(full_path(from), ec))
+            return false;
+        std::filesystem::create_directories(full_path(to).parent_path());
+        std::filesystem::rename(full_path(from), full_path(to));
+        return true;
+#endif
+    }
+
+    // Drops cached descriptors of a directory and everything below it, to be called
+    // before the directory is removed or renamed.
+    void invalidate(std::filesystem::path const& relative)
+    {
+        std::string const key = relative.generic_string();
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = handles.begin(); it != handles.end();)
+        {
+            std::string const& cached = it->first;
+            bool const below = key.empty()
+                || (0 == cached.compare(0, key.size(), key) && (cached.size() == key.size() || '/' == cached[key.size()]));
+            if (below)
+            {
+                lru.erase(it->second.lru_pos);
+                it = handles.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+};
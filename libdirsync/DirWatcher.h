@@ -0,0 +1,1209 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+#include <atomic>
+#include <string>
+#include <set>
+#include <vector>
+#include <map>
+#include <optional>
+#include <tuple>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <span>
+#include "Logger.h"
+#include "Config.h"
+#include "IoScheduler.h"
+#include "Metrics.h"
+#include "FileInfo.h"
+#include "FilterEngine.h"
+#include "Journal.h"
+#include "Task.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+
+class DirWatcherCallbackBase
+{
+public:
+    DirWatcherCallbackBase(void) = default;
+    virtual ~DirWatcherCallbackBase(void) = default;
+
+    enum class action_t { CREATE, MODIFY, DELETE, RENAME, METADATA, UNEXPECTED_ACTION };
+    // Symbolic links are replicated as links, SPECIAL covers FIFOs and device nodes.
+    enum class file_t { DIRECTORY, REGULAR, SYMLINK, SPECIAL, UNEXPECTED_FILE };
+
+    static char const* get_action_str(action_t action)
+    {
+        switch (action)
+        {
+        case DirWatcherCallbackBase::action_t::CREATE:
+            return "created";
+        case DirWatcherCallbackBase::action_t::MODIFY:
+            return "modified";
+        case DirWatcherCallbackBase::action_t::DELETE:
+            return "deleted";
+        case DirWatcherCallbackBase::action_t::RENAME:
+            return "renamed";
+        case DirWatcherCallbackBase::action_t::METADATA:
+            return "updated";
+        case DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION:
+            throw std::runtime_error("Unexpected action has been detected");
+        default:
+            return nullptr;
+        }
+    }
+
+    static char const* get_file_str(const file_t file)
+    {
+        switch (file)
+        {
+        case DirWatcherCallbackBase::file_t::DIRECTORY:
+            return "Directory";
+        case DirWatcherCallbackBase::file_t::REGULAR:
+            return "Regular file";
+        case DirWatcherCallbackBase::file_t::SYMLINK:
+            return "Symbolic link";
+        case DirWatcherCallbackBase::file_t::SPECIAL:
+            return "Special file";
+        case DirWatcherCallbackBase::file_t::UNEXPECTED_FILE:
+            throw std::runtime_error("Action has been detected for unexpected file type");
+        default:
+            return nullptr;
+        }
+    }
+
+    // One entry of a change set. path_id indexes the path_table_t handed over with
+    // the records.
+    struct change_record_t
+    {
+        uint32_t path_id;
+        action_t action;
+        file_t file;
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t ino;
+    };
+
+    // Relative paths of a change set, stored once per batch.
+    class path_table_t
+    {
+        std::vector<fs::path> paths;
+
+    public:
+
+        uint32_t add(fs::path relative)
+        {
+            paths.push_back(std::move(relative));
+            return static_cast<uint32_t>(paths.size() - 1);
+        }
+
+        fs::path const& operator[](uint32_t id) const
+        {
+            return paths[id];
+        }
+
+        size_t size(void) const
+        {
+            return paths.size();
+        }
+    };
+
+    virtual void log(action_t action, file_t file, std::string const& name) const = 0;
+    // relative_path is the location of path below the source root, which is also its
+    // location below the replica root directory_path.
+    virtual void report_action(action_t action, file_t file, fs::path const& path, fs::path const& relative_path, std::string const& directory_path) = 0;
+    // Moves old_relative_path to relative_path inside the replica; directories are
+    // moved with their content. Returning false makes the watcher fall back to a copy
+    // of the new path and a deletion of the old one.
+    virtual bool report_rename(file_t file, fs::path const& old_relative_path, fs::path const& path, fs::path const& relative_path, std::string const& directory_path)
+    {
+        (void)file; (void)old_relative_path; (void)path; (void)relative_path; (void)directory_path;
+        return false;
+    }
+    // Whether the replica already holds `relative` as described by `info`, judged by
+    // size and mtime alone. The watcher leaves such files out of a cycle.
+    virtual bool is_in_sync(fs::path const& relative, FileInfo const& info)
+    {
+        (void)relative; (void)info;
+        return false;
+    }
+    // A non-zero batch size makes the watcher hand file operations over through
+    // report_batch, grouped by directory and priority class, at most that many per call.
+    virtual size_t get_batch_size(void) const
+    {
+        return 0;
+    }
+    // Applies a change set; records are in path order. The default reports them one
+    // by one. Throwing fails the whole batch.
+    virtual void report_batch(std::span<change_record_t const> records, path_table_t const& paths, fs::path const& source_root, std::string const& directory_path)
+    {
+        for (auto const& record : records)
+            report_action(record.action, record.file, source_root / paths[record.path_id], paths[record.path_id], directory_path);
+    }
+    // Coroutine flavour of report_action for file operations of jobs with
+    // async_callbacks enabled. Overrides co_await offloaded I/O and other tasks
+    // instead of blocking a copy thread; the default runs report_action.
+    virtual Task<void> report_action_async(action_t action, file_t file, fs::path path, fs::path relative_path, std::string directory_path)
+    {
+        report_action(action, file, path, relative_path, directory_path);
+        co_return;
+    }
+};
+
+inline void DirWatcherCallbackBase::log(const action_t action, const file_t file, std::string const& name) const
+{
+    std::cout << "The " << get_file_str(file) << " " << name << " has been " << get_action_str(action) << std::endl;
+}
+
+
+class DirWatcher final
+{
+    using action_t = DirWatcherCallbackBase::action_t;
+    using file_t = DirWatcherCallbackBase::file_t;
+    using priority_t = IoScheduler::priority_t;
+
+    struct entry_info_t
+    {
+        file_t file = file_t::UNEXPECTED_FILE;
+        FileInfo info;
+        // Kept from being copied by a size or age predicate, only during a scan.
+        bool held = false;
+    };
+
+    // Keyed by the path relative to the source root. fs::path compares element-wise,
+    // so a directory is directly followed by all of its descendants.
+    using snapshot_t = std::map<fs::path, entry_info_t>;
+
+public:
+
+    struct pending_action_t
+    {
+        action_t action;
+        file_t file;
+        fs::path relative;
+        FileInfo info;
+        priority_t priority = priority_t::NORMAL;
+        fs::path old_relative;
+        uint64_t seq = 0;
+        // When the scan found the change, replication lag is measured from here.
+        int64_t detected_ns = 0;
+    };
+
+    struct plan_t
+    {
+        std::vector<pending_action_t> inline_actions;
+        std::vector<pending_action_t> file_actions;
+        std::vector<pending_action_t> dir_deletes;
+    };
+
+private:
+
+    snapshot_t snapshot;
+
+    static constexpr size_t name_len = 1024;
+    // Metadata updates are a few system calls each, so they always go out as change
+    // sets of at least this many entries.
+    static constexpr size_t metadata_batch_size = 256;
+
+    std::string name;
+    std::string source = "Source";
+    std::string replica = "Replica";
+    size_t synch_interval;
+    std::vector<fs::path> priority_paths;
+    uint64_t small_file_size;
+    std::chrono::seconds hot_age;
+    FilterEngine filter;
+    DirWatcherCallbackBase* callback;
+    JobMetrics& metrics;
+    Journal* journal;
+    std::atomic<bool> const* cancelled;
+    bool const async_callbacks;
+
+    // Bulk transfers outlive the cycle that queued them; their paths are skipped by
+    // later scans until they complete.
+    std::mutex in_flight_mtx;
+    std::set<fs::path> in_flight;
+
+    // Paths whose action failed, with the snapshot entry to put back before the next
+    // scan, or none to drop the path, so that the scan finds the change again.
+    std::mutex failed_mtx;
+    std::map<fs::path, std::optional<entry_info_t>> failed;
+
+public:
+
+    // Once *cancelled_ becomes true scans stop early and pending operations are
+    // skipped, so a cycle winds down quickly.
+    DirWatcher(JobConfig const& config, DirWatcherCallbackBase* callback_, JobMetrics& metrics_, Journal* journal_ = nullptr,
+        std::atomic<bool> const* cancelled_ = nullptr)
+        : name(config.name)
+        , source(config.source)
+        , replica(config.replica)
+        , synch_interval(config.synch_interval)
+        , small_file_size(config.small_file_size)
+        , hot_age(config.hot_age)
+        , callback(callback_)
+        , metrics(metrics_)
+        , journal(journal_)
+        , cancelled(cancelled_)
+        , async_callbacks(config.async_callbacks)
+    {
+        for (auto const& prefix : config.priority_paths)
+        {
+            fs::path path = fs::path(prefix).lexically_normal();
+            if (false == path.has_filename())
+                path = path.parent_path();
+            priority_paths.push_back(std::move(path));
+        }
+        for (auto const& file : config.filter_files)
+            filter.load_file(file);
+        for (auto const& rule : config.filters)
+            filter.add_rule(rule);
+    }
+
+    DirWatcher(const DirWatcher&) = delete;
+
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    DirWatcher(DirWatcher&&) = delete;
+
+    DirWatcher& operator=(DirWatcher&&) = delete;
+
+    std::string const& get_name(void) const
+    {
+        return name;
+    }
+
+    std::string const& get_source(void) const
+    {
+        return source;
+    }
+
+    size_t get_synch_interval(void) const
+    {
+        return synch_interval;
+    }
+
+    // Starts from a replica state recorded by a journal instead of an empty one, so
+    // the first cycle only does what is missing.
+    void restore(Journal::state_t const& state)
+    {
+        snapshot.clear();
+        for (auto const& [relative, entry] : state)
+        {
+            file_t file = entry.directory ? file_t::DIRECTORY : file_t::REGULAR;
+#ifndef _WIN32
+            // Journals written before modes were recorded only tell directories from files.
+            if (0 != entry.info.mode)
+                file = get_file_type(entry.info.mode);
+#endif
+            snapshot.emplace(relative, entry_info_t{ file, entry.info });
+        }
+    }
+
+    // Runs one synchronization cycle. Renames and directory creations are applied
+    // inline in path order, file operations go through the I/O scheduler and
+    // directory deletions are applied once every high and normal priority operation
+    // finished. Bulk transfers keep running in the background. on_done is invoked
+    // when the cycle is over, from whichever thread completed it. With `subtrees`
+    // (relative to the source) only those parts of the source are rescanned.
+    void run_cycle(size_t job_id, IoScheduler& io_scheduler, std::function<void(void)> on_done, std::vector<fs::path> const& subtrees = {})
+    {
+        std::vector<fs::path> scopes = get_scan_scopes(subtrees);
+        if (false == scopes.empty())
+        {
+            std::string list;
+            for (auto const& scope : scopes)
+                list += (list.empty() ? "" : ", ") + scope.generic_string();
+            Logger::logf(Logger::severity_t::DEBUG, __FILE__, __LINE__, "Job %s: rescanning %s", name.c_str(), list.c_str());
+        }
+        plan_t plan = scan(scopes);
+        for (auto* actions : { &plan.inline_actions, &plan.file_actions, &plan.dir_deletes })
+        {
+            for (auto& action : *actions)
+                journal_plan(action);
+        }
+        // A failed action is retried by the next cycle, the others still go ahead.
+        for (auto const& action : plan.inline_actions)
+        {
+            try
+            {
+                if (action_t::RENAME == action.action)
+                    apply_rename(action, plan);
+                else
+                    report(action);
+            }
+            catch (...)
+            {
+                log_failure(std::current_exception());
+            }
+        }
+
+        auto finish = [this, dir_deletes = std::move(plan.dir_deletes), scopes = std::move(scopes), on_done = std::move(on_done)]()
+        {
+            for (auto const& action : dir_deletes)
+            {
+                try
+                {
+                    report(action);
+                }
+                catch (...)
+                {
+                    log_failure(std::current_exception());
+                }
+            }
+            if (journal)
+            {
+                try
+                {
+                    journal->checkpoint(scopes);
+                }
+                catch (std::exception const& e)
+                {
+                    Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Can't checkpoint the journal of job %s: %s", name.c_str(), e.what());
+                }
+            }
+            on_done();
+        };
+
+        size_t const batch_size = callback->get_batch_size();
+        std::vector<std::vector<pending_action_t>> batches = make_batches(std::move(plan.file_actions), batch_size);
+        size_t const foreground = std::count_if(batches.begin(), batches.end(),
+            [](std::vector<pending_action_t> const& batch) { return priority_t::BULK != batch.front().priority; });
+
+        auto shared_finish = std::make_shared<decltype(finish)>(std::move(finish));
+        auto remaining = std::make_shared<std::atomic<size_t>>(foreground);
+        // A network replica ("tcp://...") can't be stat'ed and shares device 0.
+        uint64_t const replica_dev = FileInfo::get(replica).dev;
+        for (auto& batch : batches)
+        {
+            pending_action_t const& first = batch.front();
+            IoScheduler::io_op_t op;
+            op.job_id = job_id;
+            op.priority = first.priority;
+            op.src_dev = action_t::DELETE == first.action ? replica_dev : first.info.dev;
+            op.dst_dev = replica_dev;
+            op.ino = std::min_element(batch.begin(), batch.end(),
+                [](pending_action_t const& a, pending_action_t const& b) { return a.info.ino < b.info.ino; })->info.ino;
+            std::function<void(void)> on_finished;
+            if (priority_t::BULK == first.priority)
+            {
+                std::vector<fs::path> relatives;
+                {
+                    std::lock_guard<std::mutex> lock(in_flight_mtx);
+                    for (auto const& action : batch)
+                    {
+                        in_flight.insert(action.relative);
+                        relatives.push_back(action.relative);
+                    }
+                }
+                on_finished = [this, relatives = std::move(relatives)]()
+                {
+                    for (auto const& relative : relatives)
+                        release(relative);
+                };
+            }
+            else
+            {
+                on_finished = [remaining, shared_finish]()
+                {
+                    if (1 == remaining->fetch_sub(1))
+                        (*shared_finish)();
+                };
+            }
+
+            if (0 != batch_size || action_t::METADATA == first.action)
+            {
+                op.task = [this, batch = std::move(batch), on_finished]()
+                {
+                    try
+                    {
+                        report_batch(batch);
+                    }
+                    catch (...)
+                    {
+                        on_finished();
+                        throw;
+                    }
+                    on_finished();
+                };
+            }
+            else if (async_callbacks)
+            {
+                op.async_task = [this, action = std::move(batch.front()), on_finished](std::function<void(void)> done)
+                {
+                    report_async(action).start([on_finished, done](std::exception_ptr error)
+                    {
+                        if (error)
+                            log_failure(error);
+                        on_finished();
+                        done();
+                    });
+                };
+            }
+            else
+            {
+                op.task = [this, action = std::move(batch.front()), on_finished]()
+                {
+                    try
+                    {
+                        report(action);
+                    }
+                    catch (...)
+                    {
+                        on_finished();
+                        throw;
+                    }
+                    on_finished();
+                };
+            }
+            io_scheduler.submit(std::move(op));
+        }
+
+        if (0 == foreground)
+            (*shared_finish)();
+    }
+
+    // Scans exactly like run_cycle does and hands every operation the cycle would
+    // issue to `visit`, in the same order, without applying any of them.
+    void plan_cycle(std::function<void(pending_action_t const& action, bool is_inline)> const& visit)
+    {
+        plan_t const plan = scan();
+        for (auto const& action : plan.inline_actions)
+            visit(action, true);
+        for (auto const& action : plan.file_actions)
+            visit(action, false);
+        for (auto const& action : plan.dir_deletes)
+            visit(action, true);
+    }
+
+    // Two-way jobs apply changes themselves: collect() scans the whole source and
+    // returns what a cycle would do, recording the scanned state as if it had been
+    // applied. After writing to this watcher's source, refresh() takes the result into
+    // the snapshot so the next scan doesn't report it back; forget() drops a subtree,
+    // which the next scan then reports as created.
+    plan_t collect(void)
+    {
+        return scan();
+    }
+
+    void refresh(fs::path const& relative)
+    {
+        forget(relative);
+        snapshot.merge(walk(relative));
+    }
+
+    void forget(fs::path const& relative)
+    {
+        auto it = snapshot.lower_bound(relative);
+        while (it != snapshot.end() && is_below(it->first, relative))
+            it = snapshot.erase(it);
+    }
+
+private:
+
+#ifndef _WIN32
+    // Sockets can't be replicated and are left out.
+    static file_t get_file_type(uint32_t mode)
+    {
+        switch (mode & S_IFMT)
+        {
+        case S_IFREG:
+            return file_t::REGULAR;
+        case S_IFDIR:
+            return file_t::DIRECTORY;
+        case S_IFLNK:
+            return file_t::SYMLINK;
+        case S_IFIFO:
+        case S_IFCHR:
+        case S_IFBLK:
+            return file_t::SPECIAL;
+        default:
+            return file_t::UNEXPECTED_FILE;
+        }
+    }
+#else
+    static file_t get_file_type(fs::file_status const& status)
+    {
+        if (fs::is_symlink(status))
+            return file_t::SYMLINK;
+        if (fs::is_regular_file(status))
+            return file_t::REGULAR;
+        if (fs::is_directory(status))
+            return file_t::DIRECTORY;
+        return file_t::UNEXPECTED_FILE;
+    }
+#endif
+
+    bool is_cancelled(void) const
+    {
+        return cancelled && cancelled->load(std::memory_order_relaxed);
+    }
+
+    // Cancelled operations stay planned in the journal, which keeps the progress of
+    // interrupted copies.
+    void report(pending_action_t const& action)
+    {
+        if (is_cancelled())
+            return;
+        try
+        {
+            callback->report_action(action.action, action.file, source / action.relative, action.relative, replica);
+        }
+        catch (...)
+        {
+            if (is_cancelled())
+                return;
+            if (journal)
+                journal->abandon(action.seq);
+            record_failure(action);
+            throw;
+        }
+        if (journal)
+            journal->done(action.seq);
+        record_lag(action);
+    }
+
+    void report_batch(std::vector<pending_action_t> const& batch)
+    {
+        if (is_cancelled())
+            return;
+        DirWatcherCallbackBase::path_table_t paths;
+        std::vector<DirWatcherCallbackBase::change_record_t> records;
+        records.reserve(batch.size());
+        for (auto const& action : batch)
+            records.push_back({ paths.add(action.relative), action.action, action.file, action.info.size, action.info.mtime_ns, action.info.ino });
+        try
+        {
+            callback->report_batch(records, paths, source, replica);
+        }
+        catch (...)
+        {
+            if (is_cancelled())
+                return;
+            for (auto const& action : batch)
+            {
+                if (journal)
+                    journal->abandon(action.seq);
+                record_failure(action);
+            }
+            throw;
+        }
+        for (auto const& action : batch)
+        {
+            if (journal)
+                journal->done(action.seq);
+            record_lag(action);
+        }
+    }
+
+    // Without a batch size every action is a batch of its own, apart from metadata
+    // updates. Otherwise actions are grouped by parent directory and priority class,
+    // keeping path order; metadata updates form batches of their own.
+    static std::vector<std::vector<pending_action_t>> make_batches(std::vector<pending_action_t> actions, size_t batch_size)
+    {
+        std::vector<std::vector<pending_action_t>> batches;
+        std::map<std::tuple<fs::path, priority_t, bool>, size_t> open;
+        for (auto& action : actions)
+        {
+            bool const metadata = action_t::METADATA == action.action;
+            size_t const limit = metadata ? std::max(batch_size, metadata_batch_size) : batch_size;
+            if (0 == limit)
+            {
+                batches.emplace_back().push_back(std::move(action));
+                continue;
+            }
+            auto const [it, inserted] = open.try_emplace({ action.relative.parent_path(), action.priority, metadata }, batches.size());
+            if (inserted || batches[it->second].size() >= limit)
+            {
+                it->second = batches.size();
+                batches.emplace_back().reserve(std::min<size_t>(limit, actions.size()));
+            }
+            batches[it->second].push_back(std::move(action));
+        }
+        return batches;
+    }
+
+    Task<void> report_async(pending_action_t action)
+    {
+        if (is_cancelled())
+            co_return;
+        std::exception_ptr error;
+        try
+        {
+            co_await callback->report_action_async(action.action, action.file, source / action.relative, action.relative, replica);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        if (error)
+        {
+            if (is_cancelled())
+                co_return;
+            if (journal)
+                journal->abandon(action.seq);
+            record_failure(action);
+            std::rethrow_exception(error);
+        }
+        if (journal)
+            journal->done(action.seq);
+        record_lag(action);
+    }
+
+    static void log_failure(std::exception_ptr error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (std::exception const& e)
+        {
+            Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Task failed: %s", e.what());
+        }
+        catch (...)
+        {
+        }
+    }
+
+    void journal_plan(pending_action_t& action)
+    {
+        if (nullptr == journal)
+            return;
+        Journal::op_t const op = action_t::CREATE == action.action ? Journal::op_t::CREATE
+            : action_t::MODIFY == action.action ? Journal::op_t::MODIFY
+            : action_t::DELETE == action.action ? Journal::op_t::DELETE
+            : action_t::METADATA == action.action ? Journal::op_t::METADATA
+            : Journal::op_t::RENAME;
+        action.seq = journal->plan(op, file_t::DIRECTORY == action.file, action.relative, action.info, action.old_relative);
+    }
+
+    // The scan already took the new state into the snapshot; a failed deletion puts
+    // the old entry back so it is deleted again, a failed metadata update an entry
+    // whose ctime differs, anything else drops the path so it is created again. A
+    // deletion clearing the way for an entry of another type takes precedence.
+    void record_failure(pending_action_t const& action)
+    {
+        std::optional<entry_info_t> restore;
+        if (action_t::DELETE == action.action || action_t::METADATA == action.action)
+            restore = entry_info_t{ action.file, action.info };
+        if (action_t::METADATA == action.action)
+            restore->info.ctime_ns -= 1;
+        std::lock_guard<std::mutex> lock(failed_mtx);
+        auto const [it, inserted] = failed.try_emplace(action.relative, restore);
+        if (false == inserted && action_t::DELETE == action.action)
+            it->second = restore;
+    }
+
+    void restore_failed(void)
+    {
+        std::lock_guard<std::mutex> lock(failed_mtx);
+        for (auto const& [relative, entry] : failed)
+        {
+            if (entry)
+                snapshot[relative] = *entry;
+            else
+                forget(relative);
+        }
+        failed.clear();
+    }
+
+    void record_lag(pending_action_t const& action)
+    {
+        if (0 == action.detected_ns)
+            return;
+        int64_t const lag = std::max<int64_t>(0, FileInfo::now_ns() - action.detected_ns);
+        metrics.lag[static_cast<size_t>(action.priority)].record(std::chrono::nanoseconds(lag));
+    }
+
+    // A failed rename falls back to copying the new path and deleting the old one. For
+    // directories the new subtree is dropped from the snapshot so the next cycle
+    // copies it.
+    void apply_rename(pending_action_t const& action, plan_t& plan)
+    {
+        if (is_cancelled())
+            return;
+        bool renamed = false;
+        try
+        {
+            renamed = callback->report_rename(action.file, action.old_relative, source / action.relative, action.relative, replica);
+        }
+        catch (std::exception const& e)
+        {
+            Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Can't rename %s to %s: %s",
+                action.old_relative.generic_string().c_str(), action.relative.generic_string().c_str(), e.what());
+        }
+        if (renamed)
+        {
+            if (journal)
+                journal->done(action.seq);
+            record_lag(action);
+            return;
+        }
+        if (journal)
+            journal->abandon(action.seq);
+
+        pending_action_t remove = action;
+        remove.action = action_t::DELETE;
+        remove.relative = action.old_relative;
+        remove.old_relative.clear();
+        journal_plan(remove);
+        if (file_t::DIRECTORY == action.file)
+        {
+            plan.dir_deletes.push_back(std::move(remove));
+            auto it = snapshot.find(action.relative);
+            while (it != snapshot.end() && is_below(it->first, action.relative))
+                it = snapshot.erase(it);
+        }
+        else
+        {
+            pending_action_t copy = action;
+            copy.action = action_t::CREATE;
+            copy.old_relative.clear();
+            journal_plan(copy);
+            plan.file_actions.push_back(std::move(remove));
+            plan.file_actions.push_back(std::move(copy));
+        }
+    }
+
+    void release(fs::path const& relative)
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        in_flight.erase(relative);
+    }
+
+    bool is_in_flight(fs::path const& relative)
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        return in_flight.contains(relative);
+    }
+
+    static bool is_below(fs::path const& path, fs::path const& dir)
+    {
+        auto const [dir_end, path_it] = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+        return dir_end == dir.end();
+    }
+
+    static fs::path rebase(fs::path const& path, fs::path const& from, fs::path const& to)
+    {
+        return to / path.lexically_relative(from);
+    }
+
+    priority_t classify(fs::path const& relative, FileInfo const& info) const
+    {
+        for (auto const& prefix : priority_paths)
+        {
+            if (is_below(relative, prefix))
+                return priority_t::HIGH;
+        }
+        if (info.size > small_file_size)
+            return priority_t::BULK;
+        if (FileInfo::now_ns() - info.mtime_ns < std::chrono::duration_cast<std::chrono::nanoseconds>(hot_age).count())
+            return priority_t::HIGH;
+        return priority_t::NORMAL;
+    }
+
+    static bool same_content(entry_info_t const& a, entry_info_t const& b)
+    {
+        return a.info.size == b.info.size && a.info.mtime_ns == b.info.mtime_ns;
+    }
+
+    // chmod, chown, setfattr and touch -a move the ctime but neither the mtime nor the
+    // size; writes move the mtime as well, and so do entries added to a directory.
+    static bool metadata_changed(entry_info_t const& a, entry_info_t const& b)
+    {
+        return a.file == b.file && 0 != a.info.ctime_ns && a.info.ctime_ns != b.info.ctime_ns && same_content(a, b);
+    }
+
+    // A file the replica holds with the same size and mtime needs no copy, which spares
+    // a restart without a journal from reading any data.
+    bool in_sync(fs::path const& relative, entry_info_t const& entry)
+    {
+        return callback && file_t::DIRECTORY != entry.file && callback->is_in_sync(relative, entry.info);
+    }
+
+    // Walks the whole source, or only `subtree` (relative to it) including the subtree
+    // root itself. Links are never followed and excluded directories are not descended
+    // into. A cancelled walk is incomplete.
+    snapshot_t walk(fs::path const& subtree = {})
+    {
+        snapshot_t current;
+        int64_t const now = FileInfo::now_ns();
+        fs::path const root = subtree.empty() ? fs::path(source) : source / subtree;
+        std::error_code ec;
+        FileInfo const info = FileInfo::get(root, ec);
+        if (ec && subtree.empty())
+            throw fs::filesystem_error("Can't scan source", root, ec);
+        if (false == subtree.empty())
+        {
+#ifndef _WIN32
+            file_t const file = ec ? file_t::UNEXPECTED_FILE : get_file_type(info.mode);
+#else
+            file_t const file = ec ? file_t::UNEXPECTED_FILE : get_file_type(fs::symlink_status(root, ec));
+#endif
+            if (file_t::UNEXPECTED_FILE == file)
+                return current;
+            for (fs::path ancestor = subtree.parent_path(); false == ancestor.empty(); ancestor = ancestor.parent_path())
+            {
+                if (filter.is_excluded(ancestor.generic_string(), true))
+                    return current;
+            }
+            FilterEngine::verdict_t const verdict = filter.evaluate(subtree.generic_string(), file_t::DIRECTORY == file, info.size, info.mtime_ns, now);
+            if (FilterEngine::verdict_t::EXCLUDED == verdict)
+                return current;
+            current.emplace(subtree, entry_info_t{ file, info, FilterEngine::verdict_t::HELD == verdict });
+            if (file_t::DIRECTORY != file)
+                return current;
+        }
+#ifndef _WIN32
+        std::set<std::pair<uint64_t, uint64_t>> visited{ { info.dev, info.ino } };
+        std::vector<fs::path> pending{ root };
+        while (false == pending.empty() && false == is_cancelled())
+        {
+            fs::path const directory = std::move(pending.back());
+            pending.pop_back();
+            walk_directory(directory, current, visited, pending, now);
+        }
+#else
+        for (auto it = fs::recursive_directory_iterator(root); it != fs::recursive_directory_iterator() && false == is_cancelled(); ++it)
+        {
+            fs::directory_entry const& entry = *it;
+            file_t const file = get_file_type(entry.symlink_status());
+            if (file_t::UNEXPECTED_FILE == file)
+                continue;
+            std::error_code ec;
+            FileInfo const info = FileInfo::get(entry.path(), ec);
+            if (ec)
+                continue;
+
+            fs::path relative = entry.path().lexically_relative(source);
+            FilterEngine::verdict_t const verdict = filter.evaluate(relative.generic_string(), file_t::DIRECTORY == file, info.size, info.mtime_ns, now);
+            if (FilterEngine::verdict_t::EXCLUDED == verdict)
+            {
+                if (file_t::DIRECTORY == file)
+                    it.disable_recursion_pending();
+                continue;
+            }
+            current.emplace(std::move(relative), entry_info_t{ file, info, FilterEngine::verdict_t::HELD == verdict });
+        }
+#endif
+        return current;
+    }
+
+#ifndef _WIN32
+    // Lists one directory with a single fstatat() per entry, relative to the directory
+    // and without following links; sockets are skipped by their d_type unseen.
+    // Subdirectories go to `pending` unless their (dev, inode) was already visited,
+    // which only bind mounts can cause, so a tree that contains itself is walked once.
+    void walk_directory(fs::path const& directory, snapshot_t& current, std::set<std::pair<uint64_t, uint64_t>>& visited,
+        std::vector<fs::path>& pending, int64_t now)
+    {
+        int const fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* const dir = fd >= 0 ? ::fdopendir(fd) : nullptr;
+        if (nullptr == dir)
+        {
+            std::error_code const ec(errno, std::generic_category());
+            if (fd >= 0)
+                ::close(fd);
+            // Removed or replaced since its parent was listed.
+            if (ENOENT == ec.value() || ENOTDIR == ec.value() || ELOOP == ec.value())
+                return;
+            throw fs::filesystem_error("Can't list source directory", directory, ec);
+        }
+        std::unique_ptr<DIR, int (*)(DIR*)> const guard(dir, ::closedir);
+        while (false == is_cancelled())
+        {
+            errno = 0;
+            dirent const* const entry = ::readdir(dir);
+            if (nullptr == entry)
+            {
+                if (0 != errno)
+                    throw fs::filesystem_error("Can't list source directory", directory, std::error_code(errno, std::generic_category()));
+                break;
+            }
+            char const* const child = entry->d_name;
+            if (0 == std::strcmp(child, ".") || 0 == std::strcmp(child, "..") || DT_SOCK == entry->d_type)
+                continue;
+            struct stat st;
+            if (0 != ::fstatat(fd, child, &st, AT_SYMLINK_NOFOLLOW))
+                continue;
+            FileInfo const info = FileInfo::from_stat(st);
+            file_t const file = get_file_type(info.mode);
+            if (file_t::UNEXPECTED_FILE == file)
+                continue;
+
+            fs::path path = directory / child;
+            fs::path relative = path.lexically_relative(source);
+            FilterEngine::verdict_t const verdict = filter.evaluate(relative.generic_string(), file_t::DIRECTORY == file, info.size, info.mtime_ns, now);
+            if (FilterEngine::verdict_t::EXCLUDED == verdict)
+                continue;
+            if (file_t::DIRECTORY == file)
+            {
+                if (false == visited.emplace(info.dev, info.ino).second)
+                {
+                    Logger::logf(Logger::severity_t::DEBUG, __FILE__, __LINE__, "Job %s: skipping %s, a directory already scanned under another path",
+                        name.c_str(), relative.generic_string().c_str());
+                    continue;
+                }
+                pending.push_back(std::move(path));
+            }
+            current.emplace(std::move(relative), entry_info_t{ file, info, FilterEngine::verdict_t::HELD == verdict });
+        }
+    }
+#endif
+
+    // Turns requested subtrees into the set of disjoint subtrees to rescan. A subtree
+    // whose parent directory isn't replicated yet is widened to its closest ancestor
+    // that is, so that directories are created top down. An empty result means the
+    // whole source.
+    std::vector<fs::path> get_scan_scopes(std::vector<fs::path> const& subtrees) const
+    {
+        std::vector<fs::path> scopes;
+        for (auto const& requested : subtrees)
+        {
+            fs::path subtree = requested.lexically_normal();
+            if (subtree.is_absolute() || (false == subtree.empty() && ".." == *subtree.begin()))
+            {
+                Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Job %s: ignoring subtree %s outside the source", name.c_str(), requested.generic_string().c_str());
+                continue;
+            }
+            if ("." == subtree || false == subtree.has_filename())
+                subtree = subtree.parent_path();
+            while (false == subtree.parent_path().empty() && false == snapshot.contains(subtree.parent_path()))
+                subtree = subtree.parent_path();
+            if (subtree.empty() || "." == subtree)
+                return {};
+            scopes.push_back(std::move(subtree));
+        }
+        std::sort(scopes.begin(), scopes.end());
+        std::vector<fs::path> disjoint;
+        for (auto& scope : scopes)
+        {
+            if (disjoint.empty() || false == is_below(scope, disjoint.back()))
+                disjoint.push_back(std::move(scope));
+        }
+        return disjoint;
+    }
+
+    // Rescans the whole source, or only `scopes`: the snapshot entries below each of
+    // them are compared with a walk of that subtree and then replaced by it, the rest
+    // of the snapshot is left alone. Renames are only detected within one subtree.
+    plan_t scan(std::vector<fs::path> const& scopes = {})
+    {
+        restore_failed();
+        if (scopes.empty())
+        {
+            snapshot_t current = walk();
+            if (is_cancelled())
+                return {};
+            plan_t plan = diff(snapshot, current);
+            snapshot = std::move(current);
+            return plan;
+        }
+
+        plan_t plan;
+        for (auto const& scope : scopes)
+        {
+            snapshot_t current = walk(scope);
+            if (is_cancelled())
+                break;
+            auto const first = snapshot.lower_bound(scope);
+            auto last = first;
+            while (last != snapshot.end() && is_below(last->first, scope))
+                ++last;
+            plan_t part = diff(snapshot_t(first, last), current);
+            snapshot.erase(first, last);
+            snapshot.merge(current);
+            for (auto [to, from] : { std::pair{ &plan.inline_actions, &part.inline_actions }, std::pair{ &plan.file_actions, &part.file_actions },
+                std::pair{ &plan.dir_deletes, &part.dir_deletes } })
+                std::move(from->begin(), from->end(), std::back_inserter(*to));
+        }
+        return plan;
+    }
+
+    // Compares a fresh walk with the previous state of the same part of the source and
+    // leaves the state to record in `current`. Entries that vanished and appeared in
+    // the same cycle with the same (dev, inode) and type are renames; a renamed
+    // directory carries its subtree along, so descendants that kept their inode are
+    // not reported again.
+    plan_t diff(snapshot_t const& previous, snapshot_t& current)
+    {
+        // A held file keeps whatever the replica has of it: the recorded state if it was
+        // copied before, which the file is compared with again once it is no longer
+        // held, otherwise nothing, so it counts as new then.
+        for (auto it = current.begin(); it != current.end();)
+        {
+            auto const old = it->second.held ? previous.find(it->first) : previous.end();
+            if (false == it->second.held)
+                ++it;
+            else if (old != previous.end() && old->second.file == it->second.file)
+                (it++)->second = old->second;
+            else
+                it = current.erase(it);
+        }
+
+        plan_t plan;
+        std::map<std::pair<uint64_t, uint64_t>, fs::path> vanished_by_id;
+        std::set<fs::path> vanished;
+        for (auto const& [relative, entry] : previous)
+        {
+            if (current.contains(relative) || is_in_flight(relative))
+                continue;
+            vanished.insert(relative);
+            if (0 != entry.info.ino)
+                vanished_by_id.emplace(std::make_pair(entry.info.dev, entry.info.ino), relative);
+        }
+
+        std::vector<std::pair<fs::path, fs::path>> moved_dirs;
+        auto moved_dir_of = [&moved_dirs](fs::path const& relative, bool by_new) -> std::pair<fs::path, fs::path> const*
+        {
+            for (auto it = moved_dirs.rbegin(); it != moved_dirs.rend(); ++it)
+            {
+                if (is_below(relative, by_new ? it->second : it->first) && relative != (by_new ? it->second : it->first))
+                    return &*it;
+            }
+            return nullptr;
+        };
+
+        // Directories replaced by another type of entry, removed with their content
+        // once every rename out of them is done.
+        std::vector<pending_action_t> replaced_dirs;
+        std::set<fs::path> replaced;
+        for (auto const& [relative, entry] : current)
+        {
+            if (is_in_flight(relative))
+                continue;
+
+            auto const old = previous.find(relative);
+            if (old != previous.end())
+            {
+                if (old->second.file != entry.file && (file_t::DIRECTORY == old->second.file || file_t::DIRECTORY == entry.file))
+                {
+                    // The replica entry of the old type has to go before the new one
+                    // can be created in its place.
+                    pending_action_t remove{ action_t::DELETE, old->second.file, relative, old->second.info, priority_t::HIGH, {} };
+                    if (file_t::DIRECTORY == entry.file)
+                    {
+                        plan.inline_actions.push_back(std::move(remove));
+                        plan.inline_actions.push_back({ action_t::CREATE, entry.file, relative, entry.info, priority_t::HIGH, {} });
+                    }
+                    else
+                    {
+                        replaced.insert(relative);
+                        replaced_dirs.push_back(std::move(remove));
+                        plan.file_actions.push_back({ action_t::CREATE, entry.file, relative, entry.info, classify(relative, entry.info), {} });
+                    }
+                    continue;
+                }
+                if (file_t::DIRECTORY != entry.file && (old->second.file != entry.file || false == same_content(old->second, entry)))
+                {
+                    if (false == in_sync(relative, entry))
+                        plan.file_actions.push_back({ action_t::MODIFY, entry.file, relative, entry.info, classify(relative, entry.info), {} });
+                }
+                else if (metadata_changed(old->second, entry))
+                    plan.file_actions.push_back({ action_t::METADATA, entry.file, relative, entry.info, priority_t::NORMAL, {} });
+                continue;
+            }
+
+            if (auto const moved = moved_dir_of(relative, true))
+            {
+                fs::path const old_relative = rebase(relative, moved->second, moved->first);
+                auto const old_entry = previous.find(old_relative);
+                if (vanished.contains(old_relative) && old_entry->second.file == entry.file && old_entry->second.info.ino == entry.info.ino)
+                {
+                    vanished.erase(old_relative);
+                    if (file_t::DIRECTORY != entry.file && false == same_content(old_entry->second, entry))
+                        plan.file_actions.push_back({ action_t::MODIFY, entry.file, relative, entry.info, classify(relative, entry.info), {} });
+                    continue;
+                }
+            }
+
+            auto const by_id = 0 == entry.info.ino ? vanished_by_id.end() : vanished_by_id.find({ entry.info.dev, entry.info.ino });
+            if (by_id != vanished_by_id.end() && vanished.contains(by_id->second) && previous.at(by_id->second).file == entry.file)
+            {
+                fs::path const old_relative = by_id->second;
+                vanished.erase(old_relative);
+                pending_action_t rename{ action_t::RENAME, entry.file, relative, entry.info, priority_t::HIGH, old_relative };
+                if (auto const moved = moved_dir_of(old_relative, false))
+                    rename.old_relative = rebase(old_relative, moved->first, moved->second);
+                plan.inline_actions.push_back(std::move(rename));
+                if (file_t::DIRECTORY == entry.file)
+                    moved_dirs.emplace_back(old_relative, relative);
+                else if (false == same_content(previous.at(old_relative), entry))
+                    plan.file_actions.push_back({ action_t::MODIFY, entry.file, relative, entry.info, classify(relative, entry.info), {} });
+                continue;
+            }
+
+            if (file_t::DIRECTORY == entry.file)
+                plan.inline_actions.push_back({ action_t::CREATE, entry.file, relative, entry.info, priority_t::HIGH, {} });
+            else if (false == in_sync(relative, entry))
+                plan.file_actions.push_back({ action_t::CREATE, entry.file, relative, entry.info, classify(relative, entry.info), {} });
+        }
+
+        // Whatever vanished below a moved directory now lives under its new name in
+        // the replica. Only the topmost deleted directory of a subtree is reported.
+        fs::path deleted_dir;
+        for (auto const& relative : vanished)
+        {
+            if (false == deleted_dir.empty() && is_below(relative, deleted_dir))
+                continue;
+            if (std::any_of(replaced.begin(), replaced.end(), [&relative](fs::path const& dir) { return is_below(relative, dir); }))
+                continue;
+
+            entry_info_t const& entry = previous.at(relative);
+            fs::path target = relative;
+            if (auto const moved = moved_dir_of(relative, false))
+                target = rebase(relative, moved->first, moved->second);
+            if (current.contains(target))
+            {
+                if (current.at(target).file == entry.file)
+                    continue;
+                // Same path, different type: clear the way right before the new entry
+                // is created.
+                auto const position = std::find_if(plan.inline_actions.begin(), plan.inline_actions.end(),
+                    [&target](pending_action_t const& action) { return action.relative == target; });
+                plan.inline_actions.insert(position, { action_t::DELETE, entry.file, target, entry.info, priority_t::HIGH, {} });
+            }
+            else if (file_t::DIRECTORY == entry.file)
+            {
+                deleted_dir = relative;
+                plan.dir_deletes.push_back({ action_t::DELETE, entry.file, target, entry.info, priority_t::NORMAL, {} });
+            }
+            else
+                plan.file_actions.push_back({ action_t::DELETE, entry.file, target, entry.info, priority_t::NORMAL, {} });
+        }
+
+        std::move(replaced_dirs.begin(), replaced_dirs.end(), std::back_inserter(plan.inline_actions));
+
+        // In-flight paths keep their old state so that the next cycle re-examines them.
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        for (auto const& relative : in_flight)
+        {
+            auto const old = previous.find(relative);
+            if (old != previous.end())
+                current[relative] = old->second;
+            else
+                current.erase(relative);
+        }
+
+        int64_t const detected = FileInfo::now_ns();
+        for (auto* actions : { &plan.inline_actions, &plan.file_actions, &plan.dir_deletes })
+        {
+            for (auto& action : *actions)
+                action.detected_ns = detected;
+        }
+        return plan;
+    }
+};
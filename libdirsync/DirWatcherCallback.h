@@ -0,0 +1,288 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <span>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include "Logger.h"
+#include "DirWatcher.h"
+#include "CopyEngine.h"
+#include "DeleteEngine.h"
+#include "DirHandleCache.h"
+#include "RemoteReplica.h"
+#include "ChunkStore.h"
+#include "Journal.h"
+#include "ThreadPool.h"
+
+
+// Applies changes to the replica folder, or through `remote` to the replica a
+// ReplicaAgent serves when that is set. With a `store`, `replica` is its files/ folder
+// and file contents go into the store as chunks plus a manifest.
+class DirWatcherCallback final : public DirWatcherCallbackBase
+{
+    CopyEngine& engine;
+    DeleteEngine& delete_engine;
+    DirHandleCache& replica;
+    RemoteReplica* remote;
+    ChunkStore* store;
+    bool const deferred_delete;
+    Journal* journal;
+    ThreadPool* io_pool;
+    size_t job_id;
+    size_t batch_size;
+
+public:
+
+    // io_pool runs the reads and writes of report_action_async.
+    DirWatcherCallback(CopyEngine& engine_, DeleteEngine& delete_engine_, DirHandleCache& replica_, bool deferred_delete_, Journal* journal_ = nullptr,
+        ThreadPool* io_pool_ = nullptr, size_t job_id_ = 0, size_t batch_size_ = 0, RemoteReplica* remote_ = nullptr,
+        ChunkStore* store_ = nullptr)
+        : engine(engine_)
+        , delete_engine(delete_engine_)
+        , replica(replica_)
+        , remote(remote_)
+        , store(store_)
+        , deferred_delete(deferred_delete_)
+        , journal(journal_)
+        , io_pool(io_pool_)
+        , job_id(job_id_)
+        , batch_size(batch_size_)
+    {
+    }
+
+    virtual size_t get_batch_size(void) const override
+    {
+        return batch_size;
+    }
+
+    // Copies carry the source mtime to the nanosecond, so a replica entry that matches
+    // in type, size and mtime is taken as current. A remote replica is checked per batch,
+    // a chunk store keeps no mtimes.
+    virtual bool is_in_sync(fs::path const& relative, FileInfo const& info) override
+    {
+        return false == (remote || store) && matches(replica, relative, info);
+    }
+
+    // Whether `relative` inside `replica` has the type, size and mtime of `info`.
+    static bool matches(DirHandleCache& replica, fs::path const& relative, FileInfo const& info)
+    {
+#ifndef _WIN32
+        struct stat st;
+        return replica.stat(relative, st) && (st.st_mode & S_IFMT) == (info.mode & S_IFMT) && info.size == static_cast<uint64_t>(st.st_size)
+            && info.mtime_ns == static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+        std::error_code ec;
+        FileInfo const current = FileInfo::get(replica.full_path(relative), ec);
+        return false == static_cast<bool>(ec) && info.size == current.size && info.mtime_ns == current.mtime_ns;
+#endif
+    }
+
+private:
+
+    virtual void report_action(const action_t action, const file_t file, fs::path const& path, fs::path const& relative_path, const std::string&) override
+    {
+        engine.acquire_op();
+        if (action_t::DELETE == action)
+            engine.get_metrics().entries_deleted.fetch_add(1, std::memory_order_relaxed);
+
+        std::string const name = relative_path.generic_string();
+        if (is_special(action, file))
+        {
+            // Neither the replica protocol nor manifests describe anything but data.
+            if (remote || store)
+            {
+                Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "%s %s can't be replicated to %s", get_file_str(file), name.c_str(),
+                    remote ? "a replica agent" : "a chunk store");
+                return;
+            }
+            engine.copy_special(path, replica, relative_path);
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+        }
+        else if ((action == DirWatcherCallback::action_t::CREATE
+            || action == DirWatcherCallback::action_t::MODIFY)
+            && file == DirWatcherCallback::file_t::REGULAR)
+        {
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+            Journal::copy_progress_t const progress = journal ? journal->copy_progress(relative_path) : Journal::copy_progress_t{};
+            // A remote copy resumes by sending only the blocks the replica doesn't hold.
+            if (remote)
+                remote->send_file(path, relative_path, engine, action_t::MODIFY == action || 0 != progress.resume_offset);
+            else if (store)
+                store->put_file(path, replica, relative_path, engine);
+            else
+                engine.copy_file(path, replica, relative_path, progress.resume_offset, progress.on_commit);
+        }
+        else if (action == DirWatcherCallback::action_t::DELETE && file != DirWatcherCallback::file_t::DIRECTORY)
+        {
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been deleted from Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+            if (remote)
+                remote->remove_file(relative_path);
+            else
+                replica.remove_file(relative_path);
+        }
+        else if (action == DirWatcherCallback::action_t::CREATE && file == DirWatcherCallback::file_t::DIRECTORY)
+        {
+            if (remote)
+                remote->make_directory(relative_path);
+            else
+                replica.make_directory(relative_path);
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+        }
+        else if (action == DirWatcherCallback::action_t::METADATA)
+        {
+            // Manifests and replica agents don't carry metadata.
+            if (remote || store)
+                return;
+            engine.copy_metadata(path, replica, relative_path, file_t::DIRECTORY == file);
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been updated in Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+        }
+        else if ((action == DirWatcherCallback::action_t::DELETE && file == DirWatcherCallback::file_t::DIRECTORY))
+        {
+            if (remote)
+                remote->remove_tree(relative_path, deferred_delete);
+            else if (deferred_delete)
+                delete_engine.defer_remove_tree(replica, relative_path);
+            else
+                delete_engine.remove_tree(replica, relative_path);
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been deleted from Replica%s", get_file_str(file), name.c_str(), (" | " + path.generic_string()).c_str());
+        }
+    }
+
+    // Entries of a batch share their parent directory; applying them in inode order
+    // keeps reads of the source close to its on-disk layout.
+    virtual void report_batch(std::span<change_record_t const> records, path_table_t const& paths, fs::path const& source_root, std::string const& directory_path) override
+    {
+        std::vector<change_record_t const*> ordered;
+        ordered.reserve(records.size());
+        for (auto const& record : records)
+            ordered.push_back(&record);
+        std::stable_sort(ordered.begin(), ordered.end(), [](change_record_t const* a, change_record_t const* b) { return a->ino < b->ino; });
+        if (remote)
+        {
+            report_batch_remote(ordered, paths, source_root);
+            return;
+        }
+        for (change_record_t const* record : ordered)
+            report_action(record->action, record->file, source_root / paths[record->path_id], paths[record->path_id], directory_path);
+    }
+
+    // Copies are pipelined through CopyEngine::copy_file_async, transfers to a remote
+    // replica and into a chunk store run on io_pool as a whole, everything else is cheap enough to run inline.
+    virtual Task<void> report_action_async(const action_t action, const file_t file, fs::path path, fs::path relative_path, std::string directory_path) override
+    {
+        if (nullptr == io_pool || file_t::REGULAR != file || (action_t::CREATE != action && action_t::MODIFY != action))
+        {
+            report_action(action, file, path, relative_path, directory_path);
+            co_return;
+        }
+        if (remote || store)
+        {
+            co_await offload(*io_pool, job_id, [&]() { report_action(action, file, path, relative_path, directory_path); });
+            co_return;
+        }
+        engine.acquire_op();
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been created in Replica%s", get_file_str(file), relative_path.generic_string().c_str(), (" | " + path.generic_string()).c_str());
+        Journal::copy_progress_t progress = journal ? journal->copy_progress(relative_path) : Journal::copy_progress_t{};
+        co_await engine.copy_file_async(path, replica, relative_path, *io_pool, job_id, progress.resume_offset, std::move(progress.on_commit));
+    }
+
+    virtual bool report_rename(const file_t file, fs::path const& old_relative_path, fs::path const& path, fs::path const& relative_path, const std::string&) override
+    {
+        engine.acquire_op();
+        if (false == (remote ? remote->rename(old_relative_path, relative_path) : replica.rename(old_relative_path, relative_path)))
+            return false;
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been renamed to %s in Replica%s", get_file_str(file),
+            old_relative_path.generic_string().c_str(), relative_path.generic_string().c_str(), (" | " + path.generic_string()).c_str());
+        return true;
+    }
+
+    // Links, FIFOs and device nodes are recreated rather than copied.
+    static bool is_special(action_t action, file_t file)
+    {
+        return (file_t::SYMLINK == file || file_t::SPECIAL == file) && (action_t::CREATE == action || action_t::MODIFY == action);
+    }
+
+    // The whole change set goes out before the first reply is awaited: one request for
+    // the replica state of its files, which skips those already matching in size and mtime, one round of signatures for those the replica
+    // already holds in some version, then every operation back to back.
+    void report_batch_remote(std::vector<change_record_t const*> const& ordered, path_table_t const& paths, fs::path const& source_root)
+    {
+        std::vector<change_record_t const*> files;
+        std::vector<fs::path> file_paths;
+        for (change_record_t const* record : ordered)
+        {
+            if (file_t::REGULAR == record->file && (action_t::CREATE == record->action || action_t::MODIFY == record->action))
+            {
+                files.push_back(record);
+                file_paths.push_back(paths[record->path_id]);
+            }
+        }
+        std::vector<RemoteReplica::stat_t> const states = file_paths.empty() ? std::vector<RemoteReplica::stat_t>{} : remote->stat(file_paths);
+        bool const preserves_mtime = false == files.empty() && remote->preserves_mtime();
+        std::set<change_record_t const*> in_sync;
+        std::vector<fs::path> delta_paths;
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (preserves_mtime && ReplicaProtocol::kind_t::REGULAR == states[i].kind && files[i]->size == states[i].size && files[i]->mtime_ns == states[i].mtime_ns)
+                in_sync.insert(files[i]);
+            else if (ReplicaProtocol::kind_t::REGULAR == states[i].kind && 0 != states[i].size && files[i]->size >= RemoteReplica::delta_min_size)
+                delta_paths.push_back(file_paths[i]);
+        }
+        std::vector<RemoteReplica::signature_t> const signatures = delta_paths.empty() ? std::vector<RemoteReplica::signature_t>{} : remote->signatures(delta_paths);
+
+        std::vector<RemoteReplica::pending_t> pending;
+        std::exception_ptr error;
+        try
+        {
+            size_t next_delta = 0;
+            for (change_record_t const* record : ordered)
+            {
+                fs::path const& relative = paths[record->path_id];
+                if (action_t::METADATA == record->action || in_sync.contains(record))
+                    continue;
+                if (is_special(record->action, record->file))
+                {
+                    Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "%s %s can't be replicated to a replica agent", get_file_str(record->file),
+                        relative.generic_string().c_str());
+                    continue;
+                }
+                engine.acquire_op();
+                log(record->action, record->file, relative.generic_string());
+                if (action_t::DELETE == record->action)
+                {
+                    engine.get_metrics().entries_deleted.fetch_add(1, std::memory_order_relaxed);
+                    pending.push_back(file_t::DIRECTORY == record->file ? remote->post_remove_tree(relative, deferred_delete) : remote->post_remove_file(relative));
+                }
+                else if (file_t::DIRECTORY == record->file)
+                    pending.push_back(remote->post_make_directory(relative));
+                else
+                {
+                    bool const delta = next_delta < delta_paths.size() && delta_paths[next_delta] == relative;
+                    pending.push_back(remote->post_file(source_root / relative, relative, engine, delta ? &signatures[next_delta] : nullptr));
+                    next_delta += delta ? 1 : 0;
+                }
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        remote->wait_all(pending);
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    virtual void log(const action_t action, const file_t file, std::string const& name) const override
+    {
+        if (DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION == action && DirWatcherCallbackBase::file_t::UNEXPECTED_FILE == file)
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for unexpected file type: %s", name.c_str());
+        else if (DirWatcherCallbackBase::action_t::UNEXPECTED_ACTION == action)
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected action has been detected for %s %s", get_file_str(file), name.c_str());
+        else if (DirWatcherCallbackBase::file_t::UNEXPECTED_FILE == file)
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Unexpected file %s has been %s", name.c_str(), get_action_str(action));
+        else
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "%s %s has been %s", get_file_str(file), name.c_str(), get_action_str(action));
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+#include <system_error>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+// The part of an lstat() result the synchronizer cares about. Symlinks are not
+// followed; dev, ino, ctime_ns, mode, uid and gid are 0 on platforms that don't
+// expose them. A ctime_ns of 0 means unknown.
+struct FileInfo
+{
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    int64_t ctime_ns = 0;
+    uint32_t mode = 0;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+
+    static FileInfo get(std::filesystem::path const& path, std::error_code& ec)
+    {
+        FileInfo info;
+        ec.clear();
+#ifndef _WIN32
+        struct stat st;
+        if (0 != ::lstat(path.c_str(), &st))
+        {
+            ec = std::error_code(errno, std::generic_category());
+            return info;
+        }
+        info = from_stat(st);
+#else
+        auto const status = std::filesystem::symlink_status(path, ec);
+        if (ec)
+            return info;
+        if (std::filesystem::is_regular_file(status))
+            info.size = std::filesystem::file_size(path, ec);
+        auto const mtime = std::filesystem::last_write_time(path, ec);
+        info.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::clock_cast<std::chrono::system_clock>(mtime).time_since_epoch()).count();
+#endif
+        return info;
+    }
+
+    static FileInfo get(std::filesystem::path const& path)
+    {
+        std::error_code ec;
+        return get(path, ec);
+    }
+
+#ifndef _WIN32
+    static FileInfo from_stat(struct stat const& st)
+    {
+        FileInfo info;
+        info.dev = static_cast<uint64_t>(st.st_dev);
+        info.ino = static_cast<uint64_t>(st.st_ino);
+        info.size = static_cast<uint64_t>(st.st_size);
+        info.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        info.ctime_ns = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+        info.mode = static_cast<uint32_t>(st.st_mode);
+        info.uid = static_cast<uint32_t>(st.st_uid);
+        info.gid = static_cast<uint32_t>(st.st_gid);
+        return info;
+    }
+
+    static timespec to_timespec(int64_t ns)
+    {
+        int64_t const seconds = ns / 1000000000 - (ns % 1000000000 < 0 ? 1 : 0);
+        return { static_cast<time_t>(seconds), static_cast<long>(ns - seconds * 1000000000) };
+    }
+#endif
+
+    static int64_t now_ns(void)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+};
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include "TokenBucket.h"
+
+
+// Include/exclude rules with gitignore semantics: rules are evaluated in order and
+// the last matching one wins, `!` re-includes, a trailing `/` restricts a rule to
+// directories, a pattern containing `/` is anchored at the source root, otherwise it
+// is matched against the entry name at any depth. `*`, `?`, `[...]` don't cross `/`,
+// `**` does. Besides globs, `size>10M`, `size<1K`, `age>7d` and `age<2h` predicates
+// apply to files; they only hold files back from being copied (see evaluate()).
+//
+// Literal patterns are resolved with a hash lookup. All wildcard patterns of a kind
+// are compiled into one NFA that is turned into a DFA lazily, one transition at a
+// time, so matching costs a table lookup per byte whatever the number of rules.
+class FilterEngine
+{
+    struct rule_t
+    {
+        bool negated = false;
+        bool dir_only = false;
+        bool is_predicate = false;
+        bool predicate_size = false;
+        bool predicate_greater = false;
+        int64_t predicate_value = 0;
+    };
+
+    class Dfa
+    {
+        using charset_t = std::bitset<256>;
+
+        struct nfa_state_t
+        {
+            std::vector<std::pair<charset_t, int>> edges;
+            std::vector<int> epsilons;
+            int accept = -1;
+        };
+
+        static constexpr size_t max_states = 4096;
+
+        std::vector<nfa_state_t> nfa;
+        std::vector<int> roots;
+        std::map<std::vector<int>, int> state_ids;
+        std::vector<std::vector<int>> states;
+        std::vector<std::array<int, 256>> transitions;
+        std::vector<int> accepts;
+        std::mutex mtx;
+
+    public:
+
+        bool empty(void) const
+        {
+            return roots.empty();
+        }
+
+        void add(std::string_view glob, int rule)
+        {
+            int const start = new_state();
+            roots.push_back(start);
+            int const end = compile(glob, start);
+            nfa[end].accept = std::max(nfa[end].accept, rule);
+            reset();
+        }
+
+        int match(std::string_view str)
+        {
+            if (roots.empty())
+                return -1;
+            std::lock_guard<std::mutex> lock(mtx);
+            if (states.empty())
+                reset();
+            int state = 1;
+            for (unsigned char c : str)
+            {
+                int next = transitions[state][c];
+                if (next < 0)
+                {
+                    next = step(state, c);
+                    if (next < 0)
+                    {
+                        // Cache exhausted; start over from the current NFA set.
+                        std::vector<int> const current = states[state];
+                        reset();
+                        state = intern(current);
+                        next = step(state, c);
+                    }
+                }
+                state = next;
+                if (0 == state)
+                    return -1;
+            }
+            return accepts[state];
+        }
+
+    private:
+
+        int new_state(void)
+        {
+            nfa.emplace_back();
+            return static_cast<int>(nfa.size() - 1);
+        }
+
+        static charset_t any_but_slash(void)
+        {
+            charset_t set;
+            set.set();
+            set.reset('/');
+            return set;
+        }
+
+        void edge(int from, charset_t const& set, int to)
+        {
+            nfa[from].edges.emplace_back(set, to);
+        }
+
+        int compile(std::string_view glob, int state)
+        {
+            for (size_t i = 0; i < glob.size(); ++i)
+            {
+                char const c = glob[i];
+                if ('*' == c && i + 1 < glob.size() && '*' == glob[i + 1])
+                {
+                    bool const at_start = 0 == i || '/' == glob[i - 1];
+                    bool const slash_after = i + 2 < glob.size() && '/' == glob[i + 2];
+                    bool const at_end = i + 2 == glob.size();
+                    int const loop = new_state();
+                    charset_t all;
+                    all.set();
+                    if (at_start && slash_after)
+                    {
+                        // "**/" - zero or more leading directories.
+                        int const out = new_state();
+                        nfa[state].epsilons.push_back(out);
+                        edge(state, all, loop);
+                        edge(loop, all, loop);
+                        charset_t slash;
+                        slash.set('/');
+                        edge(loop, slash, out);
+                        state = out;
+                        i += 2;
+                        continue;
+                    }
+                    if (at_start && at_end)
+                    {
+                        nfa[state].epsilons.push_back(loop);
+                        edge(loop, all, loop);
+                        return loop;
+                    }
+                    // Anywhere else "**" behaves like "*".
+                    nfa[state].epsilons.push_back(loop);
+                    edge(loop, any_but_slash(), loop);
+                    state = loop;
+                    ++i;
+                    continue;
+                }
+
+                int const next = new_state();
+                if ('*' == c)
+                {
+                    nfa[state].epsilons.push_back(next);
+                    edge(next, any_but_slash(), next);
+                }
+                else if ('?' == c)
+                {
+                    edge(state, any_but_slash(), next);
+                }
+                else if ('[' == c && std::string_view::npos != glob.find(']', i + 2))
+                {
+                    size_t j = i + 1;
+                    bool const negate = '!' == glob[j] || '^' == glob[j];
+                    if (negate)
+                        ++j;
+                    charset_t set;
+                    bool first = true;
+                    for (; j < glob.size() && (first || ']' != glob[j]); ++j, first = false)
+                    {
+                        unsigned char lo = static_cast<unsigned char>(glob[j]);
+                        unsigned char hi = lo;
+                        if (j + 2 < glob.size() && '-' == glob[j + 1] && ']' != glob[j + 2])
+                        {
+                            hi = static_cast<unsigned char>(glob[j + 2]);
+                            j += 2;
+                        }
+                        for (unsigned v = lo; v <= hi; ++v)
+                            set.set(v);
+                    }
+                    if (negate)
+                        set.flip();
+                    set.reset('/');
+                    edge(state, set, next);
+                    i = j;
+                }
+                else
+                {
+                    char const literal = '\\' == c && i + 1 < glob.size() ? glob[++i] : c;
+                    charset_t set;
+                    set.set(static_cast<unsigned char>(literal));
+                    edge(state, set, next);
+                }
+                state = next;
+            }
+            return state;
+        }
+
+        void closure(std::vector<int>& set) const
+        {
+            std::vector<int> stack(set.begin(), set.end());
+            while (false == stack.empty())
+            {
+                int const s = stack.back();
+                stack.pop_back();
+                for (int const e : nfa[s].epsilons)
+                {
+                    if (set.end() == std::find(set.begin(), set.end(), e))
+                    {
+                        set.push_back(e);
+                        stack.push_back(e);
+                    }
+                }
+            }
+            std::sort(set.begin(), set.end());
+        }
+
+        // Returns -1 when the state cache is full.
+        int intern(std::vector<int> const& set)
+        {
+            auto const it = state_ids.find(set);
+            if (it != state_ids.end())
+                return it->second;
+            if (states.size() >= max_states)
+                return -1;
+
+            int const id = static_cast<int>(states.size());
+            state_ids.emplace(set, id);
+            states.push_back(set);
+            std::array<int, 256> row;
+            row.fill(-1);
+            transitions.push_back(row);
+            int accept = -1;
+            for (int const s : set)
+                accept = std::max(accept, nfa[s].accept);
+            accepts.push_back(accept);
+            return id;
+        }
+
+        int step(int state, unsigned char c)
+        {
+            std::vector<int> next;
+            for (int const s : states[state])
+            {
+                for (auto const& [set, to] : nfa[s].edges)
+                {
+                    if (set.test(c) && next.end() == std::find(next.begin(), next.end(), to))
+                        next.push_back(to);
+                }
+            }
+            closure(next);
+            int const id = intern(next);
+            if (id >= 0)
+                transitions[state][c] = id;
+            return id;
+        }
+
+        void reset(void)
+        {
+            state_ids.clear();
+            states.clear();
+            transitions.clear();
+            accepts.clear();
+            intern({});
+            std::vector<int> start = roots;
+            closure(start);
+            intern(start);
+        }
+    };
+
+    // Name and path rules, compiled separately for files and directories so that
+    // directory-only rules never shadow the rules that apply to files.
+    struct matcher_t
+    {
+        std::unordered_map<std::string, int> literal_names;
+        std::unordered_map<std::string, int> literal_paths;
+        Dfa names;
+        Dfa paths;
+
+        int match(std::string_view name, std::string_view path)
+        {
+            int best = -1;
+            if (false == literal_names.empty())
+            {
+                auto const it = literal_names.find(std::string(name));
+                if (it != literal_names.end())
+                    best = it->second;
+            }
+            if (false == literal_paths.empty())
+            {
+                auto const it = literal_paths.find(std::string(path));
+                if (it != literal_paths.end())
+                    best = std::max(best, it->second);
+            }
+            best = std::max(best, names.match(name));
+            best = std::max(best, paths.match(path));
+            return best;
+        }
+    };
+
+    std::vector<rule_t> rules;
+    std::vector<int> predicates;
+    matcher_t file_matcher;
+    matcher_t dir_matcher;
+
+public:
+
+    FilterEngine(void) = default;
+
+    FilterEngine(const FilterEngine&) = delete;
+
+    FilterEngine& operator=(const FilterEngine&) = delete;
+
+    bool empty(void) const
+    {
+        return rules.empty();
+    }
+
+    void add_rule(std::string rule_str)
+    {
+        while (false == rule_str.empty() && (' ' == rule_str.back() || '\t' == rule_str.back() || '\r' == rule_str.back()))
+            rule_str.pop_back();
+        if (rule_str.empty() || '#' == rule_str.front())
+            return;
+
+        rule_t rule;
+        int const index = static_cast<int>(rules.size());
+        if ('!' == rule_str.front())
+        {
+            rule.negated = true;
+            rule_str.erase(0, 1);
+        }
+
+        if (parse_predicate(rule_str, rule))
+        {
+            rules.push_back(rule);
+            predicates.push_back(index);
+            return;
+        }
+
+        if ('/' == rule_str.back())
+        {
+            rule.dir_only = true;
+            rule_str.pop_back();
+        }
+        bool const anchored = std::string::npos != rule_str.find('/');
+        if ('/' == rule_str.front())
+            rule_str.erase(0, 1);
+        if (rule_str.empty())
+            throw std::runtime_error("Empty filter pattern");
+
+        rules.push_back(rule);
+        bool const literal = std::string::npos == rule_str.find_first_of("*?[\\");
+        for (matcher_t* matcher : { &dir_matcher, &file_matcher })
+        {
+            if (matcher == &file_matcher && rule.dir_only)
+                continue;
+            if (literal)
+                (anchored ? matcher->literal_paths : matcher->literal_names)[rule_str] = index;
+            else
+                (anchored ? matcher->paths : matcher->names).add(rule_str, index);
+        }
+    }
+
+    void load_file(std::string const& filename)
+    {
+        std::ifstream in(filename);
+        if (false == in.is_open())
+            throw std::runtime_error("Can't open filter file " + filename);
+        std::string line;
+        while (std::getline(in, line))
+            add_rule(line);
+    }
+
+    enum class verdict_t { INCLUDED, EXCLUDED, HELD };
+
+    // relative_path uses '/' separators. size and mtime_ns are only looked at for
+    // regular files.
+    bool is_excluded(std::string_view relative_path, bool is_dir, uint64_t size = 0, int64_t mtime_ns = 0, int64_t now_ns = 0)
+    {
+        return verdict_t::INCLUDED != evaluate(relative_path, is_dir, size, mtime_ns, now_ns);
+    }
+
+    // Like is_excluded, but an exclusion that depends on a size or age predicate, one
+    // that decided it or a later negated one that could have re-included the file, is HELD:
+    // such a file isn't copied, yet growing or aging past a threshold doesn't make it
+    // vanish from the replica either.
+    verdict_t evaluate(std::string_view relative_path, bool is_dir, uint64_t size = 0, int64_t mtime_ns = 0, int64_t now_ns = 0)
+    {
+        if (rules.empty())
+            return verdict_t::INCLUDED;
+
+        size_t const slash = relative_path.rfind('/');
+        std::string_view const name = std::string_view::npos == slash ? relative_path : relative_path.substr(slash + 1);
+        int best = (is_dir ? dir_matcher : file_matcher).match(name, relative_path);
+        bool could_include = false;
+        if (false == is_dir)
+        {
+            for (auto it = predicates.rbegin(); it != predicates.rend() && *it > best; ++it)
+            {
+                rule_t const& rule = rules[*it];
+                int64_t const value = rule.predicate_size ? static_cast<int64_t>(size) : (now_ns - mtime_ns) / 1000000000;
+                if (rule.predicate_greater ? value > rule.predicate_value : value < rule.predicate_value)
+                {
+                    best = *it;
+                    break;
+                }
+                could_include = could_include || rule.negated;
+            }
+        }
+        if (best < 0 || rules[best].negated)
+            return verdict_t::INCLUDED;
+        return rules[best].is_predicate || could_include ? verdict_t::HELD : verdict_t::EXCLUDED;
+    }
+
+private:
+
+    static bool parse_predicate(std::string const& str, rule_t& rule)
+    {
+        bool const is_size = 0 == str.rfind("size", 0);
+        bool const is_age = 0 == str.rfind("age", 0);
+        if (false == is_size && false == is_age)
+            return false;
+        size_t const op = is_size ? 4 : 3;
+        if (op >= str.size() || ('>' != str[op] && '<' != str[op]))
+            return false;
+
+        rule.is_predicate = true;
+        rule.predicate_size = is_size;
+        rule.predicate_greater = '>' == str[op];
+        std::string const value = str.substr(op + 1);
+        if (is_size)
+        {
+            rule.predicate_value = static_cast<int64_t>(TokenBucket::parse_rate(value));
+            return true;
+        }
+
+        size_t pos = 0;
+        int64_t amount = 0;
+        try
+        {
+            amount = std::stoll(value, &pos);
+        }
+        catch (std::logic_error const&)
+        {
+            throw std::runtime_error("Invalid age " + value);
+        }
+        std::string const unit = value.substr(pos);
+        int64_t const multiplier = unit.empty() || "s" == unit ? 1 : "m" == unit ? 60 : "h" == unit ? 3600 : "d" == unit ? 86400 : 0;
+        if (0 == multiplier)
+            throw std::runtime_error("Invalid age unit " + unit);
+        rule.predicate_value = amount * multiplier;
+        return true;
+    }
+};
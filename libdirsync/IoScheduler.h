@@ -0,0 +1,274 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include "ThreadPool.h"
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+
+// Limits how many file operations run concurrently against every underlying device.
+// Operations wait in a per-device queue ordered by priority class, then by inode
+// number (a cheap proxy for on-disk locality), and are handed to the copy pool only when both the source and
+// the destination device have a free slot, so a spinning disk sees one sequential
+// stream while NVMe drives get enough parallelism to stay busy.
+class IoScheduler
+{
+public:
+
+    enum class priority_t { HIGH, NORMAL, BULK };
+
+    static constexpr size_t priority_count = 3;
+
+    struct io_op_t
+    {
+        size_t job_id = 0;
+        priority_t priority = priority_t::NORMAL;
+        uint64_t src_dev = 0;
+        uint64_t dst_dev = 0;
+        uint64_t ino = 0;
+        ThreadPool::task_t task;
+        // Used instead of task for operations that finish after the call returns,
+        // like coroutines: it gets a callback to invoke exactly once when the
+        // operation is over, the device slots stay taken until then.
+        std::function<void(std::function<void(void)>)> async_task;
+    };
+
+    struct limits_t
+    {
+        size_t rotational_concurrency = 1;
+        size_t ssd_concurrency = 8;
+        size_t queue_depth = 4096;
+    };
+
+private:
+
+    struct device_t
+    {
+        size_t limit = 1;
+        size_t in_flight = 0;
+        std::multimap<std::pair<priority_t, uint64_t>, io_op_t> queue;
+    };
+
+    ThreadPool& pool;
+    limits_t const limits;
+    std::mutex mtx;
+    std::condition_variable space_cv;
+    std::condition_variable idle_cv;
+    std::unordered_map<uint64_t, device_t> devices;
+    size_t outstanding = 0;
+    // Operations of every job not completed yet, and what runs once there are none.
+    std::unordered_map<size_t, size_t> job_outstanding;
+    std::unordered_map<size_t, std::vector<std::function<void(void)>>> idle_callbacks;
+
+public:
+
+    IoScheduler(ThreadPool& pool_, limits_t const& limits_)
+        : pool(pool_)
+        , limits(limits_)
+    {
+    }
+
+    IoScheduler(const IoScheduler&) = delete;
+
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    IoScheduler(IoScheduler&&) = delete;
+
+    IoScheduler& operator=(IoScheduler&&) = delete;
+
+    // Blocks while the source device queue is full.
+    void submit(io_op_t op)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        device_t& src = get_device(op.src_dev);
+        get_device(op.dst_dev);
+        space_cv.wait(lock, [&] { return src.queue.size() < limits.queue_depth; });
+        auto const key = std::make_pair(op.priority, op.ino);
+        ++job_outstanding[op.job_id];
+        src.queue.emplace(key, std::move(op));
+        ++outstanding;
+        pump();
+    }
+
+    // Waits until every submitted operation has completed; false if the deadline
+    // passed first.
+    bool wait_idle(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        return idle_cv.wait_until(lock, deadline, [this] { return 0 == outstanding; });
+    }
+
+    // Runs `fn` once every operation of `job_id` submitted so far has completed and
+    // released its device slots: right away on the calling thread when there is none,
+    // otherwise on the thread completing the last one, before wait_idle returns. `fn`
+    // must be short; it must not submit operations.
+    void when_idle(size_t job_id, std::function<void(void)> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto const it = job_outstanding.find(job_id);
+            if (job_outstanding.end() != it && 0 != it->second)
+            {
+                idle_callbacks[job_id].push_back(std::move(fn));
+                return;
+            }
+        }
+        fn();
+    }
+
+    static char const* get_priority_str(priority_t priority)
+    {
+        switch (priority)
+        {
+        case priority_t::HIGH:
+            return "high";
+        case priority_t::NORMAL:
+            return "normal";
+        case priority_t::BULK:
+            return "bulk";
+        default:
+            return nullptr;
+        }
+    }
+
+    // Number of operations allowed to run concurrently against `dev`.
+    static size_t get_device_limit(uint64_t dev, limits_t const& limits)
+    {
+        return std::max<size_t>(1, is_rotational(dev) ? limits.rotational_concurrency : limits.ssd_concurrency);
+    }
+
+private:
+
+    device_t& get_device(uint64_t dev)
+    {
+        auto it = devices.find(dev);
+        if (it == devices.end())
+        {
+            it = devices.emplace(dev, device_t{}).first;
+            it->second.limit = get_device_limit(dev, limits);
+            Logger::logf(Logger::severity_t::DEBUG, __FILE__, __LINE__, "Device %llu is %s, concurrency limit %zu",
+                static_cast<unsigned long long>(dev), is_rotational(dev) ? "rotational" : "non-rotational", it->second.limit);
+        }
+        return it->second;
+    }
+
+    // Must be called with mtx held.
+    void pump(void)
+    {
+        for (auto& [dev, src] : devices)
+        {
+            while (false == src.queue.empty() && src.in_flight < src.limit)
+            {
+                auto it = src.queue.begin();
+                device_t& dst = devices.at(it->second.dst_dev);
+                if (&dst != &src && dst.in_flight >= dst.limit)
+                    break;
+
+                io_op_t op = std::move(it->second);
+                src.queue.erase(it);
+                ++src.in_flight;
+                if (&dst != &src)
+                    ++dst.in_flight;
+                space_cv.notify_all();
+
+                size_t const job_id = op.job_id;
+                if (op.async_task)
+                {
+                    pool.submit(job_id, [this, op = std::move(op)]()
+                    {
+                        auto const completed = std::make_shared<std::atomic<bool>>(false);
+                        auto done = [this, completed, job_id = op.job_id, src_dev = op.src_dev, dst_dev = op.dst_dev]()
+                        {
+                            if (false == completed->exchange(true))
+                                complete(job_id, src_dev, dst_dev);
+                        };
+                        try
+                        {
+                            op.async_task(done);
+                        }
+                        catch (...)
+                        {
+                            done();
+                            throw;
+                        }
+                    });
+                    continue;
+                }
+                pool.submit(job_id, [this, op = std::move(op)]()
+                {
+                    try
+                    {
+                        op.task();
+                    }
+                    catch (...)
+                    {
+                        complete(op.job_id, op.src_dev, op.dst_dev);
+                        throw;
+                    }
+                    complete(op.job_id, op.src_dev, op.dst_dev);
+                });
+            }
+        }
+    }
+
+    void complete(size_t job_id, uint64_t src_dev, uint64_t dst_dev)
+    {
+        std::vector<std::function<void(void)>> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            --devices.at(src_dev).in_flight;
+            if (src_dev != dst_dev)
+                --devices.at(dst_dev).in_flight;
+            if (0 == --job_outstanding.at(job_id))
+            {
+                auto const it = idle_callbacks.find(job_id);
+                if (idle_callbacks.end() != it)
+                {
+                    callbacks = std::move(it->second);
+                    idle_callbacks.erase(it);
+                }
+            }
+            pump();
+        }
+        // Before the operation stops counting, so that wait_idle covers the callbacks.
+        for (auto const& callback : callbacks)
+            callback();
+        std::lock_guard<std::mutex> lock(mtx);
+        if (0 == --outstanding)
+            idle_cv.notify_all();
+    }
+
+    static bool is_rotational(uint64_t dev)
+    {
+#ifdef __linux__
+        std::string const base = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+        // Partitions don't have a queue directory, their parent disk does.
+        for (char const* rel : { "/queue/rotational", "/../queue/rotational" })
+        {
+            std::ifstream in(base + rel);
+            int value = 0;
+            if (in >> value)
+                return 1 == value;
+        }
+#else
+        (void)dev;
+#endif
+        return false;
+    }
+};
@@ -0,0 +1,627 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <system_error>
+#include "FileInfo.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// Write-ahead journal of the operations a job applies to its replica. Every operation
+// is recorded as planned before it runs and as done once it succeeded; long copies
+// also record the offset up to which the destination has been written. Records are
+// buffered and written with a single fdatasync per batch, outside the lock recorders
+// take, so they don't wait for the disk.
+//
+// Once checkpoint_records have been written, at the end of a cycle or when the journal
+// is closed, it is compacted into a checkpoint: the state of the replica (every entry
+// a completed operation produced) goes to `<journal>.snapshot` and the journal restarts
+// with only the operations still running. After a crash the
+// checkpoint plus the completed operations give the replica state to diff against, so
+// only unfinished work is redone, and interrupted copies continue from their last
+// recorded offset when the source is unchanged.
+//
+// Snapshot lines:  <d|f> <size> <mtime_ns> <dev> <ino>\t<path>
+// Journal lines:   P <seq> <op> <d|f> <size> <mtime_ns> <dev> <ino>\t<path>\t<old path>
+//                  D <seq>
+//                  C <seq> <offset>
+// Both files start with a generation header; a journal is only replayed on top of the
+// snapshot of the same generation.
+class Journal
+{
+public:
+
+    enum class op_t : char { CREATE = 'c', MODIFY = 'm', DELETE = 'd', RENAME = 'r', METADATA = 'a' };
+
+    struct entry_t
+    {
+        bool directory = false;
+        FileInfo info;
+    };
+
+    using state_t = std::map<std::filesystem::path, entry_t>;
+
+    // Where a copy starts and how its progress is recorded.
+    struct copy_progress_t
+    {
+        uint64_t resume_offset = 0;
+        std::function<void(uint64_t)> on_commit;
+    };
+
+    static constexpr size_t batch_records = 256;
+    static constexpr std::chrono::milliseconds batch_interval{ 50 };
+    static constexpr size_t checkpoint_records = 1 << 16;
+
+private:
+
+    struct record_t
+    {
+        op_t op = op_t::CREATE;
+        bool directory = false;
+        FileInfo info;
+        std::filesystem::path relative;
+        std::filesystem::path old_relative;
+        uint64_t offset = 0;
+        bool recovered = false;
+    };
+
+    std::filesystem::path const file;
+    std::filesystem::path const snapshot_file;
+    // Taken before mtx by whoever writes to the journal file, which mtx doesn't cover.
+    std::mutex sync_mtx;
+    std::mutex mtx;
+    state_t applied;
+    std::map<uint64_t, record_t> pending;
+    std::unordered_map<std::string, uint64_t> pending_copies;
+    uint64_t next_seq = 1;
+    uint64_t generation = 0;
+    std::string buffer;
+    size_t buffered = 0;
+    // Records since the last checkpoint.
+    size_t records = 0;
+    bool dirty = false;
+    std::chrono::steady_clock::time_point last_sync;
+#ifndef _WIN32
+    int fd = -1;
+#else
+    std::ofstream out;
+#endif
+
+public:
+
+    explicit Journal(std::filesystem::path file_)
+        : file(std::move(file_))
+        , snapshot_file(file.string() + ".snapshot")
+    {
+    }
+
+    ~Journal(void)
+    {
+        std::lock_guard<std::mutex> sync_lock(sync_mtx);
+        std::lock_guard<std::mutex> lock(mtx);
+        try
+        {
+            if (dirty)
+                write_checkpoint();
+            else
+                sync();
+        }
+        catch (std::exception const&)
+        {
+        }
+#ifndef _WIN32
+        if (fd >= 0)
+            ::close(fd);
+#endif
+    }
+
+    Journal(const Journal&) = delete;
+
+    Journal& operator=(const Journal&) = delete;
+
+    // Replica state recorded by the last checkpoint and the journal, read-only.
+    state_t load(void)
+    {
+        std::lock_guard<std::mutex> sync_lock(sync_mtx);
+        std::lock_guard<std::mutex> lock(mtx);
+        load_snapshot();
+        replay();
+        return applied;
+    }
+
+    // Rebuilds the replica state from the last checkpoint and the journal, keeps
+    // interrupted copies around for resuming and starts a new journal generation.
+    state_t recover(void)
+    {
+        std::lock_guard<std::mutex> sync_lock(sync_mtx);
+        std::lock_guard<std::mutex> lock(mtx);
+        load_snapshot();
+        replay();
+        for (auto it = pending.begin(); it != pending.end();)
+        {
+            bool const resumable = is_copy(it->second) && 0 != it->second.offset;
+            if (resumable)
+            {
+                it->second.recovered = true;
+                pending_copies[it->second.relative.generic_string()] = it->first;
+            }
+            it = resumable ? std::next(it) : pending.erase(it);
+        }
+        write_checkpoint();
+        return applied;
+    }
+
+    // Records an operation before it is applied; returns its sequence number.
+    uint64_t plan(op_t op, bool directory, std::filesystem::path const& relative, FileInfo const& info, std::filesystem::path const& old_relative = {})
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        uint64_t const seq = next_seq++;
+        record_t& record = pending[seq];
+        record.op = op;
+        record.directory = directory;
+        record.info = info;
+        record.relative = relative;
+        record.old_relative = old_relative;
+
+        if (is_copy(record))
+        {
+            auto const [it, inserted] = pending_copies.try_emplace(relative.generic_string(), seq);
+            if (false == inserted)
+            {
+                auto const previous = pending.find(it->second);
+                if (previous != pending.end())
+                {
+                    // An interrupted copy of the very same source version continues
+                    // where it stopped.
+                    record_t const& old = previous->second;
+                    if (old.info.size == info.size && old.info.mtime_ns == info.mtime_ns)
+                        record.offset = old.offset;
+                    pending.erase(previous);
+                }
+                it->second = seq;
+            }
+        }
+        bool due = append(format_plan(seq, record));
+        if (0 != record.offset)
+            due = append("C " + std::to_string(seq) + " " + std::to_string(record.offset));
+        lock.unlock();
+        if (due)
+            flush();
+        return seq;
+    }
+
+    void done(uint64_t seq)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto const it = pending.find(seq);
+        if (it == pending.end())
+            return;
+        apply(it->second);
+        forget(it);
+        bool const due = append("D " + std::to_string(seq));
+        lock.unlock();
+        if (due)
+            flush();
+    }
+
+    // The operation failed; it is dropped so that a later plan starts from scratch.
+    void abandon(uint64_t seq)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto const it = pending.find(seq);
+        if (it != pending.end())
+            forget(it);
+    }
+
+    // Resume offset and progress callback of the pending copy of `relative`.
+    copy_progress_t copy_progress(std::filesystem::path const& relative)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        copy_progress_t progress;
+        auto const it = pending_copies.find(relative.generic_string());
+        if (it == pending_copies.end())
+            return progress;
+        uint64_t const seq = it->second;
+        progress.resume_offset = pending.at(seq).offset;
+        progress.on_commit = [this, seq](uint64_t offset)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto const record = pending.find(seq);
+            if (record == pending.end())
+                return;
+            record->second.offset = offset;
+            bool const due = append("C " + std::to_string(seq) + " " + std::to_string(offset));
+            lock.unlock();
+            if (due)
+                flush();
+        };
+        return progress;
+    }
+
+    // Makes every buffered record durable. Records appended meanwhile go to the next
+    // batch.
+    void flush(void)
+    {
+        std::lock_guard<std::mutex> sync_lock(sync_mtx);
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            last_sync = std::chrono::steady_clock::now();
+            batch.swap(buffer);
+            buffered = 0;
+        }
+        write_out(batch);
+    }
+
+    // Meant to be called at the end of a cycle: makes its records durable and drops
+    // interrupted copies the cycle didn't pick up again, only those below `scopes` when
+    // the cycle rescanned just these subtrees. Once checkpoint_records have been written
+    // since the last checkpoint, the journal is compacted into a new snapshot generation.
+    void checkpoint(std::vector<std::filesystem::path> const& scopes = {})
+    {
+        std::unique_lock<std::mutex> sync_lock(sync_mtx);
+        std::unique_lock<std::mutex> lock(mtx);
+        for (auto it = pending.begin(); it != pending.end();)
+        {
+            bool const in_scope = scopes.empty() || std::any_of(scopes.begin(), scopes.end(),
+                [&it](std::filesystem::path const& scope) { return is_below(it->second.relative, scope); });
+            if (it->second.recovered && in_scope)
+            {
+                auto const next = std::next(it);
+                forget(it);
+                it = next;
+                dirty = true;
+            }
+            else
+                ++it;
+        }
+        if (dirty && records >= checkpoint_records)
+        {
+            write_checkpoint();
+            return;
+        }
+        lock.unlock();
+        sync_lock.unlock();
+        flush();
+    }
+
+private:
+
+    static bool is_copy(record_t const& record)
+    {
+        return false == record.directory && (op_t::CREATE == record.op || op_t::MODIFY == record.op);
+    }
+
+    void forget(std::map<uint64_t, record_t>::iterator it)
+    {
+        if (is_copy(it->second))
+        {
+            auto const copy = pending_copies.find(it->second.relative.generic_string());
+            if (copy != pending_copies.end() && copy->second == it->first)
+                pending_copies.erase(copy);
+        }
+        pending.erase(it);
+    }
+
+    static bool is_below(std::filesystem::path const& path, std::filesystem::path const& dir)
+    {
+        auto const [dir_end, path_it] = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+        return dir_end == dir.end();
+    }
+
+    void apply(record_t const& record)
+    {
+        switch (record.op)
+        {
+        case op_t::CREATE:
+        case op_t::MODIFY:
+        case op_t::METADATA:
+            applied[record.relative] = entry_t{ record.directory, record.info };
+            break;
+        case op_t::DELETE:
+            for (auto it = applied.lower_bound(record.relative); it != applied.end() && is_below(it->first, record.relative);)
+                it = applied.erase(it);
+            break;
+        case op_t::RENAME:
+        {
+            state_t moved;
+            for (auto it = applied.lower_bound(record.old_relative); it != applied.end() && is_below(it->first, record.old_relative);)
+            {
+                moved.emplace(record.relative / it->first.lexically_relative(record.old_relative), it->second);
+                it = applied.erase(it);
+            }
+            moved[record.relative] = entry_t{ record.directory, record.info };
+            applied.merge(moved);
+            break;
+        }
+        }
+    }
+
+    // Must be called with mtx held. Returns whether a batch is due, which the caller
+    // flushes once it released mtx.
+    bool append(std::string const& line)
+    {
+        buffer += line;
+        buffer += '\n';
+        ++buffered;
+        ++records;
+        dirty = true;
+        return buffered >= batch_records || std::chrono::steady_clock::now() - last_sync >= batch_interval;
+    }
+
+    // Must be called with sync_mtx and mtx held.
+    void sync(void)
+    {
+        last_sync = std::chrono::steady_clock::now();
+        write_out(buffer);
+        buffer.clear();
+        buffered = 0;
+    }
+
+    // Must be called with sync_mtx held, which keeps the descriptor open.
+    void write_out(std::string const& data)
+    {
+        if (data.empty())
+            return;
+#ifndef _WIN32
+        if (fd < 0)
+            throw std::filesystem::filesystem_error("Journal is not open", file, std::make_error_code(std::errc::bad_file_descriptor));
+        for (size_t written = 0; written < data.size();)
+        {
+            ssize_t const n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                throw std::filesystem::filesystem_error("Can't write journal", file, std::error_code(errno, std::generic_category()));
+            }
+            written += static_cast<size_t>(n);
+        }
+        if (0 != ::fdatasync(fd))
+            throw std::filesystem::filesystem_error("Can't sync journal", file, std::error_code(errno, std::generic_category()));
+#else
+        out << data << std::flush;
+#endif
+    }
+
+    static std::string escape(std::string const& str)
+    {
+        std::string result;
+        result.reserve(str.size());
+        for (char const c : str)
+        {
+            if ('\\' == c)
+                result += "\\\\";
+            else if ('\n' == c)
+                result += "\\n";
+            else if ('\t' == c)
+                result += "\\t";
+            else
+                result += c;
+        }
+        return result;
+    }
+
+    static std::string unescape(std::string const& str)
+    {
+        std::string result;
+        result.reserve(str.size());
+        for (size_t i = 0; i < str.size(); ++i)
+        {
+            if ('\\' == str[i] && i + 1 < str.size())
+            {
+                char const c = str[++i];
+                result += 'n' == c ? '\n' : 't' == c ? '\t' : c;
+            }
+            else
+                result += str[i];
+        }
+        return result;
+    }
+
+    static std::string format_info(bool directory, FileInfo const& info)
+    {
+        return std::string(directory ? "d" : "f") + " " + std::to_string(info.size) + " " + std::to_string(info.mtime_ns)
+            + " " + std::to_string(info.dev) + " " + std::to_string(info.ino) + " " + std::to_string(info.ctime_ns)
+            + " " + std::to_string(info.mode) + " " + std::to_string(info.uid) + " " + std::to_string(info.gid);
+    }
+
+    // `in` holds nothing but the info; journals written before ctime and ownership
+    // were recorded lack them, which leaves them 0.
+    static bool parse_info(std::istringstream& in, bool& directory, FileInfo& info)
+    {
+        std::string type;
+        if (false == static_cast<bool>(in >> type >> info.size >> info.mtime_ns >> info.dev >> info.ino) || ("d" != type && "f" != type))
+            return false;
+        if (false == static_cast<bool>(in >> info.ctime_ns >> info.mode >> info.uid >> info.gid))
+            info.ctime_ns = info.mode = info.uid = info.gid = 0;
+        directory = "d" == type;
+        return true;
+    }
+
+    static std::string format_plan(uint64_t seq, record_t const& record)
+    {
+        return "P " + std::to_string(seq) + " " + static_cast<char>(record.op) + " " + format_info(record.directory, record.info)
+            + "\t" + escape(record.relative.generic_string()) + "\t" + escape(record.old_relative.generic_string());
+    }
+
+    static std::string header(char const* kind, uint64_t generation)
+    {
+        return std::string("# dirsync ") + kind + " " + std::to_string(generation);
+    }
+
+    static bool read_header(std::istream& in, char const* kind, uint64_t& generation)
+    {
+        std::string line;
+        if (false == static_cast<bool>(std::getline(in, line)))
+            return false;
+        std::string const prefix = std::string("# dirsync ") + kind + " ";
+        if (0 != line.rfind(prefix, 0))
+            return false;
+        try
+        {
+            generation = std::stoull(line.substr(prefix.size()));
+        }
+        catch (std::logic_error const&)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    void load_snapshot(void)
+    {
+        std::ifstream in(snapshot_file, std::ios::binary);
+        if (false == in.is_open() || false == read_header(in, "snapshot", generation))
+            return;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            size_t const tab = line.find('\t');
+            if (std::string::npos == tab)
+                break;
+            std::istringstream fields(line.substr(0, tab));
+            entry_t entry;
+            if (false == parse_info(fields, entry.directory, entry.info))
+                break;
+            applied.emplace(unescape(line.substr(tab + 1)), entry);
+        }
+    }
+
+    // A torn record at the end of the journal ends the replay.
+    void replay(void)
+    {
+        std::ifstream in(file, std::ios::binary);
+        uint64_t journal_generation = 0;
+        if (false == in.is_open() || false == read_header(in, "journal", journal_generation) || journal_generation != generation)
+            return;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line.substr(0, line.find('\t')));
+            char kind = 0;
+            uint64_t seq = 0;
+            if (false == static_cast<bool>(fields >> kind >> seq))
+                break;
+            next_seq = std::max(next_seq, seq + 1);
+            if ('P' == kind)
+            {
+                size_t const first_tab = line.find('\t');
+                size_t const second_tab = std::string::npos == first_tab ? first_tab : line.find('\t', first_tab + 1);
+                char op = 0;
+                record_t record;
+                if (std::string::npos == second_tab || false == static_cast<bool>(fields >> op)
+                    || false == parse_info(fields, record.directory, record.info))
+                    break;
+                record.op = static_cast<op_t>(op);
+                record.relative = unescape(line.substr(first_tab + 1, second_tab - first_tab - 1));
+                record.old_relative = unescape(line.substr(second_tab + 1));
+                pending[seq] = std::move(record);
+            }
+            else if ('D' == kind)
+            {
+                auto const it = pending.find(seq);
+                if (it != pending.end())
+                {
+                    apply(it->second);
+                    pending.erase(it);
+                }
+            }
+            else if ('C' == kind)
+            {
+                uint64_t offset = 0;
+                if (false == static_cast<bool>(fields >> offset))
+                    break;
+                auto const it = pending.find(seq);
+                if (it != pending.end())
+                    it->second.offset = offset;
+            }
+            else
+                break;
+        }
+    }
+
+    // Writes the applied state as the next snapshot generation, then restarts the
+    // journal with the operations that are still pending. Both files are replaced
+    // with a rename, so a crash in between leaves a consistent pair behind: a journal
+    // of an older generation is ignored. Must be called with sync_mtx and mtx held.
+    void write_checkpoint(void)
+    {
+        sync();
+        ++generation;
+        dirty = false;
+        records = 0;
+
+        std::string snapshot = header("snapshot", generation) + "\n";
+        for (auto const& [relative, entry] : applied)
+            snapshot += format_info(entry.directory, entry.info) + "\t" + escape(relative.generic_string()) + "\n";
+        replace_file(snapshot_file, snapshot);
+
+        std::string journal = header("journal", generation) + "\n";
+        for (auto const& [seq, record] : pending)
+        {
+            journal += format_plan(seq, record) + "\n";
+            if (0 != record.offset)
+                journal += "C " + std::to_string(seq) + " " + std::to_string(record.offset) + "\n";
+        }
+        replace_file(file, journal);
+
+#ifndef _WIN32
+        if (fd >= 0)
+            ::close(fd);
+        fd = ::open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0)
+            throw std::filesystem::filesystem_error("Can't open journal", file, std::error_code(errno, std::generic_category()));
+#else
+        out.close();
+        out.open(file, std::ios::binary | std::ios::app);
+#endif
+    }
+
+    static void replace_file(std::filesystem::path const& path, std::string const& content)
+    {
+        std::filesystem::path const tmp = path.string() + ".tmp";
+#ifndef _WIN32
+        int const out_fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0)
+            throw std::filesystem::filesystem_error("Can't create journal file", tmp, std::error_code(errno, std::generic_category()));
+        for (size_t written = 0; written < content.size();)
+        {
+            ssize_t const n = ::write(out_fd, content.data() + written, content.size() - written);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+            {
+                std::error_code const ec(errno, std::generic_category());
+                ::close(out_fd);
+                throw std::filesystem::filesystem_error("Can't write journal file", tmp, ec);
+            }
+            written += static_cast<size_t>(n);
+        }
+        if (0 != ::fsync(out_fd))
+        {
+            std::error_code const ec(errno, std::generic_category());
+            ::close(out_fd);
+            throw std::filesystem::filesystem_error("Can't sync journal file", tmp, ec);
+        }
+        ::close(out_fd);
+#else
+        std::ofstream(tmp, std::ios::binary | std::ios::trunc) << content;
+#endif
+        std::filesystem::rename(tmp, path);
+    }
+};
@@ -8,17 +8,39 @@
 #include <chrono>
 #include <fstream>
 #include <mutex> 
+#include <string>
+#include <memory>
+#include <stdexcept>
 
 
-class Logger
+// Destination of log records. Logger writes them to the console and a log file;
+// programs embedding the library pass a sink of their own to SyncService.
+class LogSink
 {
 public:
 
     enum class severity_t { INFO, WARNING, ERROR, FATAL, DEBUG };
 
-private:
+    virtual ~LogSink(void) = default;
+
+    virtual bool is_enabled(severity_t severity) const
+    {
+        (void)severity;
+        return true;
+    }
+
+    virtual void write(severity_t severity, char const* file, size_t line, std::string const& message) = 0;
+};
+
 
+// Logger::logf hands records to the sink installed on the calling thread with
+// Logger::scope_t, or to the process-wide Logger instance when there is none. Thread
+// pools install the sink that was current when they were created on their workers,
+// so every thread a SyncService starts logs to that service's sink.
+class Logger final : public LogSink
+{
     static inline Logger* this_ptr = nullptr;
+    static inline thread_local LogSink* scoped_sink = nullptr;
     std::ofstream* outf;
     std::ostream& out;
     bool const debug;
@@ -56,16 +78,74 @@ public:
 
     Logger& operator=(Logger&&) = delete;
 
+    // Installs `sink` as the sink of the calling thread for its lifetime; nullptr
+    // keeps the process-wide Logger.
+    class scope_t
+    {
+        LogSink* const previous;
+
+    public:
+
+        explicit scope_t(LogSink* sink)
+            : previous(scoped_sink)
+        {
+            scoped_sink = sink;
+        }
+
+        ~scope_t(void)
+        {
+            scoped_sink = previous;
+        }
+
+        scope_t(const scope_t&) = delete;
+
+        scope_t& operator=(const scope_t&) = delete;
+    };
+
+    static LogSink* current_sink(void)
+    {
+        return scoped_sink;
+    }
+
     template<typename ...T>
     static void logf(Logger::severity_t severity, const char* FILE, size_t LINE, char const* fmt, T&& ... args)  //__attribute__ ((format(printf, 4, 5)));
     {
-        if (nullptr == this_ptr)
+        LogSink* const sink = scoped_sink ? scoped_sink : this_ptr;
+        if (nullptr == sink)
             throw std::runtime_error("The logger must first be instantiated");
 
-        if (Logger::severity_t::DEBUG == severity && false == this_ptr->debug)
+        if (false == sink->is_enabled(severity))
             return;
 
-        this_ptr->logf_internal(severity, FILE, LINE, fmt, std::forward<T>(args)...);
+        sink->write(severity, FILE, LINE, format(fmt, std::forward<T>(args)...));
+    }
+
+    virtual bool is_enabled(severity_t severity) const override
+    {
+        return severity_t::DEBUG != severity || debug;
+    }
+
+    virtual void write(severity_t severity, char const* FILE, size_t LINE, std::string const& message) override
+    {
+        std::time_t cur_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        // Copy and scan threads log concurrently, std::localtime's buffer is shared.
+        std::tm cur_time_buffer{};
+#ifdef _WIN32
+        ::localtime_s(&cur_time_buffer, &cur_time);
+#else
+        ::localtime_r(&cur_time, &cur_time_buffer);
+#endif
+        std::tm const* cur_time_local = &cur_time_buffer;
+        if (true == show_source)
+        {
+            std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << message << " (FROM: " << FILE << ":" << LINE << ")" << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
+            std::osyncstream(*outf) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << message << " (FROM: " << FILE << ":" << LINE << ")" << std::endl;
+        }
+        else
+        {
+            std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << message << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
+            std::osyncstream(*outf) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << message << " (FROM: " << FILE << ":" << LINE << ")" << std::endl;
+        }
     }
 
 
@@ -108,25 +188,8 @@ private:
         }
     }
 
-    template<typename ...T>
-    void logf_internal(Logger::severity_t severity, const char* FILE, size_t LINE, char const* fmt, T&& ... args)
-    {
-        std::time_t cur_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-        std::tm* cur_time_local = std::localtime(&cur_time);
-        if (true == show_source)
-        {
-            std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << " (FROM: " << FILE << ":" << LINE << ")" << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
-            std::osyncstream(*outf) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << " (FROM: " << FILE << ":" << LINE << ")" << std::endl;
-        }
-        else
-        {
-            std::osyncstream(out) << get_severity_color_str(severity) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << get_severity_color_str(Logger::severity_t::INFO) << std::endl;
-            std::osyncstream(*outf) << std::put_time(cur_time_local, "%Y/%m/%d %H:%M:%S") << " | " << get_severity_str(severity) << ": " << this->format(fmt, std::forward<T>(args)...) << " (FROM: " << FILE << ":" << LINE << ")" << std::endl;
-        }
-    }
-
     template<typename ... Args>
-    std::string format(char const* format, Args&& ... args)
+    static std::string format(char const* format, Args&& ... args)
     {
         const int size_s = std::snprintf(nullptr, 0, format, args ...) + 1;
         if (size_s <= 0) { throw std::runtime_error("Error during formatting."); }
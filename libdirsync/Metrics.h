@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include "IoScheduler.h"
+
+
+// Histogram with power-of-two millisecond buckets, good enough to report percentiles
+// of replication lag without storing samples. Samples go to the slot of the minute
+// they were recorded in and percentiles cover the current and the previous minute, so
+// one slow burst, such as an initial sync, doesn't pin them for good.
+class LatencyHistogram
+{
+    static constexpr size_t bucket_count = 40;
+    static constexpr std::chrono::seconds period{ 60 };
+
+    struct slot_t
+    {
+        std::atomic<int64_t> epoch{ -1 };
+        std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+    };
+    std::array<slot_t, 2> slots;
+    // Only taken to recycle a slot, once a minute.
+    std::mutex mtx;
+
+    static int64_t current_epoch(void)
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count() / period.count();
+    }
+
+    // Bucket totals of the slots inside the window.
+    std::array<uint64_t, bucket_count> totals(void) const
+    {
+        int64_t const epoch = current_epoch();
+        std::array<uint64_t, bucket_count> result{};
+        for (auto const& slot : slots)
+        {
+            int64_t const slot_epoch = slot.epoch.load(std::memory_order_acquire);
+            if (slot_epoch != epoch && slot_epoch + 1 != epoch)
+                continue;
+            for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+                result[bucket] += slot.buckets[bucket].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+public:
+
+    void record(std::chrono::nanoseconds latency)
+    {
+        int64_t const ms = std::chrono::duration_cast<std::chrono::milliseconds>(latency).count();
+        size_t bucket = 0;
+        while (bucket + 1 < bucket_count && (int64_t(1) << bucket) <= ms)
+            ++bucket;
+        int64_t const epoch = current_epoch();
+        slot_t& slot = slots[static_cast<size_t>(epoch) % slots.size()];
+        if (epoch != slot.epoch.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (epoch != slot.epoch.load(std::memory_order_relaxed))
+            {
+                for (auto& b : slot.buckets)
+                    b.store(0, std::memory_order_relaxed);
+                slot.epoch.store(epoch, std::memory_order_release);
+            }
+        }
+        slot.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count(void) const
+    {
+        uint64_t total = 0;
+        for (uint64_t const b : totals())
+            total += b;
+        return total;
+    }
+
+    // Upper bound of the bucket holding the given percentile, in milliseconds.
+    uint64_t percentile_ms(double percentile) const
+    {
+        std::array<uint64_t, bucket_count> const buckets = totals();
+        uint64_t total = 0;
+        for (uint64_t const b : buckets)
+            total += b;
+        if (0 == total)
+            return 0;
+        uint64_t const target = static_cast<uint64_t>(static_cast<double>(total) * percentile / 100.0);
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+        {
+            seen += buckets[bucket];
+            if (seen > target || seen == total)
+                return uint64_t(1) << bucket;
+        }
+        return uint64_t(1) << (bucket_count - 1);
+    }
+};
+
+
+// Counters shared by the scanner and copy threads of one job. Cycle reports are the
+// difference between two snapshots.
+struct JobMetrics
+{
+    struct snapshot_t
+    {
+        uint64_t files_copied = 0;
+        uint64_t bytes_copied = 0;
+        uint64_t entries_deleted = 0;
+        uint64_t throttle_wait_ns = 0;
+        uint64_t metadata_updated = 0;
+
+        snapshot_t operator-(snapshot_t const& other) const
+        {
+            return { files_copied - other.files_copied, bytes_copied - other.bytes_copied,
+                entries_deleted - other.entries_deleted, throttle_wait_ns - other.throttle_wait_ns, metadata_updated - other.metadata_updated };
+        }
+    };
+
+    std::atomic<uint64_t> files_copied{ 0 };
+    std::atomic<uint64_t> bytes_copied{ 0 };
+    std::atomic<uint64_t> entries_deleted{ 0 };
+    std::atomic<uint64_t> throttle_wait_ns{ 0 };
+    std::atomic<uint64_t> metadata_updated{ 0 };
+    std::array<LatencyHistogram, IoScheduler::priority_count> lag;
+
+    snapshot_t snapshot(void) const
+    {
+        return { files_copied.load(std::memory_order_relaxed), bytes_copied.load(std::memory_order_relaxed),
+            entries_deleted.load(std::memory_order_relaxed), throttle_wait_ns.load(std::memory_order_relaxed), metadata_updated.load(std::memory_order_relaxed) };
+    }
+};
@@ -0,0 +1,851 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <cstdint>
+#include "Logger.h"
+#include "Sha256.h"
+#include "CopyEngine.h"
+#include "ReplicaProtocol.h"
+#include "Compressor.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
+
+
+// Client side of a replica served by a ReplicaAgent, for jobs whose replica is
+// "tcp://host:port". All operations of a job share one connection: every caller sends
+// its requests and waits for its own replies, so concurrent copies are pipelined
+// instead of paying a round trip per request. The post_* functions only send and
+// leave the wait to the caller, which is how a change set gets applied with a single
+// round trip. A lost connection fails the requests in flight and is reopened by the
+// next request.
+//
+// Files that already exist in the replica can be sent as a delta: the agent returns a
+// SHA-256 per block of its copy and only blocks that differ travel.
+//
+// On Linux file data doesn't pass through user space unless it has to: whole files go
+// out with sendfile(), and the blocks of a delta, which have to be read for hashing,
+// with MSG_ZEROCOPY when they are large, so the kernel sends from the read buffers
+// instead of copying them. zero_copy = false sends everything with read and send.
+//
+// With compression enabled, and an agent that supports it, file data goes out as zstd
+// frames instead, one per chunk or run of changed blocks; chunks that don't shrink
+// are sent as they are and end compression for the rest of their file.
+class RemoteReplica final
+{
+public:
+
+    static constexpr char const* scheme = "tcp://";
+    static constexpr uint32_t block_size = 64 << 10;
+    // Below this a delta costs more round trip than it saves transfer.
+    static constexpr uint64_t delta_min_size = 1 << 20;
+
+    struct stat_t
+    {
+        ReplicaProtocol::kind_t kind = ReplicaProtocol::kind_t::MISSING;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+    };
+
+    struct signature_t
+    {
+        uint64_t size = 0;
+        uint32_t block_size = 0;
+        std::vector<Sha256::digest_t> blocks;
+    };
+
+    static bool is_remote(std::string const& replica)
+    {
+        return 0 == replica.rfind(scheme, 0);
+    }
+
+#ifndef _WIN32
+private:
+
+    using message_t = ReplicaProtocol::message_t;
+
+    struct reply_t
+    {
+        bool done = false;
+        message_t type = message_t::STATUS;
+        std::vector<char> payload;
+    };
+
+    struct connection_t
+    {
+        int fd = -1;
+        std::thread reader;
+        std::mutex send_mtx;
+        std::mutex mtx;
+        std::condition_variable cv;
+        // Requests waiting for a reply, by id.
+        std::unordered_map<uint32_t, reply_t> replies;
+        int error = 0;
+        std::atomic<uint32_t> next_id{ 1 };
+        // MSG_ZEROCOPY bookkeeping: sends issued (under send_mtx), sends the kernel
+        // reported complete (under mtx) and whether a thread is reading those reports.
+        bool zerocopy = false;
+        uint32_t zerocopy_sent = 0;
+        uint32_t zerocopy_done = 0;
+        bool zerocopy_polling = false;
+        // The agent accepts DATA_ZSTD.
+        bool compress = false;
+        // The agent takes the mtime a CLOSE carries.
+        bool set_mtime = false;
+
+        ~connection_t(void)
+        {
+            ::shutdown(fd, SHUT_RDWR);
+            if (reader.joinable())
+                reader.join();
+            ::close(fd);
+        }
+    };
+
+    std::string const endpoint;
+    bool const zero_copy;
+    Compressor::settings_t const compression;
+    Compressor::tuner_t tuner;
+    LogSink* const log_sink = Logger::current_sink();
+    std::mutex mtx;
+    std::shared_ptr<connection_t> connection;
+    // Compressors are kept for reuse, a zstd context with workers is costly to set up.
+    std::vector<std::unique_ptr<Compressor>> idle_compressors;
+    std::atomic<uint64_t> bytes_sent{ 0 };
+
+public:
+
+    // A request that has been sent; wait() for its outcome.
+    struct pending_t
+    {
+        std::shared_ptr<connection_t> connection;
+        uint32_t id = 0;
+        std::filesystem::path relative;
+        // Set for file transfers, which count in the metrics once they succeeded.
+        CopyEngine* engine = nullptr;
+        uint64_t bytes = 0;
+    };
+
+    // `replica` is "tcp://host:port"; nothing is connected before the first request.
+    explicit RemoteReplica(std::string const& replica, bool zero_copy_ = true, Compressor::settings_t const& compression_ = {})
+        : endpoint(replica.substr(is_remote(replica) ? std::char_traits<char>::length(scheme) : 0))
+        , zero_copy(zero_copy_)
+        , compression(compression_)
+        , tuner(compression_.target_rate)
+    {
+    }
+
+    RemoteReplica(const RemoteReplica&) = delete;
+
+    RemoteReplica& operator=(const RemoteReplica&) = delete;
+
+    // File data put on the wire so far, after compression.
+    uint64_t get_bytes_sent(void) const
+    {
+        return bytes_sent.load(std::memory_order_relaxed);
+    }
+
+    // Whether replica files carry the mtimes of their sources, which makes a STAT
+    // enough to tell that a file is up to date.
+    bool preserves_mtime(void)
+    {
+        return get_connection()->set_mtime;
+    }
+
+    std::vector<stat_t> stat(std::vector<std::filesystem::path> const& paths)
+    {
+        std::shared_ptr<connection_t> const current = get_connection();
+        uint32_t const id = expect(*current);
+        ReplicaProtocol::writer_t out;
+        out.begin(message_t::STAT, id).u32(static_cast<uint32_t>(paths.size()));
+        for (auto const& relative : paths)
+            out.path(relative);
+        send(*current, id, out.end());
+
+        reply_t const reply = receive({ current, id, {} }, message_t::STAT_REPLY);
+        ReplicaProtocol::reader_t in(reply.payload);
+        std::vector<stat_t> result(in.u32());
+        for (auto& entry : result)
+        {
+            entry.kind = static_cast<ReplicaProtocol::kind_t>(in.u8());
+            entry.size = in.u64();
+            entry.mtime_ns = in.i64();
+        }
+        return result;
+    }
+
+    // Signatures of several files with a single round trip.
+    std::vector<signature_t> signatures(std::vector<std::filesystem::path> const& paths)
+    {
+        std::shared_ptr<connection_t> const current = get_connection();
+        std::vector<pending_t> pending;
+        ReplicaProtocol::writer_t out;
+        for (auto const& relative : paths)
+        {
+            pending.push_back({ current, expect(*current), relative });
+            out.begin(message_t::SIGNATURE, pending.back().id).path(relative).u32(block_size).end();
+        }
+        send(*current, pending, out);
+
+        std::vector<signature_t> result;
+        for (auto const& request : pending)
+        {
+            reply_t const reply = receive(request, message_t::SIGNATURE_REPLY);
+            ReplicaProtocol::reader_t in(reply.payload);
+            signature_t& signature = result.emplace_back();
+            signature.size = in.u64();
+            signature.block_size = in.u32();
+            signature.blocks.resize(in.u32());
+            for (auto& digest : signature.blocks)
+            {
+                auto const bytes = in.bytes(digest.size());
+                std::copy(bytes.begin(), bytes.end(), digest.begin());
+            }
+        }
+        return result;
+    }
+
+    pending_t post_make_directory(std::filesystem::path const& relative)
+    {
+        return post(message_t::MKDIR, relative, [&](ReplicaProtocol::writer_t& out) { out.path(relative); });
+    }
+
+    pending_t post_remove_file(std::filesystem::path const& relative)
+    {
+        return post(message_t::UNLINK, relative, [&](ReplicaProtocol::writer_t& out) { out.path(relative); });
+    }
+
+    pending_t post_remove_tree(std::filesystem::path const& relative, bool deferred)
+    {
+        return post(message_t::RMTREE, relative, [&](ReplicaProtocol::writer_t& out) { out.path(relative).u8(deferred ? 1 : 0); });
+    }
+
+    // Streams `from` to `relative`. With a signature of the replica's copy, blocks it
+    // already holds are skipped. Throws if the source can't be read or the copy is
+    // cancelled; errors of the agent show up in wait().
+    pending_t post_file(std::filesystem::path const& from, std::filesystem::path const& relative, CopyEngine& engine, signature_t const* signature = nullptr)
+    {
+        int const in = ::open(from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (in < 0 || 0 != ::fstat(in, &st))
+        {
+            std::error_code const ec(errno, std::generic_category());
+            if (in >= 0)
+                ::close(in);
+            throw std::filesystem::filesystem_error("Can't open source file", from, ec);
+        }
+        // The mtime from before the copy, a change meanwhile leaves the replica looking stale.
+        int64_t const mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        std::shared_ptr<connection_t> const current = get_connection();
+        bool const delta = signature && false == signature->blocks.empty() && 0 != signature->block_size;
+        // Large files are compressed by several workers, which need chunks of a few MiB
+        // to share.
+        size_t const threads = current->compress && static_cast<uint64_t>(st.st_size) >= Compressor::multithread_min && compression.threads > 1
+            ? compression.threads : 0;
+        size_t const chunk = 0 != threads ? 4 * CopyEngine::chunk_size : CopyEngine::chunk_size;
+        size_t const unit = delta ? signature->block_size : chunk;
+        // Whole blocks per read, so that block boundaries line up with buffer boundaries.
+        size_t const span = std::max(unit, chunk / unit * unit);
+        auto const unchanged = [&](std::vector<char> const& buffer, uint64_t offset, size_t at, size_t size)
+        {
+            uint64_t const block = (offset + at) / unit;
+            return delta && block < signature->blocks.size() && (size == unit || offset + at + size == signature->size)
+                && Sha256::hash(buffer.data() + at, size) == signature->blocks[block];
+        };
+
+        pending_t pending{ current, expect(*current), relative, &engine };
+        // The OPEN goes out together with the first DATA header.
+        ReplicaProtocol::writer_t out;
+        out.begin(message_t::OPEN, pending.id).path(relative).u32(static_cast<uint32_t>(st.st_mode & 07777)).u8(delta ? 0 : 1).end();
+#ifdef __linux__
+        bool const use_sendfile = zero_copy && false == delta && false == current->compress;
+#else
+        bool const use_sendfile = false;
+#endif
+        // With zero-copy sends a buffer may only be refilled once the kernel is done
+        // with it, so several of them take turns.
+        std::vector<std::vector<char>> buffers(use_sendfile ? 0 : current->zerocopy ? 4 : 1, std::vector<char>(span));
+        std::vector<uint32_t> needed(buffers.size(), 0);
+        std::unique_ptr<Compressor> compressor = current->compress ? acquire_compressor() : nullptr;
+        uint64_t size = static_cast<uint64_t>(st.st_size);
+        uint64_t offset = 0;
+        try
+        {
+            for (size_t round = 0;; ++round)
+            {
+                if (engine.is_cancelled())
+                    throw std::filesystem::filesystem_error("Copy cancelled", from, std::make_error_code(std::errc::operation_canceled));
+                if (use_sendfile)
+                {
+                    // Like a read loop, a file that grew meanwhile is sent to its new end.
+                    if (offset >= size && (0 != ::fstat(in, &st) || static_cast<uint64_t>(st.st_size) <= offset))
+                        break;
+                    size = std::max(size, static_cast<uint64_t>(st.st_size));
+                    size_t const n = static_cast<size_t>(std::min<uint64_t>(span, size - offset));
+                    engine.throttle_bytes(n);
+                    size_t const sent = send_file_data(*current, out, pending.id, in, offset, n, from);
+                    out.clear();
+                    pending.bytes += n;
+                    bytes_sent.fetch_add(n, std::memory_order_relaxed);
+                    offset += sent;
+                    if (sent < n)
+                        break;
+                    continue;
+                }
+
+                size_t const slot = round % buffers.size();
+                wait_zerocopy(*current, needed[slot]);
+                std::vector<char>& buffer = buffers[slot];
+                size_t const n = read_at(in, buffer, offset, from);
+                // Every run of blocks the replica doesn't hold goes out as one frame.
+                for (size_t at = 0; at < n;)
+                {
+                    size_t end = at;
+                    while (end < n && false == unchanged(buffer, offset, end, std::min(unit, n - end)))
+                        end += std::min(unit, n - end);
+                    if (end > at)
+                    {
+                        std::span<char const> const run(buffer.data() + at, end - at);
+                        size_t const packed = compressor ? send_packed_data(*current, out, pending.id, offset + at, run, *compressor, threads) : 0;
+                        if (0 == packed)
+                        {
+                            release_compressor(std::move(compressor));
+                            engine.throttle_bytes(run.size());
+                            // A copied run must not clear what an earlier zero-copy one of the buffer needs.
+                            if (uint32_t const count = send_buffer_data(*current, out, pending.id, offset + at, run))
+                                needed[slot] = count;
+                        }
+                        else
+                            engine.throttle_bytes(packed);
+                        out.clear();
+                        pending.bytes += run.size();
+                        bytes_sent.fetch_add(0 != packed ? packed : run.size(), std::memory_order_relaxed);
+                    }
+                    for (at = end; at < n && unchanged(buffer, offset, at, std::min(unit, n - at));)
+                        at += std::min(unit, n - at);
+                }
+                offset += n;
+                if (n < buffer.size())
+                    break;
+            }
+        }
+        catch (...)
+        {
+            for (uint32_t const count : needed)
+                wait_zerocopy(*current, count);
+            release_compressor(std::move(compressor));
+            ::close(in);
+            // The stream is closed either way, so the agent doesn't keep the file open;
+            // cutting it at what was sent keeps a half-updated copy from looking complete.
+            out.clear();
+            out.begin(message_t::CLOSE, pending.id).u64(offset).end();
+            forget(*current, pending.id);
+            try
+            {
+                send(*current, pending.id, out);
+            }
+            catch (std::exception const&)
+            {
+            }
+            throw;
+        }
+        for (uint32_t const count : needed)
+            wait_zerocopy(*current, count);
+        release_compressor(std::move(compressor));
+        ::close(in);
+        out.begin(message_t::CLOSE, pending.id).u64(offset);
+        if (current->set_mtime)
+            out.i64(mtime_ns);
+        send(*current, pending.id, out.end());
+        return pending;
+    }
+
+    // Waits for the outcome of a request; throws what the agent reported.
+    void wait(pending_t const& pending)
+    {
+        receive(pending, message_t::STATUS);
+        if (pending.engine)
+        {
+            JobMetrics& metrics = pending.engine->get_metrics();
+            metrics.files_copied.fetch_add(1, std::memory_order_relaxed);
+            metrics.bytes_copied.fetch_add(pending.bytes, std::memory_order_relaxed);
+        }
+    }
+
+    // Waits for all of them, then throws the first error, if any.
+    void wait_all(std::vector<pending_t> const& pending)
+    {
+        std::exception_ptr error;
+        for (auto const& request : pending)
+        {
+            try
+            {
+                wait(request);
+            }
+            catch (...)
+            {
+                if (nullptr == error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    void make_directory(std::filesystem::path const& relative)
+    {
+        wait(post_make_directory(relative));
+    }
+
+    void remove_file(std::filesystem::path const& relative)
+    {
+        wait(post_remove_file(relative));
+    }
+
+    void remove_tree(std::filesystem::path const& relative, bool deferred)
+    {
+        wait(post_remove_tree(relative, deferred));
+    }
+
+    // False when `from` doesn't exist in the replica.
+    bool rename(std::filesystem::path const& from, std::filesystem::path const& to)
+    {
+        try
+        {
+            wait(post(message_t::RENAME, from, [&](ReplicaProtocol::writer_t& out) { out.path(from).path(to); }));
+        }
+        catch (std::filesystem::filesystem_error const& e)
+        {
+            if (std::errc::no_such_file_or_directory == e.code())
+                return false;
+            throw;
+        }
+        return true;
+    }
+
+    // Sends a whole file; with `delta` and a source of at least delta_min_size the
+    // replica's copy is diffed first.
+    void send_file(std::filesystem::path const& from, std::filesystem::path const& relative, CopyEngine& engine, bool delta)
+    {
+        std::error_code ec;
+        uint64_t const size = delta ? std::filesystem::file_size(from, ec) : 0;
+        if (delta && false == static_cast<bool>(ec) && size >= delta_min_size)
+        {
+            signature_t const signature = std::move(signatures({ relative }).front());
+            wait(post_file(from, relative, engine, &signature));
+        }
+        else
+            wait(post_file(from, relative, engine));
+    }
+
+private:
+
+    std::shared_ptr<connection_t> get_connection(void)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (connection)
+        {
+            std::lock_guard<std::mutex> connection_lock(connection->mtx);
+            if (0 == connection->error)
+                return connection;
+        }
+        auto fresh = std::make_shared<connection_t>();
+        fresh->fd = ReplicaProtocol::connect(endpoint);
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+        int const one = 1;
+        fresh->zerocopy = zero_copy && 0 == ::setsockopt(fresh->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+#endif
+        fresh->reader = std::thread(&RemoteReplica::read_loop, fresh.get(), log_sink);
+        uint32_t const id = expect(*fresh);
+        uint32_t const wanted = ReplicaProtocol::feature_mtime | (compression.enabled && Compressor::available ? ReplicaProtocol::feature_zstd : 0);
+        ReplicaProtocol::writer_t out;
+        send(*fresh, id, out.begin(message_t::HELLO, id).u32(ReplicaProtocol::version).u32(wanted).end());
+        reply_t const reply = receive({ fresh, id, {} }, message_t::HELLO_REPLY);
+        uint32_t const features = ReplicaProtocol::reader_t(reply.payload).u32();
+        fresh->compress = 0 != (features & ReplicaProtocol::feature_zstd);
+        fresh->set_mtime = 0 != (features & ReplicaProtocol::feature_mtime);
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Connected to replica agent %s", endpoint.c_str());
+        if (0 != (wanted & ~features & ReplicaProtocol::feature_zstd))
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Replica agent %s can't decompress, sending data uncompressed", endpoint.c_str());
+        connection = fresh;
+        return connection;
+    }
+
+    // Hands every reply to the request waiting for it until the connection breaks.
+    static void read_loop(connection_t* current, LogSink* log_sink)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        int error = ECONNRESET;
+        try
+        {
+            ReplicaProtocol::frame_reader_t in(current->fd);
+            ReplicaProtocol::header_t header;
+            std::span<char const> payload;
+            while (in.next(header, payload))
+            {
+                std::lock_guard<std::mutex> lock(current->mtx);
+                auto const it = current->replies.find(header.id);
+                if (it == current->replies.end())
+                    continue;
+                it->second.done = true;
+                it->second.type = header.type;
+                it->second.payload.assign(payload.begin(), payload.end());
+                current->cv.notify_all();
+            }
+        }
+        catch (std::system_error const& e)
+        {
+            error = e.code().value();
+        }
+        std::lock_guard<std::mutex> lock(current->mtx);
+        current->error = error;
+        current->cv.notify_all();
+    }
+
+    template<typename F>
+    pending_t post(message_t type, std::filesystem::path const& relative, F const& fill)
+    {
+        std::shared_ptr<connection_t> const current = get_connection();
+        pending_t pending{ current, expect(*current), relative };
+        ReplicaProtocol::writer_t out;
+        out.begin(type, pending.id);
+        fill(out);
+        send(*current, pending.id, out.end());
+        return pending;
+    }
+
+    static uint32_t expect(connection_t& current)
+    {
+        uint32_t const id = current.next_id.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(current.mtx);
+        current.replies.emplace(id, reply_t{});
+        return id;
+    }
+
+    static void forget(connection_t& current, uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(current.mtx);
+        current.replies.erase(id);
+    }
+
+    // A failed send drops the replies the caller was about to wait for.
+    static void send(connection_t& current, uint32_t id, ReplicaProtocol::writer_t const& out, std::span<char const> tail = {})
+    {
+        try
+        {
+            std::lock_guard<std::mutex> lock(current.send_mtx);
+            ReplicaProtocol::send_all(current.fd, out.data(), tail);
+        }
+        catch (...)
+        {
+            forget(current, id);
+            throw;
+        }
+    }
+
+    static void send(connection_t& current, std::vector<pending_t> const& pending, ReplicaProtocol::writer_t const& out)
+    {
+        try
+        {
+            std::lock_guard<std::mutex> lock(current.send_mtx);
+            ReplicaProtocol::send_all(current.fd, out.data());
+        }
+        catch (...)
+        {
+            for (auto const& request : pending)
+                forget(current, request.id);
+            throw;
+        }
+    }
+
+    reply_t receive(pending_t const& pending, message_t expected)
+    {
+        connection_t& current = *pending.connection;
+        std::unique_lock<std::mutex> lock(current.mtx);
+        auto const it = current.replies.find(pending.id);
+        if (it == current.replies.end())
+            throw std::logic_error("Replica request waited for twice");
+        // Other requests may rehash the table meanwhile, the element itself stays put.
+        reply_t& slot = it->second;
+        current.cv.wait(lock, [&] { return slot.done || 0 != current.error; });
+        reply_t reply = std::move(slot);
+        current.replies.erase(pending.id);
+        lock.unlock();
+
+        std::filesystem::path const path = std::filesystem::path(scheme + endpoint) / pending.relative;
+        if (false == reply.done)
+            throw std::filesystem::filesystem_error("Replica connection lost", path, std::error_code(current.error, std::generic_category()));
+        ReplicaProtocol::reader_t in(reply.payload);
+        if (message_t::STATUS == reply.type)
+        {
+            int const error = in.i32();
+            std::string const what = in.string();
+            if (0 != error)
+                throw std::filesystem::filesystem_error(what, path, std::error_code(error, std::generic_category()));
+        }
+        if (expected != reply.type)
+            throw std::filesystem::filesystem_error("Unexpected reply from replica agent", path, std::make_error_code(std::errc::protocol_error));
+        return reply;
+    }
+
+    std::unique_ptr<Compressor> acquire_compressor(void)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (idle_compressors.empty())
+            return std::make_unique<Compressor>();
+        std::unique_ptr<Compressor> compressor = std::move(idle_compressors.back());
+        idle_compressors.pop_back();
+        return compressor;
+    }
+
+    void release_compressor(std::unique_ptr<Compressor> compressor)
+    {
+        if (nullptr == compressor)
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        idle_compressors.push_back(std::move(compressor));
+    }
+
+    // Sends `data` as a DATA_ZSTD frame (after whatever `out` holds) and returns the
+    // compressed size, or sends nothing and returns 0 when it doesn't compress.
+    size_t send_packed_data(connection_t& current, ReplicaProtocol::writer_t& out, uint32_t id, uint64_t offset, std::span<char const> data,
+        Compressor& compressor, size_t threads)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        std::span<char const> const packed = compressor.compress(data, 0 != compression.level ? compression.level : tuner.get_level(), threads);
+        if (0 == compression.level)
+            tuner.record(data.size() / std::max<size_t>(1, threads), std::chrono::steady_clock::now() - start);
+        if (packed.empty())
+            return 0;
+        out.begin(message_t::DATA_ZSTD, id).u64(offset).u32(static_cast<uint32_t>(data.size())).end(packed.size());
+        std::lock_guard<std::mutex> lock(current.send_mtx);
+        ReplicaProtocol::send_all(current.fd, out.data(), packed);
+        return packed.size();
+    }
+
+    // Below this MSG_ZEROCOPY costs more in page pinning and completion handling than
+    // the copy it saves.
+    static constexpr size_t zerocopy_min = 64 << 10;
+
+    // Sends a DATA frame (after whatever `out` holds) with `data` as payload. Returns the
+    // count of completed zero-copy sends wait_zerocopy() needs before `data` may be
+    // overwritten, 0 if it was copied right away.
+    static uint32_t send_buffer_data(connection_t& current, ReplicaProtocol::writer_t& out, uint32_t id, uint64_t offset, std::span<char const> data)
+    {
+        out.begin(message_t::DATA, id).u64(offset).end(data.size());
+        std::lock_guard<std::mutex> lock(current.send_mtx);
+#ifdef MSG_ZEROCOPY
+        if (current.zerocopy && data.size() >= zerocopy_min)
+        {
+            ReplicaProtocol::send_all(current.fd, out.data(), {}, MSG_MORE);
+            for (size_t done = 0; done < data.size();)
+            {
+                ssize_t const n = ::send(current.fd, data.data() + done, data.size() - done, MSG_NOSIGNAL | MSG_ZEROCOPY);
+                if (n < 0 && EINTR == errno)
+                    continue;
+                if (n < 0 && ENOBUFS == errno)
+                {
+                    // Out of locked memory for pinned pages, this part is copied.
+                    ReplicaProtocol::send_all(current.fd, data.subspan(done));
+                    break;
+                }
+                if (n < 0)
+                    throw std::system_error(errno, std::generic_category(), "Can't write to replica connection");
+                ++current.zerocopy_sent;
+                done += static_cast<size_t>(n);
+            }
+            return current.zerocopy_sent;
+        }
+#endif
+        ReplicaProtocol::send_all(current.fd, out.data(), data);
+        return 0;
+    }
+
+    // Returns once the kernel reported `needed` zero-copy sends of the connection
+    // complete, or the connection broke. One waiter at a time reads the reports from
+    // the socket's error queue, the others sleep until it has.
+    static void wait_zerocopy(connection_t& current, uint32_t needed)
+    {
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+        if (0 == needed)
+            return;
+        std::unique_lock<std::mutex> lock(current.mtx);
+        while (static_cast<int32_t>(current.zerocopy_done - needed) < 0 && 0 == current.error)
+        {
+            if (current.zerocopy_polling)
+            {
+                current.cv.wait(lock);
+                continue;
+            }
+            current.zerocopy_polling = true;
+            lock.unlock();
+            // POLLERR, which signals the error queue, is reported without asking.
+            pollfd fds{ current.fd, 0, 0 };
+            ::poll(&fds, 1, 100);
+            uint32_t done = 0;
+            bool const completed = read_zerocopy_reports(current.fd, done);
+            lock.lock();
+            if (completed && static_cast<int32_t>(done - current.zerocopy_done) > 0)
+                current.zerocopy_done = done;
+            current.zerocopy_polling = false;
+            current.cv.notify_all();
+        }
+#else
+        (void)current;
+        (void)needed;
+#endif
+    }
+
+#if defined(__linux__) && defined(SO_ZEROCOPY)
+    // Drains the error queue; `done` is one past the highest send reported complete.
+    // TCP completes sends in order, so that is the count of completed sends.
+    static bool read_zerocopy_reports(int fd, uint32_t& done)
+    {
+        bool completed = false;
+        while (true)
+        {
+            char control[128];
+            msghdr message{};
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if (::recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                return completed;
+            for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            {
+                bool const is_error = (SOL_IP == header->cmsg_level && IP_RECVERR == header->cmsg_type)
+                    || (SOL_IPV6 == header->cmsg_level && IPV6_RECVERR == header->cmsg_type);
+                if (false == is_error)
+                    continue;
+                sock_extended_err error;
+                std::memcpy(&error, CMSG_DATA(header), sizeof(error));
+                if (SO_EE_ORIGIN_ZEROCOPY != error.ee_origin)
+                    continue;
+                done = error.ee_data + 1;
+                completed = true;
+            }
+        }
+    }
+#endif
+
+#ifdef __linux__
+    // Sends a DATA frame (after whatever `out` holds) whose payload is `size` bytes of
+    // `file` from `offset`, with sendfile. Returns how many came from the file: should
+    // it have shrunk the frame is filled up with zeros, which the CLOSE cuts off again.
+    static size_t send_file_data(connection_t& current, ReplicaProtocol::writer_t& out, uint32_t id, int file, uint64_t offset, size_t size,
+        std::filesystem::path const& path)
+    {
+        out.begin(message_t::DATA, id).u64(offset).end(size);
+        std::lock_guard<std::mutex> lock(current.send_mtx);
+        ReplicaProtocol::send_all(current.fd, out.data(), {}, MSG_MORE);
+        size_t done = 0;
+        int error = 0;
+        while (done < size)
+        {
+            off_t position = static_cast<off_t>(offset + done);
+            ssize_t const n = ::sendfile(current.fd, file, &position, size - done);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n <= 0)
+            {
+                error = n < 0 ? errno : 0;
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        // sendfile() fails alike for the file and the socket; the read tells which it was.
+        bool const fallback = 0 != error;
+        error = 0;
+        std::vector<char> buffer;
+        while (fallback && done < size)
+        {
+            buffer.resize(std::min<size_t>(size - done, CopyEngine::chunk_size));
+            ssize_t const n = ::pread(file, buffer.data(), buffer.size(), static_cast<off_t>(offset + done));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+                error = errno;
+            if (n <= 0)
+                break;
+            ReplicaProtocol::send_all(current.fd, { buffer.data(), static_cast<size_t>(n) });
+            done += static_cast<size_t>(n);
+        }
+        size_t const from_file = done;
+        buffer.assign(std::min<size_t>(size - done, CopyEngine::chunk_size), 0);
+        for (; done < size; done += buffer.size())
+        {
+            buffer.resize(std::min(buffer.size(), size - done));
+            ReplicaProtocol::send_all(current.fd, buffer);
+        }
+        if (0 != error)
+            throw std::filesystem::filesystem_error("Can't read source file", path, std::error_code(error, std::generic_category()));
+        return from_file;
+    }
+#endif
+
+    static size_t read_at(int fd, std::vector<char>& buffer, uint64_t offset, std::filesystem::path const& path)
+    {
+        size_t done = 0;
+        while (done < buffer.size())
+        {
+            ssize_t const n = ::pread(fd, buffer.data() + done, buffer.size() - done, static_cast<off_t>(offset + done));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+                throw std::filesystem::filesystem_error("Can't read source file", path, std::error_code(errno, std::generic_category()));
+            if (0 == n)
+                break;
+            done += static_cast<size_t>(n);
+        }
+        return done;
+    }
+#else
+public:
+
+    struct pending_t
+    {
+    };
+
+    explicit RemoteReplica(std::string const&, bool = true, Compressor::settings_t const& = {})
+    {
+        throw std::runtime_error("Network replicas are only supported on POSIX systems");
+    }
+
+    uint64_t get_bytes_sent(void) const { return 0; }
+    std::vector<stat_t> stat(std::vector<std::filesystem::path> const&) { return {}; }
+    std::vector<signature_t> signatures(std::vector<std::filesystem::path> const&) { return {}; }
+    pending_t post_make_directory(std::filesystem::path const&) { return {}; }
+    pending_t post_remove_file(std::filesystem::path const&) { return {}; }
+    pending_t post_remove_tree(std::filesystem::path const&, bool) { return {}; }
+    pending_t post_file(std::filesystem::path const&, std::filesystem::path const&, CopyEngine&, signature_t const* = nullptr) { return {}; }
+    void wait(pending_t const&) {}
+    void wait_all(std::vector<pending_t> const&) {}
+    void make_directory(std::filesystem::path const&) {}
+    void remove_file(std::filesystem::path const&) {}
+    void remove_tree(std::filesystem::path const&, bool) {}
+    bool rename(std::filesystem::path const&, std::filesystem::path const&) { return false; }
+    void send_file(std::filesystem::path const&, std::filesystem::path const&, CopyEngine&, bool) {}
+#endif
+};
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <system_error>
+#include <cstdint>
+#include <cstring>
+#include "Logger.h"
+#include "Sha256.h"
+#include "DirHandleCache.h"
+#include "DeleteEngine.h"
+#include "ReplicaProtocol.h"
+#include "Compressor.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#endif
+
+
+// Serves a replica folder to RemoteReplica clients (see ReplicaProtocol.h). Every
+// connection has a thread of its own that applies its requests in order through the
+// same DirHandleCache and DeleteEngine a local job uses; replies are batched until the
+// thread runs out of buffered requests. On Linux large DATA payloads are spliced from
+// the socket into the file without passing through user space, unless zero_copy is
+// off. Clients may send data zstd-compressed when the agent was built with zstd.
+// There is no authentication, the agent should only listen on a trusted network.
+class ReplicaAgent final
+{
+#ifndef _WIN32
+    using message_t = ReplicaProtocol::message_t;
+    using kind_t = ReplicaProtocol::kind_t;
+
+    // File of an OPEN whose CLOSE hasn't arrived yet. The first error sticks and is
+    // reported by the CLOSE.
+    struct stream_t
+    {
+        int fd = -1;
+        std::filesystem::path relative;
+        int error = 0;
+        std::string what;
+    };
+
+    struct connection_t
+    {
+        int fd;
+        std::thread thread;
+        bool done = false;
+    };
+
+    // DATA frames at least this large are spliced; the reader asks for little more
+    // than a header at a time then, so that most of a payload is still in the socket.
+    static constexpr size_t splice_min = 64 << 10;
+    static constexpr size_t splice_read_ahead = 16 << 10;
+
+    DirHandleCache replica;
+    DeleteEngine delete_engine;
+    bool const zero_copy;
+    LogSink* const log_sink = Logger::current_sink();
+    int listen_fd = -1;
+    int wake_pipe[2] = { -1, -1 };
+    std::thread acceptor;
+    std::mutex mtx;
+    std::list<connection_t> connections;
+
+public:
+
+    // Listens on "[address:]port" (loopback without an address, port 0 picks one).
+    ReplicaAgent(std::filesystem::path const& root, std::string const& endpoint, size_t delete_threads = 4, bool zero_copy_ = true)
+        : replica(root)
+        , delete_engine(delete_threads)
+        , zero_copy(zero_copy_)
+    {
+        replica.make_directory({});
+        delete_engine.purge_trash(replica);
+        listen_fd = ReplicaProtocol::listen(endpoint);
+        if (0 != ::pipe2(wake_pipe, O_CLOEXEC))
+        {
+            ::close(listen_fd);
+            throw std::system_error(errno, std::generic_category(), "Can't create agent wake pipe");
+        }
+        acceptor = std::thread(&ReplicaAgent::accept_loop, this);
+    }
+
+    ~ReplicaAgent(void)
+    {
+        char const byte = 0;
+        while (::write(wake_pipe[1], &byte, 1) < 0 && EINTR == errno)
+            ;
+        acceptor.join();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto& connection : connections)
+                ::shutdown(connection.fd, SHUT_RDWR);
+        }
+        for (auto& connection : connections)
+        {
+            connection.thread.join();
+            ::close(connection.fd);
+        }
+        for (int fd : { listen_fd, wake_pipe[0], wake_pipe[1] })
+            ::close(fd);
+    }
+
+    ReplicaAgent(const ReplicaAgent&) = delete;
+
+    ReplicaAgent& operator=(const ReplicaAgent&) = delete;
+
+    uint16_t get_port(void) const
+    {
+        return ReplicaProtocol::local_port(listen_fd);
+    }
+
+private:
+
+    void accept_loop(void)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        while (true)
+        {
+            pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { listen_fd, POLLIN, 0 } };
+            if (::poll(fds, 2, -1) < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Replica agent poll failed: %s", std::strerror(errno));
+                break;
+            }
+            if (fds[0].revents)
+                break;
+            if (0 == (fds[1].revents & POLLIN))
+                continue;
+            int const fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            ReplicaProtocol::set_socket_options(fd);
+
+            std::lock_guard<std::mutex> lock(mtx);
+            // Threads of closed connections are reaped here, so they don't pile up.
+            for (auto it = connections.begin(); it != connections.end();)
+            {
+                if (false == it->done)
+                {
+                    ++it;
+                    continue;
+                }
+                it->thread.join();
+                ::close(it->fd);
+                it = connections.erase(it);
+            }
+            connection_t& connection = connections.emplace_back();
+            connection.fd = fd;
+            connection.thread = std::thread(&ReplicaAgent::serve, this, &connection);
+        }
+    }
+
+    void serve(connection_t* connection)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        std::unordered_map<uint32_t, stream_t> streams;
+        Decompressor decompressor;
+        ReplicaProtocol::writer_t out;
+        auto const flush = [&]()
+        {
+            if (out.empty())
+                return;
+            ReplicaProtocol::send_all(connection->fd, out.data());
+            out.clear();
+        };
+
+        int pipe_fds[2] = { -1, -1 };
+#ifdef __linux__
+        if (zero_copy && 0 == ::pipe2(pipe_fds, O_CLOEXEC))
+            ::fcntl(pipe_fds[1], F_SETPIPE_SZ, 1 << 20);
+#endif
+        try
+        {
+            ReplicaProtocol::frame_reader_t in(connection->fd, pipe_fds[0] >= 0 ? splice_read_ahead : 256 << 10);
+            ReplicaProtocol::header_t header;
+            while (in.next_header(header, flush))
+            {
+#ifdef __linux__
+                if (message_t::DATA == header.type && header.size >= splice_min && pipe_fds[0] >= 0)
+                {
+                    splice_data(in, header, streams, pipe_fds, flush);
+                    continue;
+                }
+#endif
+                handle(header, in.take(header.size, flush), streams, decompressor, out);
+                if (out.data().size() >= (64 << 10))
+                    flush();
+            }
+            flush();
+        }
+        catch (std::exception const& e)
+        {
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Replica connection dropped: %s", e.what());
+        }
+        for (auto& [id, stream] : streams)
+        {
+            if (stream.fd >= 0)
+                ::close(stream.fd);
+        }
+        for (int fd : pipe_fds)
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        connection->done = true;
+    }
+
+    void handle(ReplicaProtocol::header_t const& header, std::span<char const> payload, std::unordered_map<uint32_t, stream_t>& streams,
+        Decompressor& decompressor, ReplicaProtocol::writer_t& out)
+    {
+        ReplicaProtocol::reader_t in(payload);
+        if (message_t::DATA == header.type || message_t::DATA_ZSTD == header.type)
+        {
+            auto const it = streams.find(header.id);
+            if (it == streams.end())
+                throw std::system_error(EPROTO, std::generic_category(), "Data for a stream that isn't open");
+            uint64_t const offset = in.u64();
+            if (message_t::DATA == header.type)
+            {
+                write_data(it->second, offset, in.rest());
+                return;
+            }
+            uint32_t const size = in.u32();
+            if (size > ReplicaProtocol::max_payload)
+                throw std::system_error(EPROTO, std::generic_category(), "Compressed data too large");
+            if (0 != it->second.error)
+                return;
+            try
+            {
+                write_data(it->second, offset, decompressor.decompress(in.rest(), size));
+            }
+            catch (std::system_error const& e)
+            {
+                fail(it->second, e.code().value(), e.what());
+            }
+            return;
+        }
+        if (message_t::OPEN == header.type)
+        {
+            stream_t& stream = streams[header.id];
+            try
+            {
+                stream.relative = in.path();
+                mode_t const mode = static_cast<mode_t>(in.u32() & 07777);
+                bool const truncate = 0 != in.u8();
+                stream.fd = replica.open_file(stream.relative, O_WRONLY | O_CREAT | O_NOFOLLOW | (truncate ? O_TRUNC : 0), mode);
+                if (stream.fd < 0)
+                    fail(stream, errno, "Can't open replica file");
+            }
+            catch (std::system_error const& e)
+            {
+                fail(stream, e.code().value(), e.what());
+            }
+            return;
+        }
+
+        int error = 0;
+        std::string what;
+        try
+        {
+            switch (header.type)
+            {
+            case message_t::HELLO:
+            {
+                if (ReplicaProtocol::version != in.u32())
+                    throw std::system_error(EPROTONOSUPPORT, std::generic_category(), "Unsupported replica protocol version");
+                uint32_t const supported = ReplicaProtocol::feature_mtime | (Compressor::available ? ReplicaProtocol::feature_zstd : 0);
+                out.begin(message_t::HELLO_REPLY, header.id).u32(in.u32() & supported).end();
+                return;
+            }
+            case message_t::STAT:
+                reply_stat(header.id, in, out);
+                return;
+            case message_t::MKDIR:
+                replica.make_directory(in.path());
+                break;
+            case message_t::UNLINK:
+                replica.remove_file(non_root(in.path()));
+                break;
+            case message_t::RMTREE:
+            {
+                std::filesystem::path const relative = non_root(in.path());
+                if (0 != in.u8())
+                    delete_engine.defer_remove_tree(replica, relative);
+                else
+                    delete_engine.remove_tree(replica, relative);
+                break;
+            }
+            case message_t::RENAME:
+            {
+                std::filesystem::path const from = non_root(in.path());
+                std::filesystem::path const to = non_root(in.path());
+                if (false == replica.rename(from, to))
+                    throw std::system_error(ENOENT, std::generic_category(), "Rename source doesn't exist");
+                break;
+            }
+            case message_t::SIGNATURE:
+                reply_signature(header.id, in, out);
+                return;
+            case message_t::CLOSE:
+            {
+                auto const it = streams.find(header.id);
+                if (it == streams.end())
+                    throw std::system_error(EPROTO, std::generic_category(), "Close of a stream that isn't open");
+                stream_t stream = std::move(it->second);
+                streams.erase(it);
+                uint64_t const size = in.u64();
+                bool const has_mtime = false == in.at_end();
+                int64_t const mtime_ns = has_mtime ? in.i64() : 0;
+                if (stream.fd >= 0)
+                {
+                    if (0 == stream.error && 0 != ::ftruncate(stream.fd, static_cast<off_t>(size)))
+                        fail(stream, errno, "Can't truncate replica file");
+                    timespec const times[2] = { { 0, UTIME_OMIT }, FileInfo::to_timespec(mtime_ns) };
+                    if (0 == stream.error && has_mtime && 0 != ::futimens(stream.fd, times))
+                        fail(stream, errno, "Can't set replica file time");
+                    if (0 != ::close(stream.fd))
+                        fail(stream, errno, "Can't close replica file");
+                }
+                if (0 != stream.error)
+                    throw std::filesystem::filesystem_error(stream.what, replica.full_path(stream.relative), std::error_code(stream.error, std::generic_category()));
+                break;
+            }
+            default:
+                throw std::system_error(EPROTO, std::generic_category(), "Unknown replica protocol message");
+            }
+        }
+        catch (std::system_error const& e)
+        {
+            error = e.code().value();
+            what = e.what();
+        }
+        out.begin(message_t::STATUS, header.id).i32(error).string(what).end();
+    }
+
+#ifdef __linux__
+    template<typename F>
+    static void splice_data(ReplicaProtocol::frame_reader_t& in, ReplicaProtocol::header_t const& header, std::unordered_map<uint32_t, stream_t>& streams,
+        int const pipe_fds[2], F const& before_wait)
+    {
+        auto const it = streams.find(header.id);
+        if (it == streams.end())
+            throw std::system_error(EPROTO, std::generic_category(), "Data for a stream that isn't open");
+        stream_t& stream = it->second;
+        uint64_t const offset = ReplicaProtocol::reader_t(in.take(8, before_wait)).u64();
+        int const error = in.splice_rest(0 == stream.error ? stream.fd : -1, offset, pipe_fds, before_wait);
+        if (0 != error)
+            fail(stream, error, "Can't write replica file");
+    }
+#endif
+
+    void reply_stat(uint32_t id, ReplicaProtocol::reader_t& in, ReplicaProtocol::writer_t& out)
+    {
+        uint32_t const count = in.u32();
+        std::vector<std::filesystem::path> paths;
+        for (uint32_t i = 0; i < count; ++i)
+            paths.push_back(in.path());
+        out.begin(message_t::STAT_REPLY, id).u32(count);
+        for (auto const& relative : paths)
+        {
+            struct stat st;
+            kind_t kind = kind_t::MISSING;
+            if (0 == ::lstat(replica.full_path(relative).c_str(), &st))
+                kind = S_ISREG(st.st_mode) ? kind_t::REGULAR : S_ISDIR(st.st_mode) ? kind_t::DIRECTORY : kind_t::OTHER;
+            else
+                st = {};
+            out.u8(static_cast<uint8_t>(kind)).u64(static_cast<uint64_t>(st.st_size))
+                .i64(static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec);
+        }
+        out.end();
+    }
+
+    void reply_signature(uint32_t id, ReplicaProtocol::reader_t& in, ReplicaProtocol::writer_t& out)
+    {
+        std::filesystem::path const relative = non_root(in.path());
+        uint64_t block_size = std::max<uint32_t>(4096, in.u32());
+        std::vector<Sha256::digest_t> digests;
+        uint64_t size = 0;
+        int const fd = ::open(replica.full_path(relative).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && 0 == ::fstat(fd, &st) && S_ISREG(st.st_mode))
+        {
+            size = static_cast<uint64_t>(st.st_size);
+            while ((size + block_size - 1) / block_size > ReplicaProtocol::max_signature_blocks)
+                block_size *= 2;
+            std::vector<char> buffer(block_size);
+            for (uint64_t offset = 0; offset < size; offset += block_size)
+            {
+                ssize_t const n = ::pread(fd, buffer.data(), block_size, static_cast<off_t>(offset));
+                if (n <= 0)
+                {
+                    // Shrunk while being read, what is left can't be reused.
+                    size = offset;
+                    break;
+                }
+                digests.push_back(Sha256::hash(buffer.data(), static_cast<size_t>(n)));
+            }
+        }
+        if (fd >= 0)
+            ::close(fd);
+
+        out.begin(message_t::SIGNATURE_REPLY, id).u64(size).u32(static_cast<uint32_t>(block_size)).u32(static_cast<uint32_t>(digests.size()));
+        for (auto const& digest : digests)
+            out.bytes(digest.data(), digest.size());
+        out.end();
+    }
+
+    static void write_data(stream_t& stream, uint64_t offset, std::span<char const> data)
+    {
+        if (0 != stream.error)
+            return;
+        for (size_t done = 0; done < data.size();)
+        {
+            ssize_t const n = ::pwrite(stream.fd, data.data() + done, data.size() - done, static_cast<off_t>(offset + done));
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+            {
+                fail(stream, errno, "Can't write replica file");
+                return;
+            }
+            done += static_cast<size_t>(n);
+        }
+    }
+
+    static void fail(stream_t& stream, int error, std::string what)
+    {
+        if (0 != stream.error)
+            return;
+        stream.error = error;
+        stream.what = std::move(what);
+    }
+
+    static std::filesystem::path non_root(std::filesystem::path relative)
+    {
+        if (relative.empty())
+            throw std::system_error(EINVAL, std::generic_category(), "Operation on the replica root");
+        return relative;
+    }
+#else
+public:
+
+    ReplicaAgent(std::filesystem::path const&, std::string const&, size_t = 4, bool = true)
+    {
+        throw std::runtime_error("The replica agent is only supported on POSIX systems");
+    }
+
+    uint16_t get_port(void) const
+    {
+        return 0;
+    }
+#endif
+};
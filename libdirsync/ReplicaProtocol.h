@@ -0,0 +1,571 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+
+// Binary protocol between a RemoteReplica and a ReplicaAgent over TCP. Every message
+// is a frame of a 9-byte header (payload size u32, type u8, request id u32, all little
+// endian) and the payload. The agent handles the frames of a connection strictly in
+// the order they arrive, so a client can send any number of requests before it waits
+// for the first reply; replies carry the id of their request. Paths are relative to
+// the replica root, '/'-separated, and must not leave it.
+//
+//   HELLO       u32 version, u32 features                -> HELLO_REPLY u32 features both ends support
+//   STAT        u32 count, count * path                  -> STAT_REPLY count * (u8 kind, u64 size, i64 mtime_ns)
+//   MKDIR       path                                     -> STATUS
+//   UNLINK      path                                     -> STATUS
+//   RMTREE      path, u8 deferred                        -> STATUS
+//   RENAME      path from, path to                       -> STATUS, ENOENT if from doesn't exist
+//   SIGNATURE   path, u32 block size                     -> SIGNATURE_REPLY u64 size, u32 block size, u32 count, count * SHA-256
+//   OPEN        path, u32 mode, u8 truncate              (no reply, opens the stream with this id)
+//   DATA        u64 offset, bytes                        (no reply, id of the OPEN)
+//   DATA_ZSTD   u64 offset, u32 size, zstd frame         (no reply, id of the OPEN, needs feature_zstd)
+//   CLOSE       u64 size[, i64 mtime_ns]                 -> STATUS of the whole stream, id of the OPEN
+//
+// A path is a u32 length followed by that many bytes. STATUS is an i32 errno value (0
+// on success) and a message. SIGNATURE_REPLY may use larger blocks than requested to
+// keep the reply small; a missing file has size 0 and no blocks. A DATA_ZSTD frame
+// unpacks to `size` bytes to be written at `offset`. With feature_mtime the agent gives
+// the file the mtime a CLOSE carries; a client only sends one after a complete stream.
+namespace ReplicaProtocol
+{
+    constexpr uint32_t version = 2;
+    constexpr uint32_t feature_zstd = 1;
+    constexpr uint32_t feature_mtime = 2;
+    constexpr size_t header_size = 9;
+    constexpr uint32_t max_payload = 16 << 20;
+    constexpr uint32_t max_signature_blocks = 1 << 18;
+
+    enum class message_t : uint8_t
+    {
+        HELLO = 1, STAT, MKDIR, UNLINK, RMTREE, RENAME, SIGNATURE, OPEN, DATA, CLOSE, DATA_ZSTD,
+        STATUS = 64, STAT_REPLY, SIGNATURE_REPLY, HELLO_REPLY
+    };
+
+    enum class kind_t : uint8_t { MISSING, REGULAR, DIRECTORY, OTHER };
+
+    // Builds frames into one buffer, so that several of them go out with one send.
+    class writer_t
+    {
+        std::vector<char> buffer;
+        size_t frame_start = 0;
+
+    public:
+
+        writer_t& begin(message_t type, uint32_t id)
+        {
+            frame_start = buffer.size();
+            buffer.resize(frame_start + header_size);
+            buffer[frame_start + 4] = static_cast<char>(type);
+            store(frame_start + 5, id, 4);
+            return *this;
+        }
+
+        // Fills in the payload size of the frame begun last; `trailing` bytes of it are
+        // sent separately right after the buffer.
+        writer_t& end(size_t trailing = 0)
+        {
+            size_t const size = buffer.size() - frame_start - header_size + trailing;
+            if (size > max_payload)
+                throw std::length_error("Replica protocol frame too large");
+            store(frame_start, size, 4);
+            return *this;
+        }
+
+        writer_t& u8(uint8_t value)
+        {
+            buffer.push_back(static_cast<char>(value));
+            return *this;
+        }
+
+        writer_t& u32(uint32_t value)
+        {
+            buffer.resize(buffer.size() + 4);
+            store(buffer.size() - 4, value, 4);
+            return *this;
+        }
+
+        writer_t& u64(uint64_t value)
+        {
+            buffer.resize(buffer.size() + 8);
+            store(buffer.size() - 8, value, 8);
+            return *this;
+        }
+
+        writer_t& i32(int32_t value)
+        {
+            return u32(static_cast<uint32_t>(value));
+        }
+
+        writer_t& i64(int64_t value)
+        {
+            return u64(static_cast<uint64_t>(value));
+        }
+
+        writer_t& bytes(void const* data, size_t size)
+        {
+            buffer.insert(buffer.end(), static_cast<char const*>(data), static_cast<char const*>(data) + size);
+            return *this;
+        }
+
+        writer_t& string(std::string const& value)
+        {
+            u32(static_cast<uint32_t>(value.size()));
+            return bytes(value.data(), value.size());
+        }
+
+        writer_t& path(std::filesystem::path const& relative)
+        {
+            return string(relative.generic_string());
+        }
+
+        std::vector<char> const& data(void) const
+        {
+            return buffer;
+        }
+
+        bool empty(void) const
+        {
+            return buffer.empty();
+        }
+
+        void clear(void)
+        {
+            buffer.clear();
+            frame_start = 0;
+        }
+
+    private:
+
+        void store(size_t at, uint64_t value, int size)
+        {
+            for (int i = 0; i < size; ++i)
+                buffer[at + static_cast<size_t>(i)] = static_cast<char>(value >> (8 * i));
+        }
+    };
+
+    // Decodes a payload; running past its end throws.
+    class reader_t
+    {
+        std::span<char const> data;
+        size_t pos = 0;
+
+    public:
+
+        explicit reader_t(std::span<char const> data_)
+            : data(data_)
+        {
+        }
+
+        uint8_t u8(void)
+        {
+            return static_cast<uint8_t>(take(1)[0]);
+        }
+
+        uint32_t u32(void)
+        {
+            return static_cast<uint32_t>(load(take(4), 4));
+        }
+
+        uint64_t u64(void)
+        {
+            return load(take(8), 8);
+        }
+
+        int32_t i32(void)
+        {
+            return static_cast<int32_t>(u32());
+        }
+
+        int64_t i64(void)
+        {
+            return static_cast<int64_t>(u64());
+        }
+
+        std::span<char const> bytes(size_t size)
+        {
+            return { take(size), size };
+        }
+
+        bool at_end(void) const
+        {
+            return pos == data.size();
+        }
+
+        std::span<char const> rest(void)
+        {
+            return bytes(data.size() - pos);
+        }
+
+        std::string string(void)
+        {
+            uint32_t const size = u32();
+            auto const value = bytes(size);
+            return std::string(value.data(), value.size());
+        }
+
+        // A relative path that stays below the replica root; anything else throws
+        // EINVAL, so that a client can't reach outside of the replica.
+        std::filesystem::path path(void)
+        {
+            std::filesystem::path const relative = std::filesystem::path(string()).lexically_normal();
+            if (relative.has_root_path())
+                throw std::system_error(EINVAL, std::generic_category(), "Absolute path in replica request");
+            std::filesystem::path result;
+            for (auto const& element : relative)
+            {
+                if (".." == element)
+                    throw std::system_error(EINVAL, std::generic_category(), "Path outside of the replica in request");
+                if (false == element.empty() && "." != element)
+                    result /= element;
+            }
+            return result;
+        }
+
+    private:
+
+        char const* take(size_t size)
+        {
+            if (size > data.size() - pos)
+                throw std::system_error(EPROTO, std::generic_category(), "Truncated replica protocol message");
+            char const* const at = data.data() + pos;
+            pos += size;
+            return at;
+        }
+
+        static uint64_t load(char const* at, int size)
+        {
+            uint64_t value = 0;
+            for (int i = 0; i < size; ++i)
+                value |= static_cast<uint64_t>(static_cast<uint8_t>(at[i])) << (8 * i);
+            return value;
+        }
+    };
+
+    struct header_t
+    {
+        uint32_t size = 0;
+        message_t type = message_t::STATUS;
+        uint32_t id = 0;
+
+        static header_t parse(char const* at)
+        {
+            reader_t in({ at, header_size });
+            header_t header;
+            header.size = in.u32();
+            header.type = static_cast<message_t>(in.u8());
+            header.id = in.u32();
+            return header;
+        }
+    };
+
+#ifndef _WIN32
+    // Buffered frame input of a socket. A frame is either taken whole with next(), or
+    // its header with next_header() and the payload piecewise with take() and, on
+    // Linux, splice_rest(), which moves it into a file without copying it through user
+    // space. Spans stay valid until the next call. read_ahead bounds how much more than
+    // needed one recv() asks for, and thereby how much of a payload ends up buffered.
+    class frame_reader_t
+    {
+        int const fd;
+        size_t const read_ahead;
+        std::vector<char> buffer = std::vector<char>(256 << 10);
+        size_t begin = 0;
+        size_t end = 0;
+        // Payload bytes of the current frame not taken yet.
+        size_t remaining = 0;
+
+    public:
+
+        explicit frame_reader_t(int fd_, size_t read_ahead_ = 256 << 10)
+            : fd(fd_)
+            , read_ahead(read_ahead_)
+        {
+        }
+
+        // Next frame, false once the peer closed the connection between two frames.
+        // `before_wait` runs whenever the data needed isn't buffered and the reader is
+        // about to block, which lets a server flush replies it batched up.
+        template<typename F>
+        bool next(header_t& header, std::span<char const>& payload, F const& before_wait)
+        {
+            if (false == next_header(header, before_wait))
+                return false;
+            payload = take(header.size, before_wait);
+            return true;
+        }
+
+        bool next(header_t& header, std::span<char const>& payload)
+        {
+            return next(header, payload, []() {});
+        }
+
+        template<typename F>
+        bool next_header(header_t& header, F const& before_wait)
+        {
+            if (0 != remaining)
+                throw std::logic_error("Replica frame payload not consumed");
+            if (false == fill(header_size, before_wait))
+                return false;
+            header = header_t::parse(buffer.data() + begin);
+            if (header.size > max_payload)
+                throw std::system_error(EPROTO, std::generic_category(), "Replica protocol frame too large");
+            begin += header_size;
+            remaining = header.size;
+            return true;
+        }
+
+        template<typename F>
+        std::span<char const> take(size_t size, F const& before_wait)
+        {
+            if (size > remaining)
+                throw std::system_error(EPROTO, std::generic_category(), "Truncated replica protocol message");
+            if (false == fill(size, before_wait))
+                throw std::system_error(ECONNRESET, std::generic_category(), "Replica connection closed inside a frame");
+            std::span<char const> const payload{ buffer.data() + begin, size };
+            begin += size;
+            remaining -= size;
+            return payload;
+        }
+
+#ifdef __linux__
+        // Writes the rest of the payload to `file` at `offset`: what is buffered with
+        // pwrite, everything else with splice from the socket through `pipe` into the
+        // file. Once writing fails the rest is read and dropped, so the stream stays in
+        // sync; returns the errno of the failure, 0 on success. A negative `file` drops
+        // the payload right away.
+        template<typename F>
+        int splice_rest(int file, uint64_t offset, int const pipe[2], F const& before_wait)
+        {
+            int error = file < 0 ? EBADF : 0;
+            size_t const buffered = std::min(remaining, end - begin);
+            for (size_t done = 0; done < buffered && 0 == error;)
+            {
+                ssize_t const n = ::pwrite(file, buffer.data() + begin + done, buffered - done, static_cast<off_t>(offset + done));
+                if (n < 0 && EINTR != errno)
+                    error = errno;
+                done += n > 0 ? static_cast<size_t>(n) : 0;
+            }
+            begin += buffered;
+            remaining -= buffered;
+            offset += buffered;
+            if (0 != remaining)
+                before_wait();
+
+            while (0 != remaining && 0 == error)
+            {
+                ssize_t const in = ::splice(fd, nullptr, pipe[1], nullptr, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (in < 0 && EINTR == errno)
+                    continue;
+                if (in < 0)
+                    throw std::system_error(errno, std::generic_category(), "Can't read from replica connection");
+                if (0 == in)
+                    throw std::system_error(ECONNRESET, std::generic_category(), "Replica connection closed inside a frame");
+                remaining -= static_cast<size_t>(in);
+                for (size_t moved = 0; moved < static_cast<size_t>(in);)
+                {
+                    loff_t position = static_cast<loff_t>(offset);
+                    ssize_t const out = 0 == error ? ::splice(pipe[0], nullptr, file, &position, static_cast<size_t>(in) - moved, SPLICE_F_MOVE) : -1;
+                    if (out < 0 && 0 == error && EINTR == errno)
+                        continue;
+                    if (out <= 0 && 0 == error)
+                        error = out < 0 ? errno : EIO;
+                    if (0 != error)
+                    {
+                        // Empty the pipe, or it would hold stale bytes for the next frame.
+                        char scratch[16 << 10];
+                        ssize_t const n = ::read(pipe[0], scratch, std::min(sizeof(scratch), static_cast<size_t>(in) - moved));
+                        if (n <= 0 && EINTR != errno)
+                            throw std::system_error(errno, std::generic_category(), "Can't drain splice pipe");
+                        moved += n > 0 ? static_cast<size_t>(n) : 0;
+                        continue;
+                    }
+                    moved += static_cast<size_t>(out);
+                    offset += static_cast<uint64_t>(out);
+                }
+            }
+            while (0 != remaining)
+                take(std::min(remaining, buffer.size() / 2), before_wait);
+            return error;
+        }
+#endif
+
+    private:
+
+        template<typename F>
+        bool fill(size_t size, F const& before_wait)
+        {
+            if (end - begin >= size)
+                return true;
+            if (buffer.size() - begin < size)
+            {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+                if (buffer.size() < size)
+                    buffer.resize(size);
+            }
+            before_wait();
+            while (end - begin < size)
+            {
+                size_t const wanted = std::min(buffer.size() - end, std::max(size - (end - begin), read_ahead));
+                ssize_t const n = ::recv(fd, buffer.data() + end, wanted, 0);
+                if (n < 0 && EINTR == errno)
+                    continue;
+                if (n < 0)
+                    throw std::system_error(errno, std::generic_category(), "Can't read from replica connection");
+                if (0 == n)
+                {
+                    if (end == begin)
+                        return false;
+                    throw std::system_error(ECONNRESET, std::generic_category(), "Replica connection closed inside a frame");
+                }
+                end += static_cast<size_t>(n);
+            }
+            return true;
+        }
+    };
+
+    // Sends `head` and then `tail` with as few system calls as possible; `flags` are
+    // added to every sendmsg().
+    inline void send_all(int fd, std::span<char const> head, std::span<char const> tail = {}, int flags = 0)
+    {
+        iovec parts[2] = { { const_cast<char*>(head.data()), head.size() }, { const_cast<char*>(tail.data()), tail.size() } };
+        size_t first = 0;
+        while (first < 2)
+        {
+            msghdr message{};
+            message.msg_iov = parts + first;
+            message.msg_iovlen = 2 - first;
+            ssize_t n = ::sendmsg(fd, &message, MSG_NOSIGNAL | flags);
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0)
+                throw std::system_error(errno, std::generic_category(), "Can't write to replica connection");
+            for (; first < 2 && static_cast<size_t>(n) >= parts[first].iov_len; ++first)
+                n -= static_cast<ssize_t>(parts[first].iov_len);
+            if (first < 2)
+            {
+                parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + n;
+                parts[first].iov_len -= static_cast<size_t>(n);
+            }
+        }
+    }
+
+    // Splits "host:port" ("[v6 address]:port" for IPv6); a missing host is empty.
+    inline void split_endpoint(std::string const& endpoint, std::string& host, std::string& port)
+    {
+        size_t const colon = endpoint.rfind(':');
+        host = std::string::npos == colon ? std::string() : endpoint.substr(0, colon);
+        port = std::string::npos == colon ? endpoint : endpoint.substr(colon + 1);
+        if (host.size() >= 2 && '[' == host.front() && ']' == host.back())
+            host = host.substr(1, host.size() - 2);
+        if (port.empty())
+            throw std::runtime_error("No port in replica endpoint " + endpoint);
+    }
+
+    inline void set_socket_options(int fd)
+    {
+        int const one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // Connects to "host:port", trying every address the name resolves to.
+    inline int connect(std::string const& endpoint)
+    {
+        std::string host;
+        std::string port;
+        split_endpoint(endpoint, host, port);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        int const rc = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses);
+        if (0 != rc)
+            throw std::runtime_error("Can't resolve replica endpoint " + endpoint + ": " + ::gai_strerror(rc));
+
+        int error = ECONNREFUSED;
+        int fd = -1;
+        for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next)
+        {
+            fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd >= 0 && 0 != ::connect(fd, address->ai_addr, address->ai_addrlen))
+            {
+                error = errno;
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(addresses);
+        if (fd < 0)
+            throw std::system_error(error, std::generic_category(), "Can't connect to replica agent " + endpoint);
+        set_socket_options(fd);
+        return fd;
+    }
+
+    // Listening socket on "[address:]port"; without an address only loopback is used.
+    // Port 0 picks a free one, see local_port.
+    inline int listen(std::string const& endpoint)
+    {
+        std::string host;
+        std::string port;
+        split_endpoint(endpoint, host, port);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* addresses = nullptr;
+        int const rc = ::getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &addresses);
+        if (0 != rc)
+            throw std::runtime_error("Can't resolve agent address " + endpoint + ": " + ::gai_strerror(rc));
+
+        int error = EADDRNOTAVAIL;
+        int fd = -1;
+        for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next)
+        {
+            fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            int const one = 1;
+            if (fd >= 0 && (0 != ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+                || 0 != ::bind(fd, address->ai_addr, address->ai_addrlen) || 0 != ::listen(fd, 64)))
+            {
+                error = errno;
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(addresses);
+        if (fd < 0)
+            throw std::system_error(error, std::generic_category(), "Can't listen on " + endpoint);
+        return fd;
+    }
+
+    inline uint16_t local_port(int fd)
+    {
+        sockaddr_storage address{};
+        socklen_t size = sizeof(address);
+        if (0 != ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size))
+            return 0;
+        if (AF_INET6 == address.ss_family)
+            return ntohs(reinterpret_cast<sockaddr_in6 const&>(address).sin6_port);
+        return ntohs(reinterpret_cast<sockaddr_in const&>(address).sin_port);
+    }
+#endif
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+// Plain FIPS 180-4 SHA-256. Used where content has to be identified across hosts or
+// runs, so a collision must be out of the question.
+class Sha256
+{
+public:
+
+    using digest_t = std::array<uint8_t, 32>;
+
+private:
+
+    std::array<uint32_t, 8> state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    std::array<uint8_t, 64> block{};
+    size_t block_used = 0;
+    uint64_t total = 0;
+
+public:
+
+    Sha256& update(void const* data, size_t size)
+    {
+        uint8_t const* bytes = static_cast<uint8_t const*>(data);
+        total += size;
+        if (0 != block_used)
+        {
+            size_t const take = std::min(size, block.size() - block_used);
+            std::memcpy(block.data() + block_used, bytes, take);
+            block_used += take;
+            bytes += take;
+            size -= take;
+            if (block.size() != block_used)
+                return *this;
+            compress(block.data());
+            block_used = 0;
+        }
+        for (; size >= block.size(); bytes += block.size(), size -= block.size())
+            compress(bytes);
+        std::memcpy(block.data(), bytes, size);
+        block_used = size;
+        return *this;
+    }
+
+    digest_t finish(void)
+    {
+        uint64_t const bits = total * 8;
+        uint8_t const pad = 0x80;
+        uint8_t const zero = 0;
+        update(&pad, 1);
+        while (56 != block_used)
+            update(&zero, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i)
+            length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        update(length, sizeof(length));
+
+        digest_t digest;
+        for (size_t i = 0; i < state.size(); ++i)
+        {
+            for (size_t j = 0; j < 4; ++j)
+                digest[i * 4 + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+        }
+        return digest;
+    }
+
+    static digest_t hash(void const* data, size_t size)
+    {
+        return Sha256().update(data, size).finish();
+    }
+
+    static std::string to_hex(digest_t const& digest)
+    {
+        static char const digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(digest.size() * 2);
+        for (uint8_t const byte : digest)
+        {
+            hex.push_back(digits[byte >> 4]);
+            hex.push_back(digits[byte & 15]);
+        }
+        return hex;
+    }
+
+private:
+
+    static uint32_t rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(uint8_t const* chunk)
+    {
+        static constexpr uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = static_cast<uint32_t>(chunk[i * 4]) << 24 | static_cast<uint32_t>(chunk[i * 4 + 1]) << 16
+                | static_cast<uint32_t>(chunk[i * 4 + 2]) << 8 | static_cast<uint32_t>(chunk[i * 4 + 3]);
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t const s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t const s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t const s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            uint32_t const ch = (e & f) ^ (~e & g);
+            uint32_t const t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t const s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            uint32_t const maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t const t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+};
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <cstdint>
+#include <cstring>
+#include "Logger.h"
+#include "DirHandleCache.h"
+#include "DeleteEngine.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+
+// Point-in-time versions of a replica. The job syncs into <replica>/current, and after
+// a cycle that changed something, at most once per interval, take() mirrors current
+// into <replica>/snapshots/<UTC time> with every file hard linked, or reflinked where
+// the file system supports that. A snapshot costs directory entries but no data; a
+// file is only stored again once it changes, because CopyEngine replaces replica files
+// that have other links instead of overwriting them. Only the newest `keep` snapshots
+// are kept.
+class SnapshotManager final
+{
+public:
+
+    struct settings_t
+    {
+        // Snapshots to keep, 0 disables them.
+        size_t keep = 0;
+        // Minimum seconds between two snapshots.
+        size_t interval = 3600;
+        // Reflinked files don't share metadata with the replica; falls back to links.
+        bool reflink = false;
+        size_t threads = 4;
+    };
+
+    static std::filesystem::path current_path(std::filesystem::path const& root)
+    {
+        return root / "current";
+    }
+
+#ifndef _WIN32
+private:
+
+    // Directories still to be mirrored, shared by the linking threads.
+    struct walk_t
+    {
+        std::filesystem::path from;
+        std::filesystem::path to;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::filesystem::path> queue;
+        size_t busy = 0;
+        int error = 0;
+        std::filesystem::path error_path;
+        std::atomic<uint64_t> entries{ 0 };
+        std::atomic<uint64_t> reflinked{ 0 };
+    };
+
+    std::filesystem::path const root;
+    settings_t const settings;
+    DeleteEngine& delete_engine;
+    std::atomic<bool> const* cancelled;
+    DirHandleCache snapshots;
+    std::chrono::steady_clock::time_point last_taken;
+    bool taken = false;
+
+public:
+
+    SnapshotManager(std::filesystem::path root_, settings_t const& settings_, DeleteEngine& delete_engine_, std::atomic<bool> const* cancelled_ = nullptr)
+        : root(std::move(root_))
+        , settings(settings_)
+        , delete_engine(delete_engine_)
+        , cancelled(cancelled_)
+        , snapshots(root / "snapshots")
+    {
+        std::filesystem::create_directories(current_path(root));
+        std::filesystem::create_directories(snapshots.get_root());
+        // Leftovers of snapshots interrupted by a crash.
+        for (auto const& entry : std::filesystem::directory_iterator(snapshots.get_root()))
+        {
+            if ('.' == entry.path().filename().string().front())
+                delete_engine.remove_tree(snapshots, entry.path().filename());
+        }
+    }
+
+    SnapshotManager(const SnapshotManager&) = delete;
+
+    SnapshotManager& operator=(const SnapshotManager&) = delete;
+
+    // Names of the complete snapshots, oldest first.
+    std::vector<std::string> list(void) const
+    {
+        std::vector<std::string> names;
+        for (auto const& entry : std::filesystem::directory_iterator(snapshots.get_root()))
+        {
+            std::string name = entry.path().filename().string();
+            if ('.' != name.front() && entry.is_directory())
+                names.push_back(std::move(name));
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    // Takes a snapshot unless the last one is younger than the interval; returns
+    // whether it did.
+    bool take_if_due(void)
+    {
+        auto const now = std::chrono::steady_clock::now();
+        if (taken && now - last_taken < std::chrono::seconds(settings.interval))
+            return false;
+        take();
+        last_taken = now;
+        taken = true;
+        prune();
+        return true;
+    }
+
+    // Mirrors current into a new snapshot and returns its name. The snapshot is built
+    // under a hidden name and renamed into place once complete.
+    std::string take(void)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        std::string name = timestamp();
+        for (int i = 1; std::filesystem::exists(snapshots.full_path(name)); ++i)
+            name = timestamp() + "-" + std::to_string(i);
+        std::string const partial = "." + name + ".partial";
+
+        walk_t walk;
+        walk.from = current_path(root);
+        walk.to = snapshots.full_path(partial);
+        if (0 != ::mkdir(walk.to.c_str(), 0755))
+            throw std::filesystem::filesystem_error("Can't create snapshot", walk.to, std::error_code(errno, std::generic_category()));
+        walk.queue.push_back({});
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < std::max<size_t>(1, settings.threads); ++i)
+            threads.emplace_back(&SnapshotManager::link_loop, this, std::ref(walk), Logger::current_sink());
+        for (auto& thread : threads)
+            thread.join();
+
+        if (0 != walk.error)
+        {
+            delete_engine.remove_tree(snapshots, partial);
+            throw std::filesystem::filesystem_error("Can't create snapshot", walk.error_path, std::error_code(walk.error, std::generic_category()));
+        }
+        snapshots.rename(partial, name);
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Snapshot %s of %s taken: %llu entries (%llu reflinked) in %.3f s", name.c_str(), root.string().c_str(),
+            static_cast<unsigned long long>(walk.entries.load()), static_cast<unsigned long long>(walk.reflinked.load()),
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return name;
+    }
+
+    // Removes all but the newest `keep` snapshots.
+    void prune(void)
+    {
+        std::vector<std::string> const names = list();
+        for (size_t i = 0; i + settings.keep < names.size(); ++i)
+        {
+            delete_engine.remove_tree(snapshots, names[i]);
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Snapshot %s of %s removed", names[i].c_str(), root.string().c_str());
+        }
+    }
+
+private:
+
+    static std::string timestamp(void)
+    {
+        std::time_t const now = std::time(nullptr);
+        std::tm utc;
+        ::gmtime_r(&now, &utc);
+        char buffer[32];
+        std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H%M%SZ", &utc);
+        return buffer;
+    }
+
+    void link_loop(walk_t& walk, LogSink* log_sink)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        std::unique_lock<std::mutex> lock(walk.mtx);
+        while (true)
+        {
+            walk.cv.wait(lock, [&] { return false == walk.queue.empty() || 0 == walk.busy || 0 != walk.error; });
+            if (walk.queue.empty() || 0 != walk.error)
+                break;
+            std::filesystem::path const relative = std::move(walk.queue.front());
+            walk.queue.pop_front();
+            ++walk.busy;
+            lock.unlock();
+
+            std::vector<std::filesystem::path> children;
+            int error = 0;
+            std::filesystem::path error_path;
+            if (cancelled && cancelled->load(std::memory_order_relaxed))
+                error = ECANCELED;
+            else
+                error = link_directory(walk, relative, children, error_path);
+
+            lock.lock();
+            --walk.busy;
+            if (0 != error && 0 == walk.error)
+            {
+                walk.error = error;
+                walk.error_path = error_path;
+            }
+            for (auto& child : children)
+                walk.queue.push_back(std::move(child));
+            walk.cv.notify_all();
+        }
+    }
+
+    // Creates the subdirectories of `relative` in the snapshot and queues them, and
+    // links or reflinks everything else. Returns an errno value.
+    int link_directory(walk_t& walk, std::filesystem::path const& relative, std::vector<std::filesystem::path>& children, std::filesystem::path& error_path)
+    {
+        std::filesystem::path const from = relative.empty() ? walk.from : walk.from / relative;
+        std::filesystem::path const to = relative.empty() ? walk.to : walk.to / relative;
+        int const from_fd = ::open(from.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int const to_fd = ::open(to.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int const list_fd = from_fd >= 0 ? ::dup(from_fd) : -1;
+        DIR* const dir = list_fd >= 0 ? ::fdopendir(list_fd) : nullptr;
+        int error = nullptr == dir || to_fd < 0 ? errno : 0;
+        error_path = from;
+        if (nullptr == dir && list_fd >= 0)
+            ::close(list_fd);
+
+        while (0 == error && dir)
+        {
+            errno = 0;
+            dirent const* const entry = ::readdir(dir);
+            if (nullptr == entry)
+            {
+                error = errno;
+                break;
+            }
+            char const* const name = entry->d_name;
+            if (0 == std::strcmp(name, ".") || 0 == std::strcmp(name, "..") || (relative.empty() && 0 == std::strcmp(name, DeleteEngine::trash_name)))
+                continue;
+            error_path = from / name;
+            walk.entries.fetch_add(1, std::memory_order_relaxed);
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (DT_UNKNOWN == type || DT_DIR == type || (DT_REG == type && settings.reflink))
+            {
+                if (0 != ::fstatat(from_fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                {
+                    // Removed by a concurrent delete, which the next snapshot reflects.
+                    if (ENOENT != errno)
+                        error = errno;
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (DT_DIR == type)
+            {
+                if (0 != ::mkdirat(to_fd, name, st.st_mode & 07777))
+                    error = errno;
+                else
+                    children.push_back(relative / name);
+                continue;
+            }
+            if (DT_REG == type && settings.reflink && reflink(from_fd, to_fd, name, st))
+            {
+                walk.reflinked.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (0 != ::linkat(from_fd, name, to_fd, name, 0) && ENOENT != errno)
+                error = errno;
+        }
+        if (dir)
+            ::closedir(dir);
+        for (int fd : { from_fd, to_fd })
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+        return error;
+    }
+
+    // Clones a file's data into a new inode; false where the file system can't, the
+    // caller links the file then.
+    static bool reflink(int from_dir, int to_dir, char const* name, struct stat const& st)
+    {
+#ifdef FICLONE
+        int const in = ::openat(from_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0)
+            return false;
+        int const out = ::openat(to_dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+        bool cloned = out >= 0 && 0 == ::ioctl(out, FICLONE, in);
+        if (cloned)
+        {
+            timespec const times[2] = { st.st_atim, st.st_mtim };
+            ::futimens(out, times);
+        }
+        if (out >= 0)
+            ::close(out);
+        if (out >= 0 && false == cloned)
+            ::unlinkat(to_dir, name, 0);
+        ::close(in);
+        return cloned;
+#else
+        (void)from_dir;
+        (void)to_dir;
+        (void)name;
+        (void)st;
+        return false;
+#endif
+    }
+#else
+public:
+
+    SnapshotManager(std::filesystem::path const&, settings_t const&, DeleteEngine&, std::atomic<bool> const* = nullptr)
+    {
+        throw std::runtime_error("Snapshots are only supported on POSIX systems");
+    }
+
+    bool take_if_due(void)
+    {
+        return false;
+    }
+#endif
+};
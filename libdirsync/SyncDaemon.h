@@ -0,0 +1,581 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <optional>
+#include <cstdint>
+#include <utility>
+#include <filesystem>
+#include "Logger.h"
+#include "ThreadPool.h"
+#include "Config.h"
+#include "IoScheduler.h"
+#include "CopyEngine.h"
+#include "Metrics.h"
+#include "DirHandleCache.h"
+#include "DeleteEngine.h"
+#include "Journal.h"
+#include "DirWatcher.h"
+#include "DirWatcherCallback.h"
+#include "RemoteReplica.h"
+#include "ChunkStore.h"
+#include "SnapshotManager.h"
+#include "TwoWaySync.h"
+#include "SyncService.h"
+
+
+// Runs any number of DirWatcher jobs on two shared pools: scans go to the scanner
+// pool and file operations to the copy pool through the per-device I/O scheduler. A single scheduler thread keeps the
+// next due time of every job, so an idle job is just an entry in the timer queue.
+// All state is owned by the instance; its threads log to the sink that was current
+// when it was created.
+class SyncDaemon final
+{
+    using clock_t = std::chrono::steady_clock;
+
+    LogSink* const log_sink = Logger::current_sink();
+    MetricsSink* const metrics_sink;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::multimap<clock_t::time_point, size_t> timers;
+    bool stop_flag = false;
+    size_t active_cycles = 0;
+    // Snapshots waiting for their job's transfers or being taken.
+    size_t active_snapshots = 0;
+    std::atomic<bool> cancelled{ false };
+    std::chrono::seconds const shutdown_timeout;
+
+    struct job_t
+    {
+        CopyEngine::throttle_t throttle;
+        JobMetrics metrics;
+        JobMetrics::snapshot_t reported;
+        CopyEngine engine;
+        DirHandleCache replica;
+        // Set when the replica is served by a ReplicaAgent, `replica` is unused then.
+        std::unique_ptr<RemoteReplica> remote;
+        // Set for a deduplicated replica, `replica` is its files/ folder then.
+        std::unique_ptr<ChunkStore> store;
+        // Set when the job keeps snapshots, `replica` is their current/ folder then.
+        std::unique_ptr<SnapshotManager> snapshots;
+        // Guarded by the daemon mutex. Something changed since the last snapshot; a
+        // snapshot is waiting for the transfers of the job, or being taken, and the
+        // cycle that came due meanwhile.
+        bool snapshot_pending = false;
+        bool snapshot_queued = false;
+        bool snapshot_running = false;
+        bool cycle_waiting = false;
+        std::unique_ptr<Journal> journal;
+        DirWatcherCallback callback;
+        DirWatcher watcher;
+        // Set for two-way jobs, which run their cycles through it.
+        std::unique_ptr<TwoWaySync> two_way;
+        // Guarded by the daemon mutex.
+        uint64_t cycles = 0;
+        bool running = false;
+        bool paused = false;
+        // Cycles before this point only rescan the queued subtrees.
+        clock_t::time_point next_full;
+        // A full scan was triggered while a cycle was running; the next cycle is full.
+        bool full_pending = false;
+        std::vector<fs::path> subtrees;
+        // Paused job whose cycle came due; resuming starts it right away.
+        bool parked = false;
+
+        job_t(JobConfig const& config, CopyEngine::throttle_t& global_throttle, DeleteEngine& delete_engine, std::atomic<bool> const* cancelled,
+            ThreadPool& io_pool, size_t job_id)
+            : engine(global_throttle, throttle, metrics, cancelled)
+            , replica(config.dedup ? ChunkStore::files_path(config.replica)
+                : config.snapshots.keep > 0 ? SnapshotManager::current_path(config.replica) : fs::path(config.replica))
+            , remote(RemoteReplica::is_remote(config.replica) ? std::make_unique<RemoteReplica>(config.replica, true, config.compression) : nullptr)
+            , store(config.dedup ? std::make_unique<ChunkStore>(config.replica) : nullptr)
+            , snapshots(config.snapshots.keep > 0 ? std::make_unique<SnapshotManager>(config.replica, config.snapshots, delete_engine, cancelled) : nullptr)
+            , journal(config.journal.empty() ? nullptr : std::make_unique<Journal>(config.journal))
+            , callback(engine, delete_engine, replica, config.deferred_delete, journal.get(), &io_pool, job_id, config.batch_size, remote.get(), store.get())
+            , watcher(config, &callback, metrics, journal.get(), cancelled)
+            , two_way(config.two_way ? std::make_unique<TwoWaySync>(config, watcher, callback, replica, engine, delete_engine, metrics, cancelled) : nullptr)
+        {
+            apply_throttle(throttle, config.throttle);
+            if (journal)
+                watcher.restore(journal->recover());
+        }
+    };
+
+    CopyEngine::throttle_t global_throttle;
+    DeleteEngine delete_engine;
+    std::vector<std::unique_ptr<job_t>> jobs;
+    ThreadPool copy_pool;
+    IoScheduler io_scheduler;
+    ThreadPool scanner_pool;
+    std::thread scheduler;
+
+public:
+
+    SyncDaemon(SyncConfig const& config, MetricsSink* metrics_sink_ = nullptr)
+        : metrics_sink(metrics_sink_)
+        , shutdown_timeout(config.shutdown_timeout)
+        , delete_engine(config.delete_threads)
+        , copy_pool(config.copy_threads)
+        , io_scheduler(copy_pool, config.io_limits)
+        , scanner_pool(config.scanner_threads)
+    {
+        apply_throttle(global_throttle, config.throttle);
+    }
+
+    ~SyncDaemon(void)
+    {
+        stop();
+        if (scheduler.joinable())
+            scheduler.join();
+    }
+
+    SyncDaemon(const SyncDaemon&) = delete;
+
+    SyncDaemon& operator=(const SyncDaemon&) = delete;
+
+    SyncDaemon(SyncDaemon&&) = delete;
+
+    SyncDaemon& operator=(SyncDaemon&&) = delete;
+
+    void add_job(JobConfig const& job)
+    {
+        if (scheduler.joinable())
+            throw std::runtime_error("Jobs must be added before the daemon is started");
+        jobs.push_back(std::make_unique<job_t>(job, global_throttle, delete_engine, &cancelled, copy_pool, jobs.size()));
+        if (job.deferred_delete && nullptr == jobs.back()->remote)
+            delete_engine.purge_trash(jobs.back()->replica);
+    }
+
+    void run(void)
+    {
+        auto const now = clock_t::now();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (size_t id = 0; id < jobs.size(); ++id)
+            {
+                jobs[id]->next_full = now + std::chrono::seconds(jobs[id]->watcher.get_synch_interval());
+                timers.emplace(jobs[id]->next_full, id);
+            }
+        }
+        scheduler = std::thread(&SyncDaemon::scheduler_loop, this);
+    }
+
+    void stop(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop_flag = true;
+        }
+        cv.notify_all();
+    }
+
+    // Moves the next cycle of job `name` to now, or right after the running one. With
+    // a `subtree` (relative to the job source) that cycle only rescans the queued
+    // subtrees, unless a full one is due anyway.
+    bool trigger_scan(std::string const& name, fs::path const& subtree = {})
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (stop_flag || false == scheduler.joinable())
+                return false;
+            size_t const id = find_job(name);
+            if (SIZE_MAX == id)
+                return false;
+            job_t& job = *jobs[id];
+            if (subtree.empty())
+            {
+                job.next_full = clock_t::now();
+                job.full_pending = job.running;
+            }
+            else
+                job.subtrees.push_back(subtree);
+            if (false == job.running)
+                set_timer(id, clock_t::now());
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    // A paused job starts no new cycles, the running one completes. An empty name
+    // applies to every job; false if there is no such job.
+    bool set_paused(std::string const& name, bool paused)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            size_t const only = name.empty() ? SIZE_MAX : find_job(name);
+            if (false == name.empty() && SIZE_MAX == only)
+                return false;
+            for (size_t id = 0; id < jobs.size(); ++id)
+            {
+                if (SIZE_MAX != only && id != only)
+                    continue;
+                job_t& job = *jobs[id];
+                job.paused = paused;
+                if (false == paused && job.parked)
+                {
+                    job.parked = false;
+                    if (false == stop_flag)
+                        set_timer(id, clock_t::now());
+                }
+            }
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    // Replaces the rate limits of job `name`, or the daemon-wide ones for an empty
+    // name, together with their schedules. 0 is unlimited.
+    bool set_throttle(std::string const& name, std::optional<uint64_t> bandwidth, std::optional<uint64_t> iops)
+    {
+        CopyEngine::throttle_t* throttle = &global_throttle;
+        if (false == name.empty())
+        {
+            size_t const id = find_job(name);
+            if (SIZE_MAX == id)
+                return false;
+            throttle = &jobs[id]->throttle;
+        }
+        if (bandwidth)
+        {
+            throttle->bytes.set_schedule({});
+            throttle->bytes.set_rate(*bandwidth);
+        }
+        if (iops)
+        {
+            throttle->ops.set_schedule({});
+            throttle->ops.set_rate(*iops);
+        }
+        return true;
+    }
+
+    // Name of the job with the innermost source containing `path`, empty if there is
+    // none.
+    std::string get_job_for_path(fs::path const& path) const
+    {
+        fs::path relative;
+        size_t const id = find_job_for_path(path, relative);
+        return SIZE_MAX == id ? std::string() : jobs[id]->watcher.get_name();
+    }
+
+    // Rescans `path` and what is below it in the job with the innermost source
+    // containing it; false if there is no such job.
+    bool trigger_scan_path(fs::path const& path)
+    {
+        fs::path relative;
+        size_t const id = find_job_for_path(path, relative);
+        return SIZE_MAX != id && trigger_scan(jobs[id]->watcher.get_name(), relative);
+    }
+
+    std::vector<JobStats> get_stats(void)
+    {
+        std::vector<JobStats> stats;
+        stats.reserve(jobs.size());
+        for (auto const& job : jobs)
+        {
+            JobStats& job_stats = stats.emplace_back(make_stats(*job, job->metrics.snapshot()));
+            std::lock_guard<std::mutex> lock(mtx);
+            job_stats.cycles = job->cycles;
+            job_stats.cycle_running = job->running;
+            job_stats.paused = job->paused;
+        }
+        return stats;
+    }
+
+    // Stops scheduling cycles and gives running cycles and queued transfers
+    // shutdown_timeout to finish. Whatever still runs after that is cancelled at its
+    // next chunk boundary; journaled jobs keep the progress for the next start.
+    void shutdown(void)
+    {
+        auto const start = clock_t::now();
+        stop();
+        if (scheduler.joinable())
+            scheduler.join();
+
+        if (false == wait_drained(start + shutdown_timeout))
+        {
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Shutdown timeout of %lld s expired, cancelling in-flight operations",
+                static_cast<long long>(shutdown_timeout.count()));
+            cancelled = true;
+            if (false == wait_drained(clock_t::now() + shutdown_timeout))
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "In-flight operations didn't stop after cancellation");
+        }
+
+        for (auto const& job : jobs)
+        {
+            if (nullptr == job->journal)
+                continue;
+            try
+            {
+                job->journal->checkpoint();
+            }
+            catch (std::exception const& e)
+            {
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Can't checkpoint the journal of job %s: %s", job->watcher.get_name().c_str(), e.what());
+            }
+        }
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Shut down in %.3f s", std::chrono::duration<double>(clock_t::now() - start).count());
+    }
+
+private:
+
+    static void apply_throttle(CopyEngine::throttle_t& throttle, ThrottleConfig const& config)
+    {
+        throttle.bytes.set_rate(config.bandwidth);
+        throttle.bytes.set_schedule(config.bandwidth_schedule);
+        throttle.ops.set_rate(config.iops);
+        throttle.ops.set_schedule(config.iops_schedule);
+    }
+
+    // Index of job `name`, SIZE_MAX if there is none.
+    size_t find_job(std::string const& name) const
+    {
+        for (size_t id = 0; id < jobs.size(); ++id)
+        {
+            if (jobs[id]->watcher.get_name() == name)
+                return id;
+        }
+        return SIZE_MAX;
+    }
+
+    // Index of the job with the innermost source containing `path`, SIZE_MAX if there
+    // is none; `relative` receives the path relative to that source.
+    size_t find_job_for_path(fs::path const& path, fs::path& relative) const
+    {
+        fs::path const normal = path.lexically_normal();
+        size_t found = SIZE_MAX;
+        size_t depth = 0;
+        for (size_t id = 0; id < jobs.size(); ++id)
+        {
+            fs::path const source = fs::path(jobs[id]->watcher.get_source()).lexically_normal();
+            fs::path const candidate = normal.lexically_relative(source);
+            size_t const source_depth = static_cast<size_t>(std::distance(source.begin(), source.end()));
+            if (false == candidate.empty() && ".." != *candidate.begin() && (SIZE_MAX == found || source_depth > depth))
+            {
+                found = id;
+                depth = source_depth;
+                relative = "." == candidate ? fs::path() : candidate;
+            }
+        }
+        return found;
+    }
+
+    static JobStats make_stats(job_t const& job, JobMetrics::snapshot_t const& counters)
+    {
+        static_assert(std::tuple_size_v<decltype(JobStats::lag_p99_ms)> == IoScheduler::priority_count);
+        JobStats stats;
+        stats.name = job.watcher.get_name();
+        stats.files_copied = counters.files_copied;
+        stats.bytes_copied = counters.bytes_copied;
+        stats.entries_deleted = counters.entries_deleted;
+        stats.throttle_wait_ns = counters.throttle_wait_ns;
+        stats.metadata_updated = counters.metadata_updated;
+        for (size_t priority = 0; priority < IoScheduler::priority_count; ++priority)
+            stats.lag_p99_ms[priority] = job.metrics.lag[priority].percentile_ms(99);
+        return stats;
+    }
+
+    // Returns whether the cycle changed the replica.
+    bool report_cycle(job_t& job)
+    {
+        JobMetrics::snapshot_t const now = job.metrics.snapshot();
+        JobMetrics::snapshot_t const diff = now - job.reported;
+        job.reported = now;
+        if (0 == diff.files_copied && 0 == diff.entries_deleted && 0 == diff.metadata_updated)
+            return false;
+        if (metrics_sink)
+            metrics_sink->cycle_finished(make_stats(job, diff));
+
+        std::string lag;
+        for (size_t priority = 0; priority < IoScheduler::priority_count; ++priority)
+        {
+            if (0 == job.metrics.lag[priority].count())
+                continue;
+            lag += std::string(lag.empty() ? "" : ", ") + IoScheduler::get_priority_str(static_cast<IoScheduler::priority_t>(priority))
+                + " " + std::to_string(job.metrics.lag[priority].percentile_ms(99)) + " ms";
+        }
+        Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Job %s: %llu files (%llu bytes) copied, %llu entries deleted, %llu metadata updates, throttled for %.3f s, p99 replication lag: %s",
+            job.watcher.get_name().c_str(), static_cast<unsigned long long>(diff.files_copied), static_cast<unsigned long long>(diff.bytes_copied),
+            static_cast<unsigned long long>(diff.entries_deleted), static_cast<unsigned long long>(diff.metadata_updated), static_cast<double>(diff.throttle_wait_ns) / 1e9, lag.c_str());
+        if (job.store)
+        {
+            ChunkStore::stats_t const stats = job.store->get_stats();
+            Logger::logf(Logger::severity_t::INFO, __FILE__, __LINE__, "Job %s: dedup ratio %.2f (%llu of %llu bytes stored, %llu of %llu chunks new), chunking at %.0f MiB/s",
+                job.watcher.get_name().c_str(), stats.dedup_ratio(), static_cast<unsigned long long>(stats.stored_bytes),
+                static_cast<unsigned long long>(stats.logical_bytes), static_cast<unsigned long long>(stats.new_chunks), static_cast<unsigned long long>(stats.chunks),
+                stats.chunking_rate() / (1 << 20));
+        }
+        return true;
+    }
+
+    // Snapshots are only taken once no transfer of the job is in flight, since files
+    // are written in place and a snapshot must not link one that is still being
+    // written, and while no cycle of the job runs, which holds back the next one. The
+    // tree walk runs on the scanner pool. A cycle that started first leaves the
+    // snapshot pending for its own end.
+    void queue_snapshot(size_t id)
+    {
+        io_scheduler.when_idle(id, [this, id]()
+        {
+            scanner_pool.submit(id, [this, id]() { take_snapshot(id); });
+        });
+    }
+
+    void take_snapshot(size_t id)
+    {
+        job_t& job = *jobs[id];
+        bool take = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job.snapshot_queued = false;
+            take = job.snapshot_pending && false == job.running && false == cancelled;
+            job.snapshot_running = take;
+        }
+        bool taken = false;
+        if (take)
+        {
+            try
+            {
+                taken = job.snapshots->take_if_due();
+            }
+            catch (std::exception const& e)
+            {
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Job %s: %s", job.watcher.get_name().c_str(), e.what());
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (taken)
+                job.snapshot_pending = false;
+            job.snapshot_running = false;
+            --active_snapshots;
+            if (std::exchange(job.cycle_waiting, false) && false == stop_flag)
+                set_timer(id, clock_t::now());
+        }
+        cv.notify_all();
+    }
+
+    // Waits for running cycles and queued transfers; false if the deadline passed
+    // before they finished.
+    bool wait_drained(clock_t::time_point deadline)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (false == cv.wait_until(lock, deadline, [this] { return 0 == active_cycles && 0 == active_snapshots; }))
+                return false;
+        }
+        return io_scheduler.wait_idle(deadline);
+    }
+
+    // Every job has at most one timer.
+    void set_timer(size_t id, clock_t::time_point due)
+    {
+        auto const timer = std::find_if(timers.begin(), timers.end(), [id](auto const& timer) { return id == timer.second; });
+        if (timers.end() != timer)
+            timers.erase(timer);
+        timers.emplace(due, id);
+    }
+
+    void schedule(size_t id, bool full)
+    {
+        bool const changed = report_cycle(*jobs[id]);
+        bool snapshot = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job_t& job = *jobs[id];
+            auto const now = clock_t::now();
+            if (job.snapshots)
+            {
+                job.snapshot_pending = job.snapshot_pending || changed;
+                snapshot = job.snapshot_pending && false == job.snapshot_queued && false == cancelled;
+                if (snapshot)
+                {
+                    job.snapshot_queued = true;
+                    ++active_snapshots;
+                }
+            }
+            --active_cycles;
+            ++job.cycles;
+            job.running = false;
+            if (std::exchange(job.full_pending, false))
+                job.next_full = now;
+            else if (full)
+                job.next_full = now + std::chrono::seconds(job.watcher.get_synch_interval());
+            if (false == stop_flag)
+                set_timer(id, job.subtrees.empty() ? job.next_full : now);
+        }
+        cv.notify_all();
+        if (snapshot)
+            queue_snapshot(id);
+    }
+
+    void scheduler_loop(void)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        std::unique_lock<std::mutex> lock(mtx);
+        while (false == stop_flag)
+        {
+            if (timers.empty())
+            {
+                cv.wait(lock);
+                continue;
+            }
+
+            auto const due = timers.begin()->first;
+            if (clock_t::now() < due)
+            {
+                cv.wait_until(lock, due);
+                continue;
+            }
+
+            size_t const id = timers.begin()->second;
+            timers.erase(timers.begin());
+            if (jobs[id]->paused)
+            {
+                jobs[id]->parked = true;
+                continue;
+            }
+            if (jobs[id]->snapshot_running)
+            {
+                jobs[id]->cycle_waiting = true;
+                continue;
+            }
+            ++active_cycles;
+            job_t& job = *jobs[id];
+            job.running = true;
+            // A full cycle covers whatever subtrees were queued.
+            bool const full = clock_t::now() >= job.next_full || job.subtrees.empty();
+            std::vector<fs::path> subtrees = std::exchange(job.subtrees, {});
+            if (full)
+                subtrees.clear();
+            scanner_pool.submit(id, [this, id, full, subtrees = std::move(subtrees)]()
+            {
+                if (cancelled)
+                {
+                    schedule(id, full);
+                    return;
+                }
+                try
+                {
+                    // Two-way cycles always scan both sides completely.
+                    if (jobs[id]->two_way)
+                        jobs[id]->two_way->run_cycle(id, io_scheduler, [this, id, full]() { schedule(id, full); });
+                    else
+                        jobs[id]->watcher.run_cycle(id, io_scheduler, [this, id, full]() { schedule(id, full); }, subtrees);
+                }
+                catch (...)
+                {
+                    schedule(id, full);
+                    throw;
+                }
+            });
+        }
+    }
+};
@@ -0,0 +1,92 @@
+#include "SyncService.h"
+#include "SyncDaemon.h"
+#include "ControlServer.h"
+
+
+struct SyncService::impl_t
+{
+    LogSink& log;
+    SyncDaemon daemon;
+    std::string const control_socket;
+    std::unique_ptr<ControlServer> control;
+    bool started = false;
+    bool stopped = false;
+
+    impl_t(SyncConfig const& config, LogSink& log_, MetricsSink* metrics)
+        : log(log_)
+        , daemon(config, metrics)
+        , control_socket(config.control_socket)
+    {
+    }
+};
+
+
+SyncService::SyncService(SyncConfig const& config, LogSink& log, MetricsSink* metrics)
+{
+    // Pools and the delete engine pick up the sink while they are constructed.
+    Logger::scope_t const log_scope(&log);
+    impl = std::make_unique<impl_t>(config, log, metrics);
+    for (auto const& job : config.jobs)
+        impl->daemon.add_job(job);
+}
+
+SyncService::~SyncService(void)
+{
+    stop();
+}
+
+void SyncService::start(void)
+{
+    if (impl->started)
+        throw std::runtime_error("The service has already been started");
+    Logger::scope_t const log_scope(&impl->log);
+    impl->started = true;
+    impl->daemon.run();
+    if (false == impl->control_socket.empty())
+        impl->control = std::make_unique<ControlServer>(*this, impl->control_socket);
+}
+
+void SyncService::stop(void)
+{
+    if (false == impl->started || impl->stopped)
+        return;
+    Logger::scope_t const log_scope(&impl->log);
+    impl->stopped = true;
+    impl->control.reset();
+    impl->daemon.shutdown();
+}
+
+bool SyncService::trigger_scan(std::string const& job, std::string const& subtree)
+{
+    return impl->daemon.trigger_scan(job, subtree);
+}
+
+bool SyncService::trigger_scan_path(std::string const& path)
+{
+    return impl->daemon.trigger_scan_path(path);
+}
+
+std::vector<JobStats> SyncService::query_stats(void) const
+{
+    return impl->daemon.get_stats();
+}
+
+bool SyncService::pause(std::string const& job)
+{
+    return impl->daemon.set_paused(job, true);
+}
+
+bool SyncService::resume(std::string const& job)
+{
+    return impl->daemon.set_paused(job, false);
+}
+
+bool SyncService::set_throttle(std::string const& job, std::optional<uint64_t> bandwidth, std::optional<uint64_t> iops)
+{
+    return impl->daemon.set_throttle(job, bandwidth, iops);
+}
+
+std::string SyncService::get_job_for_path(std::string const& path) const
+{
+    return impl->daemon.get_job_for_path(path);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "Logger.h"
+
+struct SyncConfig;
+
+
+// Counters of one job. In JobStats returned by SyncService::query_stats they are
+// totals since the service was created, in the ones handed to MetricsSink they are
+// what the cycle that just finished did. lag_p99_ms covers the last one to two
+// minutes, measured from when a scan detected each change, one entry per priority
+// class (high, normal, bulk), 0 while nothing of that class was applied meanwhile.
+struct JobStats
+{
+    std::string name;
+    uint64_t files_copied = 0;
+    uint64_t bytes_copied = 0;
+    uint64_t entries_deleted = 0;
+    uint64_t throttle_wait_ns = 0;
+    uint64_t metadata_updated = 0;
+    std::array<uint64_t, 3> lag_p99_ms{};
+    uint64_t cycles = 0;
+    bool cycle_running = false;
+    bool paused = false;
+};
+
+
+// Receives the statistics of every finished cycle that copied, deleted or updated something.
+// Called on library threads, implementations must be thread-safe.
+class MetricsSink
+{
+public:
+
+    virtual ~MetricsSink(void) = default;
+
+    virtual void cycle_finished(JobStats const& cycle) = 0;
+};
+
+
+// In-process synchronization of the jobs of a SyncConfig. Every service owns its
+// thread pools, throttles and journals, so several services can run side by side;
+// all of their threads log to `log`. With control_socket set in the config a running
+// service also accepts commands on that Unix domain socket (see ControlServer.h).
+// Only this header and Logger.h are needed to use it, the engine behind it lives in
+// the libdirsync library.
+class SyncService final
+{
+    struct impl_t;
+    std::unique_ptr<impl_t> impl;
+
+public:
+
+    // Opens the replicas and journals of every job; throws if one of them can't be.
+    SyncService(SyncConfig const& config, LogSink& log, MetricsSink* metrics = nullptr);
+
+    // Stops the service like stop() if it is still running.
+    ~SyncService(void);
+
+    SyncService(const SyncService&) = delete;
+
+    SyncService& operator=(const SyncService&) = delete;
+
+    // Schedules the first cycle of every job one interval from now.
+    void start(void);
+
+    // Stops scheduling cycles, lets running ones and queued transfers finish within
+    // the configured shutdown_timeout and cancels the rest. Returns once everything
+    // stopped; the service can't be started again.
+    void stop(void);
+
+    // Runs a cycle of `job` as soon as possible instead of waiting for its interval;
+    // a cycle that is running already is followed by another one right away. With a
+    // `subtree` (relative to the job source) that cycle only rescans the subtrees
+    // queued so far and leaves the rest of the job state alone. False if there is no
+    // such job or the service isn't running.
+    bool trigger_scan(std::string const& job, std::string const& subtree = {});
+
+    // Same for the subtree below `path`, in the job with the innermost source folder
+    // containing it.
+    bool trigger_scan_path(std::string const& path);
+
+    // A paused job starts no new cycles until it is resumed; the running cycle
+    // completes. An empty name applies to every job. False if there is no such job.
+    bool pause(std::string const& job = {});
+
+    bool resume(std::string const& job = {});
+
+    // Replaces the bandwidth (bytes/s) and/or IOPS limit of `job`, or the service-wide
+    // ones for an empty name, including their time-of-day schedules. 0 is unlimited.
+    bool set_throttle(std::string const& job, std::optional<uint64_t> bandwidth, std::optional<uint64_t> iops);
+
+    // Name of the job whose source folder contains `path`, empty if there is none.
+    std::string get_job_for_path(std::string const& path) const;
+
+    std::vector<JobStats> query_stats(void) const;
+};
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include "ThreadPool.h"
+
+
+template<typename T>
+struct TaskResult
+{
+    std::optional<T> value;
+
+    void return_value(T value_)
+    {
+        value = std::move(value_);
+    }
+
+    T take(void)
+    {
+        return std::move(*value);
+    }
+};
+
+template<>
+struct TaskResult<void>
+{
+    void return_void(void)
+    {
+    }
+
+    void take(void)
+    {
+    }
+};
+
+
+// Lazily started coroutine producing a T. Awaiting a task starts it and resumes the
+// awaiter right after it finishes, on whatever thread that happens; exceptions are
+// rethrown in the awaiter. start() runs a task without an awaiting coroutine.
+//
+// Coroutines never block a thread while they wait: offload() hands blocking work to a
+// ThreadPool and resumes the coroutine on the pool thread that ran it, when_all()
+// waits for several tasks running concurrently.
+template<typename T = void>
+class Task
+{
+public:
+
+    struct promise_type : TaskResult<T>
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        Task get_return_object(void)
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        struct final_awaiter_t
+        {
+            bool await_ready(void) noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+            {
+                std::coroutine_handle<> const continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume(void) noexcept
+            {
+            }
+        };
+
+        final_awaiter_t final_suspend(void) noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception(void) noexcept
+        {
+            error = std::current_exception();
+        }
+    };
+
+private:
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle_)
+        : handle(handle_)
+    {
+    }
+
+    struct detached_t
+    {
+        struct promise_type
+        {
+            detached_t get_return_object(void)
+            {
+                return {};
+            }
+
+            std::suspend_never initial_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            std::suspend_never final_suspend(void) noexcept
+            {
+                return {};
+            }
+
+            void return_void(void)
+            {
+            }
+
+            void unhandled_exception(void) noexcept
+            {
+                std::terminate();
+            }
+        };
+    };
+
+    static detached_t run_detached(Task task, std::function<void(std::exception_ptr)> on_done)
+    {
+        std::exception_ptr error;
+        try
+        {
+            co_await std::move(task);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        on_done(error);
+    }
+
+public:
+
+    Task(Task&& other) noexcept
+        : handle(std::exchange(other.handle, nullptr))
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+
+    Task& operator=(const Task&) = delete;
+
+    ~Task(void)
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    auto operator co_await(void) && noexcept
+    {
+        struct awaiter_t
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready(void) noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume(void)
+            {
+                if (handle.promise().error)
+                    std::rethrow_exception(handle.promise().error);
+                return handle.promise().take();
+            }
+        };
+        return awaiter_t{ handle };
+    }
+
+    // Runs the task on the calling thread until its first suspension; on_done gets
+    // the exception it finished with, if any.
+    void start(std::function<void(std::exception_ptr)> on_done) &&
+    {
+        run_detached(std::move(*this), std::move(on_done));
+    }
+};
+
+
+// Awaitable running fn() on `pool` (as job `job_id`) and resuming the awaiting
+// coroutine on that pool thread with its result.
+template<typename F>
+auto offload(ThreadPool& pool, size_t job_id, F fn)
+{
+    using result_t = std::invoke_result_t<F&>;
+
+    struct awaiter_t
+    {
+        ThreadPool& pool;
+        size_t job_id;
+        F fn;
+        std::conditional_t<std::is_void_v<result_t>, bool, std::optional<result_t>> result{};
+        std::exception_ptr error{};
+
+        bool await_ready(void) noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            pool.submit(job_id, [this, awaiting]()
+            {
+                try
+                {
+                    if constexpr (std::is_void_v<result_t>)
+                        fn();
+                    else
+                        result.emplace(fn());
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                awaiting.resume();
+            });
+        }
+
+        result_t await_resume(void)
+        {
+            if (error)
+                std::rethrow_exception(error);
+            if constexpr (false == std::is_void_v<result_t>)
+                return std::move(*result);
+        }
+    };
+    return awaiter_t{ pool, job_id, std::move(fn) };
+}
+
+
+// Awaitable starting every task at once and resuming the awaiting coroutine when the
+// last one finished; the first failure is rethrown after all of them finished.
+inline auto when_all(std::vector<Task<void>> tasks)
+{
+    struct state_t
+    {
+        std::atomic<size_t> remaining{ 0 };
+        std::coroutine_handle<> awaiting;
+        std::mutex mtx;
+        std::exception_ptr error;
+    };
+
+    struct awaiter_t
+    {
+        std::vector<Task<void>> tasks;
+        std::shared_ptr<state_t> state = std::make_shared<state_t>();
+
+        bool await_ready(void) noexcept
+        {
+            return tasks.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiting)
+        {
+            state->awaiting = awaiting;
+            // One extra count keeps tasks that finish synchronously from resuming the
+            // awaiting coroutine before every task has been started.
+            state->remaining = tasks.size() + 1;
+            for (auto& task : tasks)
+            {
+                std::move(task).start([state = state](std::exception_ptr error)
+                {
+                    if (error)
+                    {
+                        std::lock_guard<std::mutex> lock(state->mtx);
+                        if (nullptr == state->error)
+                            state->error = error;
+                    }
+                    if (1 == state->remaining.fetch_sub(1))
+                        state->awaiting.resume();
+                });
+            }
+            return 1 != state->remaining.fetch_sub(1);
+        }
+
+        void await_resume(void)
+        {
+            if (state->error)
+                std::rethrow_exception(state->error);
+        }
+    };
+    return awaiter_t{ std::move(tasks) };
+}
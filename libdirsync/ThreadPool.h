@@ -0,0 +1,118 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include "Logger.h"
+
+
+// Worker pool shared between sync jobs. Every job owns its own FIFO and the workers
+// take one task per job in round-robin order, so a job with a huge backlog can't
+// starve the others and a job without pending work costs nothing.
+class ThreadPool
+{
+public:
+
+    using task_t = std::function<void(void)>;
+
+private:
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::unordered_map<size_t, std::deque<task_t>> queues;
+    std::deque<size_t> ready_jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    LogSink* const log_sink = Logger::current_sink();
+
+public:
+
+    // Workers log to the sink that is current on the constructing thread.
+    explicit ThreadPool(size_t threads)
+    {
+        if (0 == threads)
+            throw std::runtime_error("Thread pool must have at least one thread");
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+
+    ~ThreadPool(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ThreadPool(ThreadPool&&) = delete;
+
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    void submit(size_t job_id, task_t task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto& queue = queues[job_id];
+            if (queue.empty())
+                ready_jobs.push_back(job_id);
+            queue.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    size_t size(void) const
+    {
+        return workers.size();
+    }
+
+private:
+
+    void worker_loop(void)
+    {
+        Logger::scope_t const log_scope(log_sink);
+        while (true)
+        {
+            task_t task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return stopping || false == ready_jobs.empty(); });
+                if (ready_jobs.empty())
+                    return;
+
+                size_t const job_id = ready_jobs.front();
+                ready_jobs.pop_front();
+                auto& queue = queues[job_id];
+                task = std::move(queue.front());
+                queue.pop_front();
+                if (false == queue.empty())
+                    ready_jobs.push_back(job_id);
+            }
+
+            try
+            {
+                task();
+            }
+            catch (std::exception const& e)
+            {
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Task failed: %s", e.what());
+            }
+            catch (...)
+            {
+                Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Task failed with an unknown exception");
+            }
+        }
+    }
+};
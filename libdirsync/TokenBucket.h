@@ -0,0 +1,204 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+
+
+// Classic token bucket: tokens refill at `rate` per second up to one second worth of
+// burst. A rate of 0 means unlimited. An optional time-of-day schedule overrides the
+// rate inside its windows, e.g. throttle hard during business hours only.
+class TokenBucket
+{
+public:
+
+    using clock_t = std::chrono::steady_clock;
+
+    struct window_t
+    {
+        int begin_minute = 0;
+        int end_minute = 0;
+        uint64_t rate = 0;
+    };
+
+private:
+
+    std::mutex mtx;
+    uint64_t base_rate;
+    std::vector<window_t> schedule;
+    double tokens = 0;
+    clock_t::time_point last_refill = clock_t::now();
+    // The schedule is looked up at most once a second, not for every chunk.
+    uint64_t scheduled_rate = 0;
+    clock_t::time_point next_lookup;
+
+public:
+
+    explicit TokenBucket(uint64_t rate_ = 0)
+        : base_rate(rate_)
+    {
+        tokens = static_cast<double>(base_rate);
+    }
+
+    TokenBucket(const TokenBucket&) = delete;
+
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    void set_rate(uint64_t rate_)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        base_rate = rate_;
+        next_lookup = {};
+    }
+
+    void set_schedule(std::vector<window_t> schedule_)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        schedule = std::move(schedule_);
+        next_lookup = {};
+    }
+
+    uint64_t get_rate(void)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return current_rate(clock_t::now());
+    }
+
+    // Takes `count` tokens, sleeping as long as needed. Requests larger than the
+    // burst size are split so they still flow at the configured rate. Returns the
+    // time spent waiting.
+    std::chrono::nanoseconds acquire(uint64_t count)
+    {
+        std::chrono::nanoseconds waited{ 0 };
+        while (count > 0)
+        {
+            std::chrono::nanoseconds delay{ 0 };
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto const now = clock_t::now();
+                uint64_t const rate = current_rate(now);
+                if (0 == rate)
+                    return waited;
+
+                refill(rate, now);
+                uint64_t const step = std::min<uint64_t>(count, rate);
+                if (tokens >= static_cast<double>(step))
+                {
+                    tokens -= static_cast<double>(step);
+                    count -= step;
+                    continue;
+                }
+                delay = std::chrono::nanoseconds(static_cast<int64_t>((static_cast<double>(step) - tokens) * 1e9 / static_cast<double>(rate)));
+            }
+            auto const start = clock_t::now();
+            std::this_thread::sleep_for(delay);
+            waited += std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - start);
+        }
+        return waited;
+    }
+
+    // Parses "08:00-18:00=10M, 22:00-06:00=0". Windows may wrap around midnight.
+    static std::vector<window_t> parse_schedule(std::string const& str)
+    {
+        std::vector<window_t> result;
+        size_t pos = 0;
+        while (pos < str.size())
+        {
+            size_t end = str.find(',', pos);
+            if (std::string::npos == end)
+                end = str.size();
+            std::string item = str.substr(pos, end - pos);
+            item.erase(std::remove_if(item.begin(), item.end(), [](unsigned char c) { return std::isspace(c); }), item.end());
+            pos = end + 1;
+            if (item.empty())
+                continue;
+
+            int h1 = 0, m1 = 0, h2 = 0, m2 = 0;
+            char rate_str[32] = {};
+            if (5 != std::sscanf(item.c_str(), "%d:%d-%d:%d=%31s", &h1, &m1, &h2, &m2, rate_str)
+                || h1 < 0 || h1 > 24 || h2 < 0 || h2 > 24 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59)
+                throw std::runtime_error("Invalid schedule window " + item);
+            result.push_back({ h1 * 60 + m1, h2 * 60 + m2, parse_rate(rate_str) });
+        }
+        return result;
+    }
+
+    // Accepts plain numbers and K/M/G suffixes (powers of 1024).
+    static uint64_t parse_rate(std::string const& str)
+    {
+        size_t pos = 0;
+        uint64_t value = 0;
+        try
+        {
+            value = std::stoull(str, &pos);
+        }
+        catch (std::logic_error const&)
+        {
+            throw std::runtime_error("Invalid rate " + str);
+        }
+        std::string const suffix = str.substr(pos);
+        if (suffix.empty())
+            return value;
+        switch (std::toupper(static_cast<unsigned char>(suffix.front())))
+        {
+        case 'K':
+            return value << 10;
+        case 'M':
+            return value << 20;
+        case 'G':
+            return value << 30;
+        default:
+            throw std::runtime_error("Invalid rate " + str);
+        }
+    }
+
+private:
+
+    // Must be called with mtx held.
+    uint64_t current_rate(clock_t::time_point now)
+    {
+        if (schedule.empty())
+            return base_rate;
+        if (now < next_lookup)
+            return scheduled_rate;
+        next_lookup = now + std::chrono::seconds(1);
+
+        std::time_t const time = std::time(nullptr);
+        std::tm local{};
+#ifdef _WIN32
+        ::localtime_s(&local, &time);
+#else
+        ::localtime_r(&time, &local);
+#endif
+        int const minute = local.tm_hour * 60 + local.tm_min;
+        scheduled_rate = base_rate;
+        for (auto const& window : schedule)
+        {
+            bool const inside = window.begin_minute <= window.end_minute
+                ? (minute >= window.begin_minute && minute < window.end_minute)
+                : (minute >= window.begin_minute || minute < window.end_minute);
+            if (inside)
+            {
+                scheduled_rate = window.rate;
+                break;
+            }
+        }
+        return scheduled_rate;
+    }
+
+    // Must be called with mtx held.
+    void refill(uint64_t rate, clock_t::time_point now)
+    {
+        double const elapsed = std::chrono::duration<double>(now - last_refill).count();
+        last_refill = now;
+        tokens = std::min(static_cast<double>(rate), tokens + elapsed * static_cast<double>(rate));
+    }
+};
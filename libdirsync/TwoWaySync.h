@@ -0,0 +1,477 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <ctime>
+#include "Logger.h"
+#include "Config.h"
+#include "IoScheduler.h"
+#include "Metrics.h"
+#include "FileInfo.h"
+#include "CopyEngine.h"
+#include "DeleteEngine.h"
+#include "DirHandleCache.h"
+#include "DirWatcher.h"
+#include "DirWatcherCallback.h"
+
+
+// Two-way synchronization of a job's source and replica. A second DirWatcher watches
+// the replica with the roles swapped, so a cycle scans each side once and the diff
+// engine yields what each side changed since the previous cycle; the two snapshots are
+// the common ancestor. A change only one side made is applied to the other side, whose
+// snapshot then takes in the result so the change doesn't come back. Paths both sides
+// changed are conflicts:
+//  - identical content on both sides counts as in sync,
+//  - otherwise the newer file wins, and the older one stays on its side renamed to
+//    <stem>.conflict-<UTC time><extension>, which the next cycle copies across too,
+//  - a directory wins over a file,
+//  - a deletion loses against any change, the deleted entries are restored,
+//  - a metadata update loses against a change of content,
+//  - a rename that overlaps a change of the other side is applied as a copy and a
+//    deletion, which are then resolved like any other change.
+class TwoWaySync final
+{
+    using action_t = DirWatcherCallbackBase::action_t;
+    using file_t = DirWatcherCallbackBase::file_t;
+    using priority_t = IoScheduler::priority_t;
+    using pending_action_t = DirWatcher::pending_action_t;
+    using plan_t = DirWatcher::plan_t;
+
+    // One side: the watcher scanning it and the callback applying its changes to the
+    // other side.
+    struct side_t
+    {
+        fs::path root;
+        DirWatcher& watcher;
+        DirWatcherCallbackBase& callback;
+        DirHandleCache& files;
+        plan_t plan;
+    };
+
+    std::string const name;
+    std::atomic<bool> const* cancelled;
+    DirHandleCache source_files;
+    DirWatcherCallback reverse_callback;
+    DirWatcher reverse_watcher;
+    std::array<side_t, 2> sides;
+    // Guards the snapshots while copy threads refresh them.
+    std::mutex mtx;
+
+public:
+
+    TwoWaySync(JobConfig const& config, DirWatcher& watcher, DirWatcherCallbackBase& callback, DirHandleCache& replica, CopyEngine& engine,
+        DeleteEngine& delete_engine, JobMetrics& metrics, std::atomic<bool> const* cancelled_ = nullptr)
+        : name(config.name)
+        , cancelled(cancelled_)
+        , source_files(config.source)
+        , reverse_callback(engine, delete_engine, source_files, false)
+        , reverse_watcher(reversed(config), &reverse_callback, metrics, nullptr, cancelled_)
+        , sides{ side_t{ config.source, watcher, callback, source_files, {} }, side_t{ config.replica, reverse_watcher, reverse_callback, replica, {} } }
+    {
+    }
+
+    TwoWaySync(const TwoWaySync&) = delete;
+
+    TwoWaySync& operator=(const TwoWaySync&) = delete;
+
+    // Counterpart of DirWatcher::run_cycle. Everything is applied before on_done runs,
+    // bulk transfers included, since the next scan has to see their results.
+    void run_cycle(size_t job_id, IoScheduler& io_scheduler, std::function<void(void)> on_done)
+    {
+        for (auto& side : sides)
+        {
+            // Either side changes behind our back, so cached directory handles may
+            // point at directories that were removed meanwhile.
+            side.files.invalidate({});
+            side.plan = side.watcher.collect();
+            if (is_cancelled())
+            {
+                on_done();
+                return;
+            }
+        }
+        reconcile();
+
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            for (auto const& action : sides[i].plan.inline_actions)
+                apply(i, action);
+        }
+
+        auto finish = [this, on_done = std::move(on_done)]()
+        {
+            for (size_t i = 0; i < sides.size(); ++i)
+            {
+                for (auto const& action : sides[i].plan.dir_deletes)
+                    apply(i, action);
+            }
+            on_done();
+        };
+
+        size_t const total = sides[0].plan.file_actions.size() + sides[1].plan.file_actions.size();
+        auto shared_finish = std::make_shared<decltype(finish)>(std::move(finish));
+        auto remaining = std::make_shared<std::atomic<size_t>>(total);
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            uint64_t const to_dev = FileInfo::get(sides[1 - i].root).dev;
+            for (auto& action : sides[i].plan.file_actions)
+            {
+                IoScheduler::io_op_t op;
+                op.job_id = job_id;
+                op.priority = action.priority;
+                op.src_dev = action_t::DELETE == action.action ? to_dev : action.info.dev;
+                op.dst_dev = to_dev;
+                op.ino = action.info.ino;
+                op.task = [this, i, action = std::move(action), remaining, shared_finish]()
+                {
+                    apply(i, action);
+                    if (1 == remaining->fetch_sub(1))
+                        (*shared_finish)();
+                };
+                io_scheduler.submit(std::move(op));
+            }
+        }
+        if (0 == total)
+            (*shared_finish)();
+    }
+
+private:
+
+    static JobConfig reversed(JobConfig config)
+    {
+        std::swap(config.source, config.replica);
+        return config;
+    }
+
+    bool is_cancelled(void) const
+    {
+        return cancelled && cancelled->load(std::memory_order_relaxed);
+    }
+
+    static bool is_below(fs::path const& path, fs::path const& dir)
+    {
+        auto const [dir_end, path_it] = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+        return dir_end == dir.end();
+    }
+
+    static std::string timestamp(void)
+    {
+        std::time_t const now = std::time(nullptr);
+        std::tm utc;
+#ifndef _WIN32
+        ::gmtime_r(&now, &utc);
+#else
+        ::gmtime_s(&utc, &now);
+#endif
+        char buffer[32];
+        std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H%M%SZ", &utc);
+        return buffer;
+    }
+
+    // Whether two entries of one type hold the same: the bytes of files, the target of
+    // links. Special files only match by mtime, opening a FIFO would block.
+    static bool same_entry(file_t file, fs::path const& a, fs::path const& b)
+    {
+        if (file_t::SYMLINK == file)
+        {
+            std::error_code ec_a;
+            std::error_code ec_b;
+            return fs::read_symlink(a, ec_a) == fs::read_symlink(b, ec_b) && false == static_cast<bool>(ec_a) && false == static_cast<bool>(ec_b);
+        }
+        if (file_t::REGULAR != file)
+            return false;
+        std::ifstream in_a(a, std::ios::binary);
+        std::ifstream in_b(b, std::ios::binary);
+        std::vector<char> buffer_a(1 << 20);
+        std::vector<char> buffer_b(1 << 20);
+        while (in_a && in_b)
+        {
+            in_a.read(buffer_a.data(), buffer_a.size());
+            in_b.read(buffer_b.data(), buffer_b.size());
+            if (in_a.gcount() != in_b.gcount() || false == std::equal(buffer_a.begin(), buffer_a.begin() + in_a.gcount(), buffer_b.begin()))
+                return false;
+        }
+        return in_a.eof() && in_b.eof();
+    }
+
+    static std::vector<pending_action_t*> all_actions(plan_t& plan)
+    {
+        std::vector<pending_action_t*> actions;
+        for (auto* list : { &plan.inline_actions, &plan.file_actions, &plan.dir_deletes })
+        {
+            for (auto& action : *list)
+                actions.push_back(&action);
+        }
+        return actions;
+    }
+
+    // Marks an action as dropped; it is removed from the plan at the end of reconcile().
+    static void drop(pending_action_t& action)
+    {
+        action.action = action_t::UNEXPECTED_ACTION;
+    }
+
+    // Turns the two plans into one set of changes to apply: renames that overlap the
+    // other side become a copy plus a deletion, and every path both sides touched is
+    // resolved as described above.
+    void reconcile(void)
+    {
+        std::array<std::set<fs::path>, 2> touched;
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            for (pending_action_t const* action : all_actions(sides[i].plan))
+            {
+                touched[i].insert(action->relative);
+                if (false == action->old_relative.empty())
+                    touched[i].insert(action->old_relative);
+            }
+        }
+        auto overlaps = [&touched](size_t other, fs::path const& relative)
+        {
+            auto const below = touched[other].lower_bound(relative);
+            if (below != touched[other].end() && is_below(*below, relative))
+                return true;
+            for (fs::path ancestor = relative.parent_path(); false == ancestor.empty(); ancestor = ancestor.parent_path())
+            {
+                if (touched[other].contains(ancestor))
+                    return true;
+            }
+            return false;
+        };
+        for (size_t i = 0; i < sides.size(); ++i)
+            split_renames(i, [&](fs::path const& relative) { return overlaps(1 - i, relative); });
+
+        // Last action per path of each side; a path can be deleted and then recreated
+        // with another type within one plan.
+        std::array<std::map<fs::path, std::vector<pending_action_t*>>, 2> by_path;
+        std::array<std::vector<fs::path>, 2> deleted_dirs;
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            for (pending_action_t* action : all_actions(sides[i].plan))
+            {
+                by_path[i][action->relative].push_back(action);
+                if (action_t::DELETE == action->action && file_t::DIRECTORY == action->file)
+                    deleted_dirs[i].push_back(action->relative);
+            }
+        }
+
+        // A deleted directory loses against changes below it on the other side, and
+        // deletions below it on the other side are covered by it either way.
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            for (auto const& dir : deleted_dirs[i])
+            {
+                bool changed_below = false;
+                for (auto it = by_path[1 - i].upper_bound(dir); it != by_path[1 - i].end() && is_below(it->first, dir); ++it)
+                {
+                    for (pending_action_t* action : it->second)
+                    {
+                        if (action_t::DELETE == action->action)
+                            drop(*action);
+                        else if (action_t::UNEXPECTED_ACTION != action->action)
+                            changed_below = true;
+                    }
+                }
+                if (changed_below)
+                    restore(i, dir);
+            }
+        }
+
+        for (auto& [relative, actions] : by_path[0])
+        {
+            auto const other = by_path[1].find(relative);
+            if (other == by_path[1].end())
+                continue;
+            resolve(relative, actions, other->second);
+        }
+
+        for (auto& side : sides)
+        {
+            for (auto* list : { &side.plan.inline_actions, &side.plan.file_actions, &side.plan.dir_deletes })
+                std::erase_if(*list, [](pending_action_t const& action) { return action_t::UNEXPECTED_ACTION == action.action; });
+        }
+    }
+
+    // Renames are applied as such unless `overlapping` says the other side touched
+    // either end. A file then becomes a deletion of the old path and a copy of the new
+    // one; a directory becomes a deletion, and its new subtree is forgotten so the next
+    // cycle copies it.
+    void split_renames(size_t i, std::function<bool(fs::path const&)> const& overlapping)
+    {
+        side_t& side = sides[i];
+        std::vector<pending_action_t> split;
+        for (auto& action : side.plan.inline_actions)
+        {
+            if (action_t::RENAME != action.action || (false == overlapping(action.relative) && false == overlapping(action.old_relative)))
+                continue;
+            pending_action_t remove = action;
+            remove.action = action_t::DELETE;
+            remove.relative = action.old_relative;
+            remove.old_relative.clear();
+            if (file_t::DIRECTORY == action.file)
+            {
+                side.plan.dir_deletes.push_back(std::move(remove));
+                side.watcher.forget(action.relative);
+            }
+            else
+            {
+                pending_action_t copy = action;
+                copy.action = action_t::CREATE;
+                copy.old_relative.clear();
+                copy.priority = priority_t::NORMAL;
+                side.plan.file_actions.push_back(std::move(remove));
+                side.plan.file_actions.push_back(std::move(copy));
+            }
+            drop(action);
+        }
+    }
+
+    // Side `i` deleted `relative`, which the other side changed meanwhile: the other
+    // side's snapshot forgets the subtree so the next cycle copies all of it back.
+    void restore(size_t i, fs::path const& relative)
+    {
+        for (pending_action_t* action : all_actions(sides[i].plan))
+        {
+            if (action_t::DELETE == action->action && is_below(action->relative, relative))
+                drop(*action);
+        }
+        sides[1 - i].watcher.forget(relative);
+        Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Job %s: conflict on %s, deleted in %s but changed in %s, restoring it",
+            name.c_str(), relative.generic_string().c_str(), sides[i].root.string().c_str(), sides[1 - i].root.string().c_str());
+    }
+
+    // Both sides changed `relative`; the last action of each side is what it ends as.
+    void resolve(fs::path const& relative, std::vector<pending_action_t*> const& first, std::vector<pending_action_t*> const& second)
+    {
+        std::array<std::vector<pending_action_t*> const*, 2> const actions{ &first, &second };
+        std::array<pending_action_t*, 2> last{};
+        for (size_t i = 0; i < sides.size(); ++i)
+        {
+            for (pending_action_t* action : *actions[i])
+            {
+                if (action_t::UNEXPECTED_ACTION != action->action)
+                    last[i] = action;
+            }
+        }
+        if (nullptr == last[0] || nullptr == last[1])
+            return;
+        auto drop_all = [&actions](size_t i)
+        {
+            for (pending_action_t* action : *actions[i])
+                drop(*action);
+        };
+
+        bool const deleted[2] = { action_t::DELETE == last[0]->action, action_t::DELETE == last[1]->action };
+        if (deleted[0] && deleted[1])
+        {
+            drop_all(0);
+            drop_all(1);
+            return;
+        }
+        if (deleted[0] || deleted[1])
+        {
+            size_t const loser = deleted[0] ? 0 : 1;
+            drop_all(loser);
+            if (file_t::DIRECTORY == last[loser]->file)
+                restore(loser, relative);
+            return;
+        }
+
+        // A metadata update gives way to a change of content on the other side.
+        bool const metadata[2] = { action_t::METADATA == last[0]->action, action_t::METADATA == last[1]->action };
+        if (metadata[0] != metadata[1])
+        {
+            drop_all(metadata[0] ? 0 : 1);
+            return;
+        }
+
+        if (file_t::DIRECTORY == last[0]->file && file_t::DIRECTORY == last[1]->file)
+        {
+            drop_all(0);
+            drop_all(1);
+            return;
+        }
+        if (file_t::DIRECTORY != last[0]->file && last[0]->file == last[1]->file
+            && last[0]->info.size == last[1]->info.size
+            && (last[0]->info.mtime_ns == last[1]->info.mtime_ns || same_entry(last[0]->file, sides[0].root / relative, sides[1].root / relative)))
+        {
+            drop_all(0);
+            drop_all(1);
+            return;
+        }
+
+        // Directories beat files, then the newer file wins; the source wins ties.
+        size_t loser = 1;
+        if (last[0]->file != last[1]->file)
+            loser = file_t::DIRECTORY == last[0]->file ? 1 : 0;
+        else if (last[1]->info.mtime_ns > last[0]->info.mtime_ns)
+            loser = 0;
+        drop_all(loser);
+        std::string const conflict = relative.stem().string() + ".conflict-" + timestamp() + relative.extension().string();
+        fs::path const aside = relative.parent_path() / conflict;
+        try
+        {
+            sides[loser].files.rename(relative, aside);
+            Logger::logf(Logger::severity_t::WARNING, __FILE__, __LINE__, "Job %s: conflict on %s, the version in %s was kept as %s",
+                name.c_str(), relative.generic_string().c_str(), sides[loser].root.string().c_str(), aside.generic_string().c_str());
+        }
+        catch (std::exception const& e)
+        {
+            // The loser stays in place and the winner isn't applied either.
+            drop_all(1 - loser);
+            Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Job %s: can't set aside conflicting %s: %s", name.c_str(), relative.generic_string().c_str(), e.what());
+        }
+    }
+
+    // Applies an action of side `i` to the other side and records the result there.
+    void apply(size_t i, pending_action_t const& action)
+    {
+        if (is_cancelled())
+            return;
+        side_t& from = sides[i];
+        side_t& to = sides[1 - i];
+        std::string const to_root = to.root.string();
+        try
+        {
+            if (action_t::RENAME == action.action)
+            {
+                if (from.callback.report_rename(action.file, action.old_relative, from.root / action.relative, action.relative, to_root))
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    to.watcher.refresh(action.old_relative);
+                    to.watcher.refresh(action.relative);
+                    return;
+                }
+                // Its old path is gone on the other side; the next cycle copies it.
+                std::lock_guard<std::mutex> lock(mtx);
+                from.watcher.forget(action.relative);
+                return;
+            }
+            from.callback.report_action(action.action, action.file, from.root / action.relative, action.relative, to_root);
+        }
+        catch (std::exception const& e)
+        {
+            Logger::logf(Logger::severity_t::ERROR, __FILE__, __LINE__, "Job %s: can't apply %s %s to %s: %s", name.c_str(), action.relative.generic_string().c_str(),
+                DirWatcherCallbackBase::get_action_str(action.action), to_root.c_str(), e.what());
+            // A failed copy is retried by the next cycle.
+            if (action_t::DELETE != action.action)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                from.watcher.forget(action.relative);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        to.watcher.refresh(action.relative);
+    }
+};